@@ -6,7 +6,7 @@
 // @author          Asteski
 // @github          https://github.com/Asteski
 // @include         *
-// @compilerOptions -ldwmapi -luxtheme
+// @compilerOptions -ldwmapi -luxtheme -lcomctl32 -lpsapi
 // ==/WindhawkMod==
 
 // ==WindhawkModReadme==
@@ -20,188 +20,3473 @@ When Windows switches to light mode, it disables dark titlebars.
 The mod listens for theme changes in real-time and updates all windows accordingly.
 
 ## How it works
-- Monitors Windows theme mode changes (WM_DWMCOLORIZATIONCOLORCHANGED, WM_SETTINGCHANGE)
-- Automatically applies DWMWA_USE_IMMERSIVE_DARK_MODE attribute to windows
+- Monitors Windows theme mode changes (WM_DWMCOLORIZATIONCOLORCHANGED, WM_SETTINGCHANGE
+  for ImmersiveColorSet), coalescing each burst of broadcasts into one update
+- Automatically applies DWMWA_USE_IMMERSIVE_DARK_MODE attribute to windows, for new
+  windows already during WM_NCCREATE so they are never drawn with a light titlebar
 - Works with all standard Win32 windows that have titlebars in injected processes
+- The theme is read from the registry by a single elected process and shared with
+  all other processes through a session-wide memory-mapped section. Only the
+  user's medium integrity processes can write it; sandboxed processes read the
+  registry themselves.
+- The elected process watches the registry for changes, so window messages never
+  read the registry
+- New windows are classified from their CreateWindowEx arguments and class atom, so
+  child, message-only and tool windows, tooltips, menus and IME windows are dropped
+  without querying the window
+- A theme change is applied to the foreground window first, then to the visible
+  windows from the top of the z-order down. Hidden and minimized windows only get
+  the attributes; their frame is redrawn when they are shown or restored.
+- Each process keeps track of the eligible windows it created, so a theme change
+  never enumerates the windows of other processes
+- When the mod is disabled, only the windows it changed are restored, to the dark
+  mode and backdrop they had before. Apps that set dark mode themselves keep it.
+- Each process counts its hooked messages, registry reads, DWM calls, frame
+  changes, skipped applies and apply latencies in a session-wide section, along
+  with the perceived latency: the time from a theme change until the foreground
+  window is themed. The elected process logs a report for the whole session a
+  few seconds after each theme change.
+
+## Settings
+- **Theme change detection**: by default `DefWindowProcW` is hooked for every window
+  in the process. The subclass mode instead subclasses only the eligible top-level
+  windows, so no other window pays for the hook. The lazy mode hooks `DefWindowProcW`
+  only once the process shows its first eligible window, so console tools and
+  background processes only ever get the window creation hooks. The theme
+  tracking (shared state, registry watch, counters and log) starts at the same
+  time.
+- **Rules**: per process or window class overrides. A process rule matches the
+  executable name, with `*` and `?` wildcards (e.g. `*setup*.exe`). A class rule
+  matches the exact window class name (e.g. `ConsoleWindowClass`). Each rule can
+  follow the system theme, force dark, force light, or skip (don't touch) the match.
+  The first matching rule wins. `SystemSettings.exe` and `ApplicationFrameHost.exe`
+  are always skipped. A rule can also select an attribute policy.
+- **Dark common controls**: list views, tree views, list headers and scrollbars in
+  eligible windows get the dark visual styles used by Explorer, and the process is
+  allowed to use dark menus. When the mod is disabled, the controls are switched
+  back to their default styles. Controls of a window that doesn't respond in time
+  keep the dark styles until they are recreated.
+- **Attribute policies**: named sets of caption, border and caption text colors (one
+  for dark and one for light mode) and a system backdrop, set together with dark mode.
+  All attributes of a window are set in one pass with a single frame change. The
+  default policy applies to windows no rule assigns one to.
+- **Single watcher in Explorer**: instead of running in every process, the mod runs
+  a window watcher in Explorer, which sets the attributes on other processes' windows
+  from the outside. Every other process unloads the mod at startup while the watcher
+  is running, except elevated processes, which Explorer can't change. Processes started
+  before the watcher keep the mod. New windows are themed shortly after they are shown
+  instead of before their first frame.
+- **Initial frame change budget**: when the mod is enabled, every process applies the
+  theme to its existing windows at once. This session-wide budget staggers that first
+  pass across all processes (0 = unlimited).
+- **Log level**: per-window events are queued in memory and written to the log about
+  once a second. Verbose logs every window creation and apply, off skips them at
+  the cost of a single check.
 */
 // ==/WindhawkModReadme==
 
+// ==WindhawkModSettings==
+/*
+- hookMode: global
+  $name: Theme change detection
+  $description: How windows are watched for theme change messages
+  $options:
+  - global: Hook DefWindowProcW (all windows)
+  - subclass: Subclass eligible top-level windows only
+  - lazy: Hook DefWindowProcW once the first eligible window appears
+- rules:
+  - - target: ""
+      $name: Process or window class
+      $description: Executable name (wildcards allowed) or exact window class name
+    - type: process
+      $name: Match on
+      $options:
+      - process: Process
+      - class: Window class
+    - action: skip
+      $name: Action
+      $options:
+      - follow: Follow system theme
+      - dark: Always dark
+      - light: Always light
+      - skip: Skip
+    - policy: ""
+      $name: Attribute policy
+      $description: Name of an attribute policy for the match (empty = inherit)
+  $name: Rules
+- darkControls: false
+  $name: Dark common controls
+  $description: Also switch list views, tree views, headers and scrollbars inside eligible windows to dark visual styles
+- policies:
+  - - name: ""
+      $name: Name
+    - captionColorDark: ""
+      $name: Caption color (dark)
+      $description: RRGGBB hex color, "none", or empty to leave the system default
+    - captionColorLight: ""
+      $name: Caption color (light)
+    - borderColorDark: ""
+      $name: Border color (dark)
+    - borderColorLight: ""
+      $name: Border color (light)
+    - textColorDark: ""
+      $name: Caption text color (dark)
+    - textColorLight: ""
+      $name: Caption text color (light)
+    - backdrop: default
+      $name: System backdrop
+      $options:
+      - default: Don't change
+      - auto: Auto
+      - none: None
+      - mica: Mica
+      - acrylic: Acrylic
+      - tabbed: Tabbed
+  $name: Attribute policies
+  $description: Caption, border and text colors and backdrop, applied along with dark mode
+- defaultPolicy: ""
+  $name: Default attribute policy
+  $description: Policy for windows no rule assigns one to (empty = dark mode only)
+- watcherMode: false
+  $name: Single watcher in Explorer
+  $description: Explorer applies the theme to other processes' windows from the outside, the mod unloads from every process Explorer can handle
+- initialFrameChangesPerSecond: 200
+  $name: Initial frame change budget
+  $description: Frame changes per second shared by all processes for the first pass after the mod is enabled (0 = unlimited)
+- logLevel: warning
+  $name: Log level
+  $description: Which per-window events are logged
+  $options:
+  - off: "Off"
+  - warning: Warnings
+  - verbose: Verbose (every window creation and apply)
+*/
+// ==/WindhawkModSettings==
+
 #include <windows.h>
 #include <dwmapi.h>
+#include <commctrl.h>
+#include <sddl.h>
+#include <uxtheme.h>
+#include <psapi.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 // DWMWA_USE_IMMERSIVE_DARK_MODE attribute
 #ifndef DWMWA_USE_IMMERSIVE_DARK_MODE
 #define DWMWA_USE_IMMERSIVE_DARK_MODE 20
 #endif
 
+// Windows 11 frame attributes
+#ifndef DWMWA_BORDER_COLOR
+#define DWMWA_BORDER_COLOR 34
+#define DWMWA_CAPTION_COLOR 35
+#define DWMWA_TEXT_COLOR 36
+#endif
+#ifndef DWMWA_SYSTEMBACKDROP_TYPE
+#define DWMWA_SYSTEMBACKDROP_TYPE 38
+#endif
+#ifndef DWMWA_COLOR_DEFAULT
+#define DWMWA_COLOR_DEFAULT 0xFFFFFFFF
+#define DWMWA_COLOR_NONE 0xFFFFFFFE
+#endif
+#define DWMSBT_AUTO_VALUE 0
+
 // Function pointer types
 typedef HRESULT(WINAPI* pShouldAppsUseDarkMode)();
 typedef HRESULT(WINAPI* pShouldSystemUseDarkMode)();
+typedef bool(WINAPI* pAllowDarkModeForWindow)(HWND hWnd, bool allow);
+typedef int(WINAPI* pSetPreferredAppMode)(int appMode);
+
+// SetPreferredAppMode values
+#define PREFERRED_APP_MODE_DEFAULT 0
+#define PREFERRED_APP_MODE_ALLOW_DARK 1
+
+// Session-wide theme state shared by all injected processes. A single elected
+// writer reads the registry and publishes the result; every other process reads
+// the dark flag and generation from here. seq is odd while a write is in progress.
+struct SharedThemeState {
+    std::atomic<LONG> seq;
+    std::atomic<LONG> isDark;
+    std::atomic<LONG> generation;   // 0 = never published, bumped on every change
+    std::atomic<DWORD> writerPid;   // elected writer process, 0 = none
+    
+    // Token bucket for the initial pass: tick (GetTickCount) in the high
+    // 32 bits, available frame changes in the low 32 bits, 0 = never used
+    std::atomic<ULONGLONG> frameChangeBucket;
+    // When the current burst of initial passes began. The processes still in
+    // their pass are flagged in their stats slots.
+    std::atomic<ULONGLONG> initialBurstStartTick;
+    
+    // Explorer process running the out-of-process window watcher, 0 = none
+    std::atomic<DWORD> watcherPid;
+    
+    // QueryPerformanceCounter time of the last published change, where the
+    // perceived latency of a theme change starts
+    std::atomic<LONGLONG> publishTime;
+};
+
+#define PERSONALIZE_KEY L"Software\\Microsoft\\Windows\\CurrentVersion\\Themes\\Personalize"
+// Shared object names carry the layout version of SharedThemeState and
+// SharedStatsSection, bump it whenever either changes so processes running
+// different versions of the mod never map each other's sections
+#define SHARED_OBJECT_PREFIX L"Local\\AutoDarkTitlebar_v2_"
+#define SHARED_THEME_STATE_NAME SHARED_OBJECT_PREFIX L"ThemeState"
+#define THEME_GENERATION_EVENT_FORMAT SHARED_OBJECT_PREFIX L"ThemeGeneration_%ld"
+// Seqlock retries before a reader gives up. A writer that died mid-write
+// leaves seq odd; the next writer takes over from there.
+#define SHARED_THEME_READ_SPINS 4096
+
+// How theme change messages are received
+enum HookMode {
+    HOOK_MODE_GLOBAL = 0,   // DefWindowProcW hook
+    HOOK_MODE_SUBCLASS = 1, // SetWindowSubclass on eligible windows
+    HOOK_MODE_LAZY = 2      // DefWindowProcW hook, installed on the first eligible window
+};
+
+// What a rule does with a matching process or window
+enum RuleAction : BYTE {
+    RULE_FOLLOW = 0,    // follow the system theme
+    RULE_DARK = 1,      // always dark
+    RULE_LIGHT = 2,     // always light
+    RULE_SKIP = 3       // don't touch
+};
+
+// What a rule decided: the action and the attribute policy index
+// (POLICY_INHERIT = not set by this rule)
+struct RuleVerdict {
+    RuleAction action;
+    BYTE policy;
+};
+
+#define POLICY_INHERIT 0
+
+// A process rule's verdict and its position in the rule list, so exact names
+// and globs can be matched separately and the first rule still wins
+struct OrderedVerdict {
+    RuleVerdict verdict;
+    int order;              // rule index, built-in rules come before 0
+};
+
+// Process name glob, compiled into lowercase literal segments split on '*'.
+// '?' inside a segment matches any single character.
+struct CompiledGlob {
+    std::vector<std::wstring> segments;
+    bool anchoredStart;     // pattern doesn't start with '*'
+    bool anchoredEnd;       // pattern doesn't end with '*'
+    OrderedVerdict verdict;
+};
+
+// Frame attributes set on a window in one pass, besides dark mode
+#define ATTRIBUTE_CAPTION_COLOR 0x1
+#define ATTRIBUTE_BORDER_COLOR 0x2
+#define ATTRIBUTE_TEXT_COLOR 0x4
+#define ATTRIBUTE_BACKDROP 0x8
+// Not an attribute: dark mode is left as it is (original value unknown)
+#define ATTRIBUTE_KEEP_DARK_MODE 0x10
+
+struct DwmAttributeSet {
+    BOOL darkMode;
+    DWORD mask;             // ATTRIBUTE_* values below that are set
+    COLORREF captionColor;
+    COLORREF borderColor;
+    COLORREF textColor;
+    int backdrop;           // DWM_SYSTEMBACKDROP_TYPE
+};
+
+// Attribute policy, with the sets for light ([0]) and dark ([1]) mode
+// precomputed when the settings are loaded
+struct ThemePolicy {
+    std::wstring name;
+    DwmAttributeSet sets[2];
+};
+
+// Policies fit in the class verdict byte next to the action
+#define MAX_THEME_POLICIES 62
+
+// Settings
+struct {
+    HookMode hookMode;
+    BOOL darkControls;
+    BOOL watcherMode;
+    int initialFrameChangesPerSecond;
+} g_settings;
+
+// Global variables
+static pShouldSystemUseDarkMode g_ShouldSystemUseDarkMode = nullptr;
+static std::atomic<BOOL> g_isDarkMode{FALSE};
+
+// Eligible top-level windows created by this process. Theme changes are
+// applied to these only, instead of enumerating every window on the desktop.
+struct TrackedWindow {
+    HWND hWnd;
+    DWORD threadId;
+    int appliedState;   // last applied state (policy * 2 + dark), APPLIED_STATE_NONE if never
+    
+    // What the window had before the mod first changed it, and the policy
+    // attributes set since. Uninit restores exactly these.
+    BOOL changed;
+    BOOL originalDarkMode;  // ORIGINAL_DARK_MODE_UNKNOWN if it couldn't be read
+    int originalBackdrop;
+    DWORD changedMask;
+    
+    // Attributes set while hidden or minimized, the frame change is done when
+    // the window is shown or restored
+    BOOL framePending;
+    
+    // Messages posted to the window are known to reach HandleHookedMessage:
+    // it passed WM_NCCREATE to DefWindowProcW or was subclassed. ANSI windows
+    // and windows with their own message handling may never get there.
+    BOOL reachesHook;
+    
+    // The controls inside were switched to the dark visual styles
+    BOOL controlsDark;
+};
+// Open-addressing table keyed by HWND: linear probing, a null hWnd marks a
+// free slot, and removal shifts the following entries back, so there are no
+// tombstones. The capacity is a power of 2 and kept at least twice the count.
+static std::vector<TrackedWindow> g_trackedWindows;
+static size_t g_trackedWindowCount = 0;
+static SRWLOCK g_trackedWindowsLock = SRWLOCK_INIT;
+#define TRACKED_WINDOWS_MIN_CAPACITY 16
+
+#define ORIGINAL_DARK_MODE_UNKNOWN (-1)
+
+#define APPLIED_STATE_NONE (-1)
+#define APPLIED_STATE_RESTORED (-2)   // original attributes restored on uninit
+
+// Apply counters: performed = DWM call and frame change done,
+// skipped = the window already had the requested value
+static std::atomic<ULONG> g_appliesPerformed{0};
+static std::atomic<ULONG> g_appliesSkipped{0};
+// New windows seen by the creation hooks, and how many of them were applied
+// at WM_NCCREATE, before their first frame (no frame change needed)
+static std::atomic<ULONG> g_windowsCreated{0};
+static std::atomic<ULONG> g_appliesPrePaint{0};
+
+// Tracked windows with a deferred frame change. WM_WINDOWPOSCHANGED is only
+// looked at while this isn't 0, and only for windows whose HWND hash bucket
+// counts one, so the windows without one are dismissed with a single load.
+static std::atomic<LONG> g_pendingFrameChanges{0};
+#define PENDING_FRAME_BUCKETS 256
+static std::atomic<LONG> g_pendingFrameBuckets[PENDING_FRAME_BUCKETS];
+
+// Messages that may pass IsHookedMessage, one bit per value of the low 10
+// bits of the message ID. Registered messages can share a bit with other
+// messages, so a set bit only means the ID has to be compared.
+// WM_WINDOWPOSCHANGED has its bit while frame changes are deferred.
+#define HOOKED_MESSAGE_BITS 0x400
+static std::atomic<ULONG> g_hookedMessageBits[HOOKED_MESSAGE_BITS / 32];
+
+// Apply order of a window in a theme pass. Cloaked windows (e.g. on another
+// virtual desktop) get no message when they are uncloaked, so their frame
+// change can't wait; they only go after the visible ones.
+enum ApplyPriority {
+    APPLY_PRIORITY_FOREGROUND = 0,
+    APPLY_PRIORITY_VISIBLE = 1,     // in z-order
+    APPLY_PRIORITY_CLOAKED = 2,
+    APPLY_PRIORITY_HIDDEN = 3       // hidden or minimized, frame change deferred
+};
+
+// The foreground window when the theme last changed, until it is applied, and
+// the QueryPerformanceCounter time of the change
+static std::atomic<HWND> g_perceivedWindow{nullptr};
+static std::atomic<LONGLONG> g_themeChangeTime{0};
+
+// Theme passes are posted to the thread owning the windows as
+// g_applyThemeMsg(applyGeneration, useDarkMode), stale generations are ignored
+static UINT g_applyThemeMsg = RegisterWindowMessageW(L"Windhawk_AutoDarkTitlebar_ApplyTheme");
+static std::atomic<LONG> g_applyGeneration{0};
+// The windows of the current pass in apply order, set with the generation
+static std::vector<TrackedWindow> g_applyPassWindows;
+static SRWLOCK g_applyPassLock = SRWLOCK_INIT;
+
+// Theme change broadcasts are re-evaluated once per epoch, after this delay
+#define THEME_REEVALUATE_DELAY_MS 100
+static PTP_TIMER g_reevaluateTimer = nullptr;
+static std::atomic<BOOL> g_reevaluatePending{FALSE};
+
+// Rules compiled at init: exact lowercase process names, process globs and
+// lowercase class names. The first matching rule wins.
+static std::unordered_map<std::wstring, OrderedVerdict> g_processRules;
+static std::vector<CompiledGlob> g_processGlobs;
+static std::unordered_map<std::wstring, RuleVerdict> g_classRules;
+static RuleAction g_processAction = RULE_FOLLOW;
+static BYTE g_processPolicy = POLICY_INHERIT;
+static INIT_ONCE g_processClassifyOnce = INIT_ONCE_STATIC_INIT;
+
+// Attribute policies, [0] is the default policy. A window's applied state is
+// policy * 2 + dark.
+static std::vector<ThemePolicy> g_policies;
+
+// Class rule decisions memoized by class atom: 0 = not decided yet, otherwise
+// 1 + action + policy * 4. Only allocated if there are class rules.
+static std::atomic<BYTE>* g_classAtomVerdicts = nullptr;
+
+// Common control classes switched to dark visual styles, and the theme used
+struct DarkControlClass {
+    PCWSTR className;
+    PCWSTR darkTheme;
+};
+static const DarkControlClass g_darkControlClasses[] = {
+    { L"SysListView32", L"DarkMode_Explorer" },
+    { L"SysTreeView32", L"DarkMode_Explorer" },
+    { L"SysHeader32", L"DarkMode_ItemsView" },
+    { L"ScrollBar", L"DarkMode_Explorer" },
+};
+
+// Control class decisions memoized by class atom: 0 = not decided yet,
+// 1 = not a dark control class, otherwise g_darkControlClasses index + 2.
+// Only allocated if dark common controls are enabled.
+static std::atomic<BYTE>* g_controlClassVerdicts = nullptr;
+
+// uxtheme dark mode functions, exported by ordinal only, resolved once
+static pAllowDarkModeForWindow g_AllowDarkModeForWindow = nullptr;
+static pSetPreferredAppMode g_SetPreferredAppMode = nullptr;
+// The mode the process had before, restored when the mod stops.
+// -1 = the mode wasn't changed.
+static int g_previousAppMode = -1;
+
+// Controls of a window owned by another thread are themed on the owner thread,
+// posted as g_applyControlsMsg(useDarkMode, 0) to the top-level window. On
+// unload, g_applyControlsMsg(FALSE, CONTROLS_RESTORE_THREAD) is sent to one
+// window of each thread to restore the controls of all its windows.
+static UINT g_applyControlsMsg = RegisterWindowMessageW(L"Windhawk_AutoDarkTitlebar_ApplyControls");
+#define CONTROLS_RESTORE_THREAD 1
+// How long unloading waits for a thread to restore its controls. A hung
+// thread keeps the dark styles.
+#define CONTROLS_RESTORE_TIMEOUT_MS 200
+
+// Window classes that never have a titlebar but are created all the time.
+// The creation hooks drop their windows after one table lookup.
+static const PCWSTR g_ineligibleClasses[] = {
+    L"tooltips_class32",
+    L"IME",
+    L"MSCTFIME UI",
+    L"#32768",      // menu
+    L"ComboLBox",
+    L"SysShadow",
+};
+
+// Creation decisions memoized by class atom: 0 = not decided yet, otherwise
+// CREATION_CLASS_*. The 64 KiB are zero-initialized image data: they count
+// as committed when the mod loads, but only the pages of atoms in use are
+// ever touched. The atom caches are cleared for a class when it is
+// unregistered, since a class registered later can get its atom.
+#define CREATION_CLASS_CANDIDATE 1
+#define CREATION_CLASS_INELIGIBLE 2
+static std::atomic<BYTE> g_creationClassVerdicts[0x10000];
+
+// Out-of-process window watcher (watcher mode, in the elected explorer.exe).
+// The watched windows and their state are only used on the watcher thread.
+#define WATCHER_APPLY_MSG (WM_APP + 1)  // thread message, wParam = useDarkMode
+static HANDLE g_watcherThread = nullptr;
+static DWORD g_watcherThreadId = 0;
+static HANDLE g_watcherStartEvent = nullptr;
+static std::unordered_map<HWND, TrackedWindow> g_watchedWindows;
+// What the watcher found out about the processes it saw windows of, by
+// process id. The handle tells when the process has exited, so the entry
+// isn't used for another process that gets the same id.
+struct WatchedProcess {
+    HANDLE hProcess;
+    BOOL injected;
+    RuleVerdict verdict;
+};
+static std::unordered_map<DWORD, WatchedProcess> g_watchedProcesses;
+// Set in processes that unloaded because the watcher serves them
+static BOOL g_servedByWatcher = FALSE;
+
+// Initial pass, applied in steps as the session-wide budget allows
+static PTP_TIMER g_initialApplyTimer = nullptr;
+static std::vector<TrackedWindow> g_initialApplyWindows;
+static size_t g_initialApplyNext = 0;
+static ULONGLONG g_initialApplyStartTick = 0;
+
+// Registry watcher, runs in the writer (or in every process without shared state)
+static HKEY g_personalizeKey = nullptr;
+static HANDLE g_personalizeEvent = nullptr;
+static HANDLE g_personalizeWait = nullptr;
+static std::atomic<BOOL> g_cachedDarkMode{FALSE};
+
+// Shared theme state
+static HANDLE g_sharedThemeMapping = nullptr;
+static SharedThemeState* g_sharedTheme = nullptr;
+static std::atomic<BOOL> g_isThemeWriter{FALSE};
+static SRWLOCK g_themeWaitLock = SRWLOCK_INIT;
+static BOOL g_themeWaitStopping = FALSE;
+static HANDLE g_generationEvent = nullptr;
+static HANDLE g_generationWait = nullptr;
+static std::atomic<DWORD> g_watchedWriterPid{0};
+static HANDLE g_writerProcess = nullptr;
+static HANDLE g_writerWait = nullptr;
+// Completion events of the waits replaced while their callback may still be
+// running, CloseSharedThemeState waits on them before the mod goes away
+static std::vector<HANDLE> g_retiredThemeWaits;
+
+// Log levels. Hot path messages are only queued if the current level allows
+// them, a disabled call costs a single relaxed load.
+enum LogLevel {
+    LOG_LEVEL_OFF = 0,
+    LOG_LEVEL_WARNING = 1,
+    LOG_LEVEL_VERBOSE = 2
+};
+static std::atomic<int> g_logLevel{LOG_LEVEL_WARNING};
+
+// Hot path log records. They are written to a lock-free ring as a format
+// string and its raw arguments, and only formatted when the ring is drained.
+// The format must be a string literal, and %s arguments must outlive the record.
+#define LOG_RING_SIZE 256   // power of 2
+#define LOG_RING_ARGS 4
+#define LOG_DRAIN_INTERVAL_MS 1000
+
+struct LogRecord {
+    std::atomic<ULONG> sequence;    // == position when free, position + 1 when written
+    BYTE level;
+    DWORD threadId;
+    DWORD tick;
+    PCWSTR format;
+    ULONG_PTR args[LOG_RING_ARGS];
+};
+static LogRecord* g_logRing = nullptr;
+static std::atomic<ULONG> g_logWritePosition{0};
+static ULONG g_logReadPosition = 0;         // owned by the drain
+static std::atomic<BOOL> g_logDraining{FALSE};
+static std::atomic<ULONG> g_logDropped{0};
+static PTP_TIMER g_logDrainTimer = nullptr;
+
+// Queue a record. Never blocks and never formats: if the ring is full, the
+// record is dropped and counted.
+VOID LogWriteRecord(int level, PCWSTR format, const ULONG_PTR* args, size_t argCount) {
+    LogRecord* ring = g_logRing;
+    if (!ring)
+        return;
+    
+    ULONG position = g_logWritePosition.load(std::memory_order_relaxed);
+    LogRecord* record;
+    for (;;) {
+        record = &ring[position & (LOG_RING_SIZE - 1)];
+        LONG diff = (LONG)(record->sequence.load(std::memory_order_acquire) - position);
+        if (diff == 0) {
+            if (g_logWritePosition.compare_exchange_weak(position, position + 1,
+                std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            g_logDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            position = g_logWritePosition.load(std::memory_order_relaxed);
+        }
+    }
+    
+    record->level = (BYTE)level;
+    record->threadId = GetCurrentThreadId();
+    record->tick = GetTickCount();
+    record->format = format;
+    for (size_t i = 0; i < LOG_RING_ARGS; i++) {
+        record->args[i] = i < argCount ? args[i] : 0;
+    }
+    record->sequence.store(position + 1, std::memory_order_release);
+}
+
+template <typename... Args>
+VOID LogWrite(int level, PCWSTR format, Args... args) {
+    static_assert(sizeof...(Args) <= LOG_RING_ARGS, "Too many log arguments");
+    ULONG_PTR values[LOG_RING_ARGS + 1] = { (ULONG_PTR)args... };
+    LogWriteRecord(level, format, values, sizeof...(Args));
+}
+
+#define LOG_AT_LEVEL(level, format, ...) \
+    do { \
+        if (__builtin_expect(g_logLevel.load(std::memory_order_relaxed) >= (level), 0)) \
+            LogWrite((level), format, ##__VA_ARGS__); \
+    } while (0)
+#define LOG_WARNING(format, ...) LOG_AT_LEVEL(LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+#define LOG_VERBOSE(format, ...) LOG_AT_LEVEL(LOG_LEVEL_VERBOSE, format, ##__VA_ARGS__)
+
+// Format and log the queued records. Only one thread drains at a time.
+VOID DrainLogRing() {
+    LogRecord* ring = g_logRing;
+    if (!ring || g_logDraining.exchange(TRUE, std::memory_order_acquire))
+        return;
+    
+    for (;;) {
+        LogRecord* record = &ring[g_logReadPosition & (LOG_RING_SIZE - 1)];
+        if (record->sequence.load(std::memory_order_acquire) != g_logReadPosition + 1)
+            break;
+        
+        WCHAR message[256];
+        _snwprintf_s(message, ARRAYSIZE(message), _TRUNCATE, record->format,
+            record->args[0], record->args[1], record->args[2], record->args[3]);
+        Wh_Log(L"[Process %d] [Thread %lu @%lu] %s%s", GetCurrentProcessId(),
+            record->threadId, record->tick,
+            record->level == LOG_LEVEL_WARNING ? L"WARNING: " : L"", message);
+        
+        record->sequence.store(g_logReadPosition + LOG_RING_SIZE, std::memory_order_release);
+        g_logReadPosition++;
+    }
+    
+    ULONG dropped = g_logDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+        Wh_Log(L"[Process %d] %lu log records dropped, ring full", GetCurrentProcessId(), dropped);
+    }
+    
+    g_logDraining.store(FALSE, std::memory_order_release);
+}
+
+VOID CALLBACK LogDrainTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    DrainLogRing();
+}
+
+// Allocate the ring and start draining it periodically, unless logging is off
+VOID StartLogRing() {
+    if (g_logLevel == LOG_LEVEL_OFF)
+        return;
+    
+    g_logRing = new LogRecord[LOG_RING_SIZE];
+    for (ULONG i = 0; i < LOG_RING_SIZE; i++) {
+        g_logRing[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    
+    g_logDrainTimer = CreateThreadpoolTimer(LogDrainTimerCallback, nullptr, nullptr);
+    if (g_logDrainTimer) {
+        ULARGE_INTEGER dueTime;
+        dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)LOG_DRAIN_INTERVAL_MS * 10000);
+        FILETIME ftDueTime;
+        ftDueTime.dwLowDateTime = dueTime.LowPart;
+        ftDueTime.dwHighDateTime = dueTime.HighPart;
+        SetThreadpoolTimer(g_logDrainTimer, &ftDueTime, LOG_DRAIN_INTERVAL_MS, 0);
+    }
+}
+
+// Stop the periodic drain, log what's left and free the ring. The hooks must
+// be gone, nothing may write to the ring anymore.
+VOID StopLogRing() {
+    if (g_logDrainTimer) {
+        SetThreadpoolTimer(g_logDrainTimer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(g_logDrainTimer, TRUE);
+        CloseThreadpoolTimer(g_logDrainTimer);
+        g_logDrainTimer = nullptr;
+    }
+    
+    DrainLogRing();
+    delete[] g_logRing;
+    g_logRing = nullptr;
+}
+
+// Per-process counters, exported through a session-wide section so the cost of
+// the mod can be read across all processes. Apply latency (DWM call and frame
+// change) is kept as a log2 histogram in microseconds: bucket 0 is < 1 us,
+// bucket n is [2^(n-1), 2^n) us, the last bucket takes everything above.
+#define STATS_LATENCY_BUCKETS 24
+#define STATS_SLOT_COUNT 512
+#define SHARED_STATS_NAME SHARED_OBJECT_PREFIX L"Stats"
+// The writer logs a session report this long after publishing a theme change
+#define STATS_REPORT_DELAY_MS 5000
+
+struct alignas(64) ProcessStatsSlot {
+    std::atomic<DWORD> processId;           // 0 = free
+    std::atomic<ULONGLONG> processStartTime; // tells a reused process id apart
+    std::atomic<LONG> initialPassPending;   // the process's initial pass is still running
+    std::atomic<ULONGLONG> hookedMessages;  // handled by the DefWindowProcW hook or subclass proc
+    std::atomic<ULONGLONG> registryReads;
+    std::atomic<ULONGLONG> dwmCalls;
+    std::atomic<ULONGLONG> frameChanges;
+    std::atomic<ULONGLONG> appliesSkipped;
+    std::atomic<ULONGLONG> framesDeferred;  // hidden or minimized windows, redrawn on show
+    std::atomic<ULONGLONG> committedBytes;  // private memory committed by the mod's setup
+    std::atomic<ULONGLONG> applyLatency[STATS_LATENCY_BUCKETS];
+    // Theme change published to the foreground window themed
+    std::atomic<ULONGLONG> perceivedLatency[STATS_LATENCY_BUCKETS];
+};
+
+struct SharedStatsSection {
+    std::atomic<LONG> retiredProcesses;
+    ProcessStatsSlot retired;               // totals of processes that released their slot
+    ProcessStatsSlot slots[STATS_SLOT_COUNT];
+};
+
+// Plain copy of the counters, summed over one or more slots
+struct StatsTotals {
+    ULONG processes;
+    ULONGLONG hookedMessages;
+    ULONGLONG registryReads;
+    ULONGLONG dwmCalls;
+    ULONGLONG frameChanges;
+    ULONGLONG appliesSkipped;
+    ULONGLONG framesDeferred;
+    ULONGLONG committedBytes;
+    ULONGLONG applyLatency[STATS_LATENCY_BUCKETS];
+    ULONGLONG perceivedLatency[STATS_LATENCY_BUCKETS];
+};
+
+// Counters of this process: a slot in the shared section, or a local one if
+// the section isn't available, so the counting code never checks
+static ProcessStatsSlot g_localStats;
+static ProcessStatsSlot* g_stats = &g_localStats;
+static HANDLE g_sharedStatsMapping = nullptr;
+static SharedStatsSection* g_sharedStats = nullptr;
+static LARGE_INTEGER g_qpcFrequency;
+static PTP_TIMER g_statsReportTimer = nullptr;
+
+#define STATS_INCREMENT(counter) g_stats->counter.fetch_add(1, std::memory_order_relaxed)
+
+// Start timing an apply
+static inline LONGLONG StatsStartTiming() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// Add the time since start to a latency histogram. Returns it in microseconds.
+static inline ULONGLONG StatsRecordLatency(std::atomic<ULONGLONG>* histogram, LONGLONG start) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    ULONGLONG ticks = now.QuadPart > start ? (ULONGLONG)(now.QuadPart - start) : 0;
+    ULONGLONG micros = g_qpcFrequency.QuadPart
+        ? ticks * 1000000 / (ULONGLONG)g_qpcFrequency.QuadPart : 0;
+    int bucket = micros ? 64 - __builtin_clzll(micros) : 0;
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    return micros;
+}
+
+// Add the time since StatsStartTiming to the apply latency histogram
+static inline VOID StatsRecordApplyLatency(LONGLONG start) {
+    StatsRecordLatency(g_stats->applyLatency, start);
+}
+
+VOID ApplyToAllWindows(BOOL useDarkMode);
+VOID PublishSharedThemeState(BOOL isDark);
+VOID UpdateThemeMode(BOOL newDarkMode);
+BOOL SetAppliedState(HWND hWnd, int state);
+BOOL MarkWindowChanged(HWND hWnd, DWORD mask);
+VOID SetWindowOriginal(HWND hWnd, BOOL originalDarkMode, int originalBackdrop);
+VOID ApplyToThreadWindows(LONG applyGeneration, BOOL useDarkMode);
+VOID EnsureDefWindowProcHook();
+BOOL MarkFramePending(HWND hWnd);
+BOOL TakeFramePending(HWND hWnd);
+VOID SetControlsDark(HWND hWnd, BOOL controlsDark);
+VOID RestoreThreadControls();
+
+// Resolve the uxtheme fallback once, so the lookup never happens on a hot path
+VOID InitDarkModeFallback() {
+    HMODULE hUxtheme = GetModuleHandleW(L"uxtheme.dll");
+    if (hUxtheme) {
+        // Ordinal 138 is ShouldSystemUseDarkMode
+        g_ShouldSystemUseDarkMode = (pShouldSystemUseDarkMode)(void*)GetProcAddress(
+            hUxtheme, MAKEINTRESOURCEA(138));
+    }
+}
+
+// Check if system is using dark mode
+BOOL IsSystemDarkMode() {
+    // Check registry first (most reliable), reusing the watched key if open
+    HKEY hKey = g_personalizeKey;
+    if (hKey || RegOpenKeyExW(HKEY_CURRENT_USER, PERSONALIZE_KEY,
+        0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+        
+        DWORD value = 0;
+        DWORD size = sizeof(DWORD);
+        STATS_INCREMENT(registryReads);
+        // AppsUseLightTheme: 0 = dark mode, 1 = light mode
+        LONG result = RegQueryValueExW(hKey, L"AppsUseLightTheme", nullptr, nullptr,
+            (LPBYTE)&value, &size);
+        if (hKey != g_personalizeKey) {
+            RegCloseKey(hKey);
+        }
+        if (result == ERROR_SUCCESS) {
+            return value == 0;
+        }
+    }
+    
+    // Fallback: uxtheme function resolved at init
+    if (g_ShouldSystemUseDarkMode) {
+        return g_ShouldSystemUseDarkMode() != 0;
+    }
+    
+    return FALSE;
+}
+
+// Re-read the theme into the cache and publish it to the other processes
+BOOL RefreshCachedDarkMode() {
+    BOOL isDark = IsSystemDarkMode();
+    g_cachedDarkMode = isDark;
+    if (g_sharedTheme) {
+        PublishSharedThemeState(isDark);
+    }
+    return isDark;
+}
+
+// Ask for a single notification on the next change of the Personalize key.
+// Thread agnostic, since the thread pool thread that asked may go away.
+BOOL ArmPersonalizeNotification() {
+    return RegNotifyChangeKeyValue(g_personalizeKey, FALSE,
+        REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC,
+        g_personalizeEvent, TRUE) == ERROR_SUCCESS;
+}
+
+// Called on the thread pool when a value under the Personalize key changed
+VOID CALLBACK PersonalizeChangedCallback(PVOID lpParameter, BOOLEAN timerOrWaitFired) {
+    // Re-arm before reading so a change in between isn't lost
+    if (!ArmPersonalizeNotification()) {
+        Wh_Log(L"[Process %d] WARNING: Failed to re-arm theme registry notification",
+            GetCurrentProcessId());
+    }
+    
+    UpdateThemeMode(RefreshCachedDarkMode());
+}
+
+// Start watching the Personalize key and keep the cached dark flag up to date
+BOOL StartThemeWatcher() {
+    if (g_personalizeWait)
+        return TRUE;
+    
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, PERSONALIZE_KEY, 0,
+        KEY_QUERY_VALUE | KEY_NOTIFY, &g_personalizeKey) != ERROR_SUCCESS) {
+        g_personalizeKey = nullptr;
+        Wh_Log(L"[Process %d] WARNING: Failed to open theme registry key", GetCurrentProcessId());
+        return FALSE;
+    }
+    
+    g_personalizeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!g_personalizeEvent || !ArmPersonalizeNotification() ||
+        !RegisterWaitForSingleObject(&g_personalizeWait, g_personalizeEvent,
+            PersonalizeChangedCallback, nullptr, INFINITE, WT_EXECUTEDEFAULT)) {
+        Wh_Log(L"[Process %d] WARNING: Failed to watch theme registry key, error=%lu",
+            GetCurrentProcessId(), GetLastError());
+        g_personalizeWait = nullptr;
+        if (g_personalizeEvent) {
+            CloseHandle(g_personalizeEvent);
+            g_personalizeEvent = nullptr;
+        }
+        RegCloseKey(g_personalizeKey);
+        g_personalizeKey = nullptr;
+        return FALSE;
+    }
+    
+    RefreshCachedDarkMode();
+    Wh_Log(L"[Process %d] Watching theme registry key", GetCurrentProcessId());
+    return TRUE;
+}
+
+// Stop the registry watcher, waiting for a running callback to finish
+VOID StopThemeWatcher() {
+    if (g_personalizeWait) {
+        UnregisterWaitEx(g_personalizeWait, INVALID_HANDLE_VALUE);
+        g_personalizeWait = nullptr;
+    }
+    if (g_personalizeEvent) {
+        CloseHandle(g_personalizeEvent);
+        g_personalizeEvent = nullptr;
+    }
+    if (g_personalizeKey) {
+        RegCloseKey(g_personalizeKey);
+        g_personalizeKey = nullptr;
+    }
+}
+
+// Build security attributes for the named objects below. Only the current
+// user at medium integrity or above gets write access; everyone else, including
+// low integrity and AppContainer processes, can only read. Those can't open
+// the objects for writing and run without the shared state.
+// Free lpSecurityDescriptor with LocalFree.
+BOOL InitSharedObjectSecurity(SECURITY_ATTRIBUTES* sa) {
+    HANDLE hToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken))
+        return FALSE;
+    
+    alignas(TOKEN_USER) BYTE tokenUser[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    DWORD size = sizeof(tokenUser);
+    PWSTR userSid = nullptr;
+    BOOL hasUser = GetTokenInformation(hToken, TokenUser, tokenUser, size, &size) &&
+        ConvertSidToStringSidW(((TOKEN_USER*)tokenUser)->User.Sid, &userSid);
+    CloseHandle(hToken);
+    if (!hasUser)
+        return FALSE;
+    
+    WCHAR sddl[256];
+    swprintf_s(sddl, ARRAYSIZE(sddl), L"D:(A;;GA;;;%s)(A;;GR;;;WD)(A;;GR;;;AC)S:(ML;;NW;;;ME)", userSid);
+    LocalFree(userSid);
+    
+    PSECURITY_DESCRIPTOR sd = nullptr;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &sd, nullptr)) {
+        return FALSE;
+    }
+    
+    sa->nLength = sizeof(*sa);
+    sa->lpSecurityDescriptor = sd;
+    sa->bInheritHandle = FALSE;
+    return TRUE;
+}
+
+// Open (or create) the session-wide shared theme state
+BOOL OpenSharedThemeState() {
+    SECURITY_ATTRIBUTES sa;
+    BOOL hasSecurity = InitSharedObjectSecurity(&sa);
+    g_sharedThemeMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, hasSecurity ? &sa : nullptr,
+        PAGE_READWRITE, 0, sizeof(SharedThemeState), SHARED_THEME_STATE_NAME);
+    if (hasSecurity) {
+        LocalFree(sa.lpSecurityDescriptor);
+    }
+    
+    if (!g_sharedThemeMapping) {
+        Wh_Log(L"[Process %d] WARNING: Failed to create shared theme state, error=%lu",
+            GetCurrentProcessId(), GetLastError());
+        return FALSE;
+    }
+    
+    g_sharedTheme = (SharedThemeState*)MapViewOfFile(g_sharedThemeMapping,
+        FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedThemeState));
+    if (!g_sharedTheme) {
+        Wh_Log(L"[Process %d] WARNING: Failed to map shared theme state, error=%lu",
+            GetCurrentProcessId(), GetLastError());
+        CloseHandle(g_sharedThemeMapping);
+        g_sharedThemeMapping = nullptr;
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+// Creation time of a running process, 0 if it exited or can't be opened
+ULONGLONG GetProcessStartTime(DWORD processId) {
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, FALSE, processId);
+    if (!hProcess)
+        return 0;
+    
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    ULONGLONG startTime = 0;
+    if (WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT &&
+        GetProcessTimes(hProcess, &creationTime, &exitTime, &kernelTime, &userTime)) {
+        startTime = ((ULONGLONG)creationTime.dwHighDateTime << 32) | creationTime.dwLowDateTime;
+    }
+    CloseHandle(hProcess);
+    return startTime;
+}
+
+// Check if the process that claimed a slot is still running. A slot that is
+// being claimed (start time not stored yet) counts as running.
+BOOL IsStatsSlotOwnerRunning(const ProcessStatsSlot& slot, DWORD processId) {
+    ULONGLONG slotStartTime = slot.processStartTime.load(std::memory_order_relaxed);
+    return !slotStartTime || GetProcessStartTime(processId) == slotStartTime;
+}
+
+// Add the counters of a slot to the retired totals
+VOID RetireStatsSlot(const ProcessStatsSlot& slot) {
+    ProcessStatsSlot& retired = g_sharedStats->retired;
+    retired.hookedMessages.fetch_add(slot.hookedMessages, std::memory_order_relaxed);
+    retired.registryReads.fetch_add(slot.registryReads, std::memory_order_relaxed);
+    retired.dwmCalls.fetch_add(slot.dwmCalls, std::memory_order_relaxed);
+    retired.frameChanges.fetch_add(slot.frameChanges, std::memory_order_relaxed);
+    retired.appliesSkipped.fetch_add(slot.appliesSkipped, std::memory_order_relaxed);
+    retired.framesDeferred.fetch_add(slot.framesDeferred, std::memory_order_relaxed);
+    retired.committedBytes.fetch_add(slot.committedBytes, std::memory_order_relaxed);
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        retired.applyLatency[i].fetch_add(slot.applyLatency[i], std::memory_order_relaxed);
+        retired.perceivedLatency[i].fetch_add(slot.perceivedLatency[i], std::memory_order_relaxed);
+    }
+    g_sharedStats->retiredProcesses.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Start counting into a slot this process just claimed, resetting what the
+// previous owner left behind
+VOID UseStatsSlot(ProcessStatsSlot& slot, ULONGLONG startTime) {
+    slot.processStartTime = startTime;
+    slot.initialPassPending = 0;
+    slot.hookedMessages = 0;
+    slot.registryReads = 0;
+    slot.dwmCalls = 0;
+    slot.frameChanges = 0;
+    slot.appliesSkipped = 0;
+    slot.framesDeferred = 0;
+    slot.committedBytes = 0;
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        slot.applyLatency[i] = 0;
+        slot.perceivedLatency[i] = 0;
+    }
+    g_stats = &slot;
+}
+
+// Claim a counter slot in the session-wide stats section. Without one, the
+// process keeps counting into its local slot. If no slot is free, the slot
+// of a process that died without releasing it is reclaimed, after its
+// counters are retired.
+VOID OpenProcessStats() {
+    QueryPerformanceFrequency(&g_qpcFrequency);
+    
+    SECURITY_ATTRIBUTES sa;
+    BOOL hasSecurity = InitSharedObjectSecurity(&sa);
+    g_sharedStatsMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, hasSecurity ? &sa : nullptr,
+        PAGE_READWRITE, 0, sizeof(SharedStatsSection), SHARED_STATS_NAME);
+    if (hasSecurity) {
+        LocalFree(sa.lpSecurityDescriptor);
+    }
+    if (!g_sharedStatsMapping)
+        return;
+    
+    g_sharedStats = (SharedStatsSection*)MapViewOfFile(g_sharedStatsMapping,
+        FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedStatsSection));
+    if (!g_sharedStats) {
+        CloseHandle(g_sharedStatsMapping);
+        g_sharedStatsMapping = nullptr;
+        return;
+    }
+    
+    DWORD processId = GetCurrentProcessId();
+    ULONGLONG startTime = GetProcessStartTime(processId);
+    for (ProcessStatsSlot& slot : g_sharedStats->slots) {
+        DWORD expected = 0;
+        if (slot.processId.load(std::memory_order_relaxed) == 0 &&
+            slot.processId.compare_exchange_strong(expected, processId)) {
+            UseStatsSlot(slot, startTime);
+            return;
+        }
+    }
+    
+    for (ProcessStatsSlot& slot : g_sharedStats->slots) {
+        DWORD ownerId = slot.processId.load(std::memory_order_relaxed);
+        if (ownerId && ownerId != processId && !IsStatsSlotOwnerRunning(slot, ownerId) &&
+            slot.processId.compare_exchange_strong(ownerId, processId)) {
+            RetireStatsSlot(slot);
+            UseStatsSlot(slot, startTime);
+            return;
+        }
+    }
+    
+    Wh_Log(L"[Process %d] WARNING: No free stats slot, counters are not shared", processId);
+}
+
+// Private memory committed by the process so far
+SIZE_T GetCommittedBytes() {
+    PROCESS_MEMORY_COUNTERS_EX counters = {};
+    counters.cb = sizeof(counters);
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+        return 0;
+    return counters.PrivateUsage;
+}
+
+// Add a slot to a running total
+VOID AddStatsTotals(StatsTotals* totals, const ProcessStatsSlot& slot) {
+    totals->hookedMessages += slot.hookedMessages.load(std::memory_order_relaxed);
+    totals->registryReads += slot.registryReads.load(std::memory_order_relaxed);
+    totals->dwmCalls += slot.dwmCalls.load(std::memory_order_relaxed);
+    totals->frameChanges += slot.frameChanges.load(std::memory_order_relaxed);
+    totals->appliesSkipped += slot.appliesSkipped.load(std::memory_order_relaxed);
+    totals->framesDeferred += slot.framesDeferred.load(std::memory_order_relaxed);
+    totals->committedBytes += slot.committedBytes.load(std::memory_order_relaxed);
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        totals->applyLatency[i] += slot.applyLatency[i].load(std::memory_order_relaxed);
+        totals->perceivedLatency[i] += slot.perceivedLatency[i].load(std::memory_order_relaxed);
+    }
+}
+
+// Log the non-empty buckets of a latency histogram on one line
+VOID LogLatencyHistogram(PCWSTR scope, PCWSTR name, const ULONGLONG* latency) {
+    WCHAR histogram[512] = L"";
+    size_t length = 0;
+    for (int i = 0; i < STATS_LATENCY_BUCKETS && length < ARRAYSIZE(histogram) - 1; i++) {
+        if (!latency[i])
+            continue;
+        int written = _snwprintf_s(histogram + length, ARRAYSIZE(histogram) - length, _TRUNCATE,
+            i == STATS_LATENCY_BUCKETS - 1 ? L" >=%lluus:%llu" : L" <%lluus:%llu",
+            i == STATS_LATENCY_BUCKETS - 1 ? 1ULL << (i - 1) : 1ULL << i, latency[i]);
+        if (written < 0)
+            break;
+        length += written;
+    }
+    Wh_Log(L"[Process %d] %s %s latency:%s", GetCurrentProcessId(), scope, name,
+        length ? histogram : L" none");
+}
+
+// Log a stats report
+VOID LogStatsTotals(PCWSTR scope, const StatsTotals& totals) {
+    Wh_Log(L"[Process %d] %s stats (%lu processes): %llu hooked messages, %llu registry reads, "
+        L"%llu DWM calls, %llu frame changes, %llu skipped applies, %llu deferred frame changes, "
+        L"%llu KB committed at init",
+        GetCurrentProcessId(), scope, totals.processes, totals.hookedMessages, totals.registryReads,
+        totals.dwmCalls, totals.frameChanges, totals.appliesSkipped, totals.framesDeferred,
+        totals.committedBytes / 1024);
+    LogLatencyHistogram(scope, L"apply", totals.applyLatency);
+    LogLatencyHistogram(scope, L"perceived", totals.perceivedLatency);
+}
+
+// Log the counters of this process
+VOID LogProcessStats() {
+    StatsTotals totals = {};
+    totals.processes = 1;
+    AddStatsTotals(&totals, *g_stats);
+    LogStatsTotals(L"Process", totals);
+}
+
+// Aggregate the slots of all processes (including those that already released
+// theirs) into a session-wide report
+VOID LogSessionStats() {
+    if (!g_sharedStats)
+        return;
+    
+    StatsTotals totals = {};
+    totals.processes = g_sharedStats->retiredProcesses.load(std::memory_order_relaxed);
+    AddStatsTotals(&totals, g_sharedStats->retired);
+    for (const ProcessStatsSlot& slot : g_sharedStats->slots) {
+        if (slot.processId.load(std::memory_order_acquire) != 0) {
+            totals.processes++;
+            AddStatsTotals(&totals, slot);
+        }
+    }
+    LogStatsTotals(L"Session", totals);
+}
+
+VOID CALLBACK StatsReportTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    LogSessionStats();
+}
+
+// Log a session report once the processes had time to apply a theme change
+VOID ScheduleSessionStatsReport() {
+    if (!g_statsReportTimer)
+        return;
+    
+    ULARGE_INTEGER dueTime;
+    dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)STATS_REPORT_DELAY_MS * 10000);
+    FILETIME ftDueTime;
+    ftDueTime.dwLowDateTime = dueTime.LowPart;
+    ftDueTime.dwHighDateTime = dueTime.HighPart;
+    SetThreadpoolTimer(g_statsReportTimer, &ftDueTime, 0, 0);
+}
+
+// Fold this process's counters into the retired totals and release its slot
+VOID CloseProcessStats() {
+    if (g_statsReportTimer) {
+        SetThreadpoolTimer(g_statsReportTimer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(g_statsReportTimer, TRUE);
+        CloseThreadpoolTimer(g_statsReportTimer);
+        g_statsReportTimer = nullptr;
+    }
+    
+    if (!g_sharedStats)
+        return;
+    
+    if (g_stats != &g_localStats) {
+        RetireStatsSlot(*g_stats);
+        
+        // Keep counting locally, nothing should be left running at this point
+        ProcessStatsSlot* slot = g_stats;
+        g_stats = &g_localStats;
+        slot->processStartTime.store(0, std::memory_order_relaxed);
+        slot->initialPassPending.store(0, std::memory_order_relaxed);
+        slot->processId.store(0, std::memory_order_release);
+    }
+    
+    UnmapViewOfFile(g_sharedStats);
+    g_sharedStats = nullptr;
+    CloseHandle(g_sharedStatsMapping);
+    g_sharedStatsMapping = nullptr;
+}
+
+// Read a consistent snapshot of the shared theme state. Returns FALSE if there
+// is no shared state, nothing was published yet, or no consistent snapshot
+// could be read; callers then keep their local cache.
+BOOL ReadSharedThemeState(BOOL* isDark, LONG* generation) {
+    if (!g_sharedTheme)
+        return FALSE;
+    
+    LONG seq, dark, gen;
+    for (int spins = 0;; spins++) {
+        if (spins == SHARED_THEME_READ_SPINS)
+            return FALSE;
+        
+        seq = g_sharedTheme->seq.load(std::memory_order_acquire);
+        dark = g_sharedTheme->isDark.load(std::memory_order_relaxed);
+        gen = g_sharedTheme->generation.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!(seq & 1) && seq == g_sharedTheme->seq.load(std::memory_order_relaxed))
+            break;
+        YieldProcessor();
+    }
+    
+    if (gen == 0)
+        return FALSE;
+    
+    if (isDark)
+        *isDark = dark != 0;
+    if (generation)
+        *generation = gen;
+    return TRUE;
+}
+
+// Create (or open) the manual-reset event that is set when the given
+// generation is published
+HANDLE OpenThemeGenerationEvent(LONG generation) {
+    WCHAR name[64];
+    swprintf_s(name, ARRAYSIZE(name), THEME_GENERATION_EVENT_FORMAT, generation);
+    
+    SECURITY_ATTRIBUTES sa;
+    BOOL hasSecurity = InitSharedObjectSecurity(&sa);
+    HANDLE hEvent = CreateEventW(hasSecurity ? &sa : nullptr, TRUE, FALSE, name);
+    if (hasSecurity) {
+        LocalFree(sa.lpSecurityDescriptor);
+    }
+    return hEvent;
+}
+
+// Publish the dark flag (writer only). The generation is bumped and waiting
+// processes are woken only when the value actually changed.
+VOID PublishSharedThemeState(BOOL isDark) {
+    LONG seq = g_sharedTheme->seq.load(std::memory_order_relaxed);
+    for (int spins = 0;; spins++) {
+        if (!(seq & 1) && g_sharedTheme->seq.compare_exchange_weak(seq, seq + 1,
+            std::memory_order_relaxed)) {
+            break;
+        }
+        
+        // Only the writer publishes, so a write that stays in progress was
+        // left by a previous writer that died; finish it instead
+        if ((seq & 1) && spins >= SHARED_THEME_READ_SPINS) {
+            seq--;
+            break;
+        }
+        YieldProcessor();
+        seq = g_sharedTheme->seq.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    
+    LONG generation = g_sharedTheme->generation.load(std::memory_order_relaxed);
+    BOOL changed = generation == 0 ||
+        (g_sharedTheme->isDark.load(std::memory_order_relaxed) != 0) != (isDark != 0);
+    if (changed) {
+        generation++;
+        g_sharedTheme->isDark.store(isDark ? 1 : 0, std::memory_order_relaxed);
+        g_sharedTheme->generation.store(generation, std::memory_order_relaxed);
+        g_sharedTheme->publishTime.store(StatsStartTiming(), std::memory_order_relaxed);
+    }
+    
+    g_sharedTheme->seq.store(seq + 2, std::memory_order_release);
+    
+    if (changed) {
+        HANDLE hEvent = OpenThemeGenerationEvent(generation);
+        if (hEvent) {
+            SetEvent(hEvent);
+            CloseHandle(hEvent);
+        }
+        Wh_Log(L"[Process %d] Published theme generation %ld (%s)",
+            GetCurrentProcessId(), generation, isDark ? L"DARK" : L"LIGHT");
+        ScheduleSessionStatsReport();
+    }
+}
+
+BOOL IsProcessRunning(DWORD processId);
+
+// Claim the writer role if nobody holds it, or if its holder died without
+// resigning and nobody was watching it
+BOOL TryBecomeThemeWriter() {
+    if (!g_sharedTheme)
+        return FALSE;
+    if (g_isThemeWriter)
+        return TRUE;
+    
+    DWORD expected = 0;
+    if (!g_sharedTheme->writerPid.compare_exchange_strong(expected, GetCurrentProcessId()) &&
+        (expected == GetCurrentProcessId() || IsProcessRunning(expected) ||
+        !g_sharedTheme->writerPid.compare_exchange_strong(expected, GetCurrentProcessId())))
+        return FALSE;
+    
+    g_isThemeWriter = TRUE;
+    Wh_Log(L"[Process %d] Elected as theme state writer", GetCurrentProcessId());
+    return TRUE;
+}
+
+// Give up the writer role so another process can take over
+VOID ResignThemeWriter() {
+    if (!g_isThemeWriter.exchange(FALSE))
+        return;
+    
+    DWORD expected = GetCurrentProcessId();
+    g_sharedTheme->writerPid.compare_exchange_strong(expected, 0);
+}
+
+VOID WatchThemeWriter();
+
+// Take over the writer role of a writer process that exited, whether it
+// resigned or not. The processes that lose the race watch the new writer.
+VOID CALLBACK ThemeWriterExitedCallback(PVOID lpParameter, BOOLEAN timerOrWaitFired) {
+    DWORD writerPid = (DWORD)(ULONG_PTR)lpParameter;
+    g_watchedWriterPid = 0;
+    
+    DWORD expected = writerPid;
+    if (!g_sharedTheme->writerPid.compare_exchange_strong(expected, GetCurrentProcessId()) &&
+        (expected != 0 || !g_sharedTheme->writerPid.compare_exchange_strong(expected, GetCurrentProcessId()))) {
+        WatchThemeWriter();
+        return;
+    }
+    
+    g_isThemeWriter = TRUE;
+    Wh_Log(L"[Process %d] Theme state writer %lu exited, taking over",
+        GetCurrentProcessId(), writerPid);
+    
+    AcquireSRWLockShared(&g_themeWaitLock);
+    BOOL stopping = g_themeWaitStopping;
+    ReleaseSRWLockShared(&g_themeWaitLock);
+    if (stopping || !StartThemeWatcher()) {
+        ResignThemeWriter();
+        return;
+    }
+    
+    UpdateThemeMode(g_cachedDarkMode);
+}
+
+// Unregister a generation or writer wait without blocking, it may be the wait
+// whose callback is running. The callback is tracked until it has returned.
+// Called with g_themeWaitLock held exclusively.
+VOID RetireThemeWait(HANDLE wait) {
+    // Forget the callbacks that are done
+    g_retiredThemeWaits.erase(std::remove_if(g_retiredThemeWaits.begin(), g_retiredThemeWaits.end(),
+        [](HANDLE done) {
+            if (WaitForSingleObject(done, 0) != WAIT_OBJECT_0)
+                return false;
+            CloseHandle(done);
+            return true;
+        }), g_retiredThemeWaits.end());
+    
+    HANDLE done = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!done) {
+        UnregisterWait(wait);
+        return;
+    }
+    UnregisterWaitEx(wait, done);
+    g_retiredThemeWaits.push_back(done);
+}
+
+// Watch the current writer process so the role can be taken over if it dies
+VOID WatchThemeWriter() {
+    DWORD writerPid = g_sharedTheme->writerPid.load(std::memory_order_relaxed);
+    if (writerPid == g_watchedWriterPid.load(std::memory_order_relaxed))
+        return;
+    
+    AcquireSRWLockExclusive(&g_themeWaitLock);
+    
+    if (g_themeWaitStopping || writerPid == g_watchedWriterPid) {
+        ReleaseSRWLockExclusive(&g_themeWaitLock);
+        return;
+    }
+    
+    if (g_writerWait) {
+        RetireThemeWait(g_writerWait);
+        g_writerWait = nullptr;
+    }
+    if (g_writerProcess) {
+        CloseHandle(g_writerProcess);
+        g_writerProcess = nullptr;
+    }
+    g_watchedWriterPid = writerPid;
+    
+    if (writerPid && writerPid != GetCurrentProcessId()) {
+        g_writerProcess = OpenProcess(SYNCHRONIZE, FALSE, writerPid);
+        if (g_writerProcess && !RegisterWaitForSingleObject(&g_writerWait, g_writerProcess,
+            ThemeWriterExitedCallback, (PVOID)(ULONG_PTR)writerPid, INFINITE, WT_EXECUTEONLYONCE)) {
+            g_writerWait = nullptr;
+        }
+    }
+    
+    ReleaseSRWLockExclusive(&g_themeWaitLock);
+}
+
+VOID CALLBACK ThemeGenerationCallback(PVOID lpParameter, BOOLEAN timerOrWaitFired);
+
+// Arm a wait for the generation after the given one
+VOID ArmThemeGenerationWait(LONG generation) {
+    AcquireSRWLockExclusive(&g_themeWaitLock);
+    
+    if (!g_themeWaitStopping) {
+        if (g_generationWait) {
+            RetireThemeWait(g_generationWait);
+            g_generationWait = nullptr;
+        }
+        if (g_generationEvent) {
+            CloseHandle(g_generationEvent);
+            g_generationEvent = nullptr;
+        }
+        
+        g_generationEvent = OpenThemeGenerationEvent(generation + 1);
+        if (g_generationEvent && !RegisterWaitForSingleObject(&g_generationWait, g_generationEvent,
+            ThemeGenerationCallback, (PVOID)(LONG_PTR)generation, INFINITE, WT_EXECUTEONLYONCE)) {
+            g_generationWait = nullptr;
+        }
+    }
+    
+    ReleaseSRWLockExclusive(&g_themeWaitLock);
+}
+
+// Switch the process to the given theme and re-apply it to all windows
+VOID UpdateThemeMode(BOOL newDarkMode) {
+    if (g_isDarkMode.exchange(newDarkMode) == newDarkMode)
+        return;
+    
+    Wh_Log(L"[Process %d] Theme changed to %s mode", 
+        GetCurrentProcessId(), newDarkMode ? L"DARK" : L"LIGHT");
+    
+    // Time until the foreground window is themed, from when the change was
+    // published (or seen here, without the shared state)
+    LONGLONG changeTime = g_sharedTheme ? g_sharedTheme->publishTime.load(std::memory_order_relaxed) : 0;
+    g_themeChangeTime = changeTime ? changeTime : StatsStartTiming();
+    g_perceivedWindow = GetForegroundWindow();
+    
+    // Apply to all windows in current process
+    ApplyToAllWindows(newDarkMode);
+    
+    // And to the windows the watcher serves
+    if (g_watcherThreadId) {
+        PostThreadMessageW(g_watcherThreadId, WATCHER_APPLY_MSG, (WPARAM)newDarkMode, 0);
+    }
+}
+
+// Called when the writer published a new generation, the parameter is the
+// generation that was current when the wait was armed
+VOID CALLBACK ThemeGenerationCallback(PVOID lpParameter, BOOLEAN timerOrWaitFired) {
+    BOOL isDark;
+    LONG generation;
+    if (!ReadSharedThemeState(&isDark, &generation)) {
+        // Keep the cached theme and wait for the generation after the one
+        // that was signaled
+        ArmThemeGenerationWait((LONG)(LONG_PTR)lpParameter + 1);
+        return;
+    }
+    
+    g_cachedDarkMode = isDark;
+    
+    // Re-arm first, then re-read so a generation published in between isn't missed
+    for (;;) {
+        ArmThemeGenerationWait(generation);
+        
+        LONG latestGeneration;
+        if (!ReadSharedThemeState(&isDark, &latestGeneration) || latestGeneration == generation)
+            break;
+        generation = latestGeneration;
+    }
+    
+    WatchThemeWriter();
+    UpdateThemeMode(isDark);
+}
+
+// Stop all waits and release the shared theme state
+VOID CloseSharedThemeState() {
+    AcquireSRWLockExclusive(&g_themeWaitLock);
+    g_themeWaitStopping = TRUE;
+    HANDLE generationWait = g_generationWait;
+    HANDLE writerWait = g_writerWait;
+    g_generationWait = nullptr;
+    g_writerWait = nullptr;
+    ReleaseSRWLockExclusive(&g_themeWaitLock);
+    
+    // Block until running callbacks are done, including those of the waits
+    // they replaced. Those can't retire more waits once stopping is set.
+    if (generationWait) {
+        UnregisterWaitEx(generationWait, INVALID_HANDLE_VALUE);
+    }
+    if (writerWait) {
+        UnregisterWaitEx(writerWait, INVALID_HANDLE_VALUE);
+    }
+    AcquireSRWLockExclusive(&g_themeWaitLock);
+    std::vector<HANDLE> retiredWaits;
+    retiredWaits.swap(g_retiredThemeWaits);
+    ReleaseSRWLockExclusive(&g_themeWaitLock);
+    for (HANDLE done : retiredWaits) {
+        WaitForSingleObject(done, INFINITE);
+        CloseHandle(done);
+    }
+    StopThemeWatcher();
+    if (g_generationEvent) {
+        CloseHandle(g_generationEvent);
+        g_generationEvent = nullptr;
+    }
+    if (g_writerProcess) {
+        CloseHandle(g_writerProcess);
+        g_writerProcess = nullptr;
+    }
+    
+    if (g_sharedTheme) {
+        ResignThemeWriter();
+        UnmapViewOfFile(g_sharedTheme);
+        g_sharedTheme = nullptr;
+    }
+    if (g_sharedThemeMapping) {
+        CloseHandle(g_sharedThemeMapping);
+        g_sharedThemeMapping = nullptr;
+    }
+}
+
+// Re-evaluate the theme after a change broadcast. The registry is only read by
+// the watcher, here the published (or cached) state is used.
+VOID ReevaluateThemeMode() {
+    // May still be the old value if the writer hasn't seen the change yet,
+    // in that case the generation event delivers it
+    BOOL newDarkMode;
+    if (!ReadSharedThemeState(&newDarkMode, nullptr)) {
+        newDarkMode = g_cachedDarkMode;
+    }
+    
+    UpdateThemeMode(newDarkMode);
+}
+
+// Tell theme related broadcasts apart from the rest of the WM_SETTINGCHANGE
+// traffic (environment, policy, ShellState sent by other mods, etc.)
+BOOL IsThemeSettingChange(UINT Msg, LPARAM lParam) {
+    if (Msg == WM_DWMCOLORIZATIONCOLORCHANGED)
+        return TRUE;
+    
+    LPCWSTR section = (LPCWSTR)lParam;
+    if (!section)
+        return FALSE;
+    
+    return wcscmp(section, L"ImmersiveColorSet") == 0 ||
+        wcscmp(section, L"WindowsThemeElement") == 0;
+}
+
+VOID CALLBACK ReevaluateTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    // Clear first, a broadcast arriving from now on starts a new epoch
+    g_reevaluatePending = FALSE;
+    ReevaluateThemeMode();
+}
+
+// Coalesce the broadcasts of one change epoch (one per top-level window, often
+// several sections) into a single re-evaluation shortly after the first one
+VOID ScheduleThemeReevaluation() {
+    if (g_reevaluatePending.exchange(TRUE))
+        return;
+    
+    if (!g_reevaluateTimer) {
+        g_reevaluatePending = FALSE;
+        ReevaluateThemeMode();
+        return;
+    }
+    
+    ULARGE_INTEGER dueTime;
+    dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)THEME_REEVALUATE_DELAY_MS * 10000);
+    FILETIME ftDueTime;
+    ftDueTime.dwLowDateTime = dueTime.LowPart;
+    ftDueTime.dwHighDateTime = dueTime.HighPart;
+    SetThreadpoolTimer(g_reevaluateTimer, &ftDueTime, 0, 0);
+}
+
+// Lowercase a string for rule matching
+std::wstring ToLowerRuleString(PCWSTR str) {
+    std::wstring result(str);
+    for (WCHAR& c : result) {
+        c = towlower(c);
+    }
+    return result;
+}
+
+// Compile a process name glob
+CompiledGlob CompileGlob(const std::wstring& pattern, OrderedVerdict verdict) {
+    CompiledGlob glob;
+    glob.anchoredStart = pattern.front() != L'*';
+    glob.anchoredEnd = pattern.back() != L'*';
+    glob.verdict = verdict;
+    
+    size_t start = 0;
+    while (start <= pattern.size()) {
+        size_t end = pattern.find(L'*', start);
+        if (end == std::wstring::npos) {
+            end = pattern.size();
+        }
+        if (end > start) {
+            glob.segments.push_back(pattern.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return glob;
+}
+
+// Check a literal segment (with '?' wildcards) against the text at str
+static BOOL GlobSegmentMatches(const std::wstring& segment, const WCHAR* str) {
+    for (size_t i = 0; i < segment.size(); i++) {
+        if (segment[i] != L'?' && segment[i] != str[i])
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Match a lowercase string against a compiled glob
+BOOL MatchGlob(const CompiledGlob& glob, const WCHAR* str, size_t len) {
+    size_t pos = 0;
+    size_t count = glob.segments.size();
+    for (size_t i = 0; i < count; i++) {
+        const std::wstring& segment = glob.segments[i];
+        
+        if (i == 0 && glob.anchoredStart) {
+            if (len < segment.size() || !GlobSegmentMatches(segment, str))
+                return FALSE;
+            pos = segment.size();
+        } else if (i == count - 1 && glob.anchoredEnd) {
+            return len >= pos + segment.size() &&
+                GlobSegmentMatches(segment, str + len - segment.size());
+        } else {
+            // Leftmost match leaves the most room for the remaining segments
+            BOOL found = FALSE;
+            for (; pos + segment.size() <= len; pos++) {
+                if (GlobSegmentMatches(segment, str + pos)) {
+                    found = TRUE;
+                    break;
+                }
+            }
+            if (!found)
+                return FALSE;
+            pos += segment.size();
+        }
+    }
+    
+    return !glob.anchoredEnd || pos == len;
+}
+
+// Parse a policy color: RRGGBB (optionally prefixed with '#') or "none".
+// Returns FALSE for an empty or invalid value, which leaves the attribute unset.
+BOOL ParsePolicyColor(PCWSTR value, COLORREF* color) {
+    if (_wcsicmp(value, L"none") == 0) {
+        *color = DWMWA_COLOR_NONE;
+        return TRUE;
+    }
+    
+    if (*value == L'#') {
+        value++;
+    }
+    if (wcslen(value) != 6)
+        return FALSE;
+    
+    WCHAR* end;
+    DWORD rgb = wcstoul(value, &end, 16);
+    if (*end)
+        return FALSE;
+    
+    *color = RGB((rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF);
+    return TRUE;
+}
+
+// Read a policy color setting into an attribute set
+VOID LoadPolicyColor(DwmAttributeSet* set, DWORD attribute, COLORREF* color,
+    PCWSTR settingFormat, int index) {
+    PCWSTR value = Wh_GetStringSetting(settingFormat, index);
+    if (*value) {
+        if (ParsePolicyColor(value, color)) {
+            set->mask |= attribute;
+        } else {
+            Wh_Log(L"[Process %d] WARNING: Invalid policy color %s", GetCurrentProcessId(), value);
+        }
+    }
+    Wh_FreeStringSetting(value);
+}
+
+// Find a policy by name (case insensitive), POLICY_INHERIT if there is none
+BYTE FindPolicy(PCWSTR name) {
+    for (size_t i = 1; i < g_policies.size(); i++) {
+        if (_wcsicmp(g_policies[i].name.c_str(), name) == 0)
+            return (BYTE)i;
+    }
+    return POLICY_INHERIT;
+}
+
+// Compile the attribute policies into precomputed attribute sets for both
+// theme modes, so a theme change only selects the other set
+VOID CompilePolicies() {
+    g_policies.clear();
+    
+    // [0] is the default policy, dark mode only unless configured
+    ThemePolicy defaultPolicy = {};
+    defaultPolicy.sets[1].darkMode = TRUE;
+    g_policies.push_back(defaultPolicy);
+    
+    for (int i = 0; g_policies.size() <= MAX_THEME_POLICIES; i++) {
+        PCWSTR name = Wh_GetStringSetting(L"policies[%d].name", i);
+        if (!*name) {
+            Wh_FreeStringSetting(name);
+            break;
+        }
+        
+        ThemePolicy policy = {};
+        policy.name = name;
+        Wh_FreeStringSetting(name);
+        
+        for (int dark = 0; dark < 2; dark++) {
+            DwmAttributeSet& set = policy.sets[dark];
+            set.darkMode = dark;
+            LoadPolicyColor(&set, ATTRIBUTE_CAPTION_COLOR, &set.captionColor,
+                dark ? L"policies[%d].captionColorDark" : L"policies[%d].captionColorLight", i);
+            LoadPolicyColor(&set, ATTRIBUTE_BORDER_COLOR, &set.borderColor,
+                dark ? L"policies[%d].borderColorDark" : L"policies[%d].borderColorLight", i);
+            LoadPolicyColor(&set, ATTRIBUTE_TEXT_COLOR, &set.textColor,
+                dark ? L"policies[%d].textColorDark" : L"policies[%d].textColorLight", i);
+        }
+        
+        PCWSTR backdrop = Wh_GetStringSetting(L"policies[%d].backdrop", i);
+        static const PCWSTR backdropNames[] = { L"auto", L"none", L"mica", L"acrylic", L"tabbed" };
+        for (int type = 0; type < (int)ARRAYSIZE(backdropNames); type++) {
+            if (wcscmp(backdrop, backdropNames[type]) == 0) {
+                for (DwmAttributeSet& set : policy.sets) {
+                    set.mask |= ATTRIBUTE_BACKDROP;
+                    set.backdrop = type;    // DWMSBT_AUTO .. DWMSBT_TABBEDWINDOW
+                }
+            }
+        }
+        Wh_FreeStringSetting(backdrop);
+        
+        g_policies.push_back(policy);
+    }
+    
+    PCWSTR defaultPolicyName = Wh_GetStringSetting(L"defaultPolicy");
+    if (*defaultPolicyName) {
+        BYTE index = FindPolicy(defaultPolicyName);
+        if (index != POLICY_INHERIT) {
+            g_policies[0].sets[0] = g_policies[index].sets[0];
+            g_policies[0].sets[1] = g_policies[index].sets[1];
+        } else {
+            Wh_Log(L"[Process %d] WARNING: Unknown default policy %s",
+                GetCurrentProcessId(), defaultPolicyName);
+        }
+    }
+    Wh_FreeStringSetting(defaultPolicyName);
+}
+
+// Add a single rule from the settings, order is its index in the rule list
+VOID AddRule(PCWSTR target, PCWSTR type, PCWSTR action, PCWSTR policy, int order) {
+    RuleVerdict verdict = { RULE_SKIP, POLICY_INHERIT };
+    if (wcscmp(action, L"follow") == 0) {
+        verdict.action = RULE_FOLLOW;
+    } else if (wcscmp(action, L"dark") == 0) {
+        verdict.action = RULE_DARK;
+    } else if (wcscmp(action, L"light") == 0) {
+        verdict.action = RULE_LIGHT;
+    }
+    
+    if (*policy) {
+        verdict.policy = FindPolicy(policy);
+        if (verdict.policy == POLICY_INHERIT) {
+            Wh_Log(L"[Process %d] WARNING: Rule for %s uses unknown policy %s",
+                GetCurrentProcessId(), target, policy);
+        }
+    }
+    
+    std::wstring name = ToLowerRuleString(target);
+    if (wcscmp(type, L"class") == 0) {
+        g_classRules.emplace(name, verdict);
+    } else if (name.find_first_of(L"*?") != std::wstring::npos) {
+        g_processGlobs.push_back(CompileGlob(name, OrderedVerdict{ verdict, order }));
+    } else {
+        g_processRules.emplace(name, OrderedVerdict{ verdict, order });
+    }
+}
+
+// Compile the built-in and user rules into the lookup tables. The policies
+// must be compiled first.
+VOID CompileRules() {
+    g_processRules.clear();
+    g_processGlobs.clear();
+    g_classRules.clear();
+    
+    // Built-in exclusions, these come first so they can't be overridden
+    g_processRules.emplace(L"systemsettings.exe", OrderedVerdict{ { RULE_SKIP, POLICY_INHERIT }, -1 });
+    g_processRules.emplace(L"applicationframehost.exe", OrderedVerdict{ { RULE_SKIP, POLICY_INHERIT }, -1 }); // UWP app host
+    
+    for (int i = 0;; i++) {
+        PCWSTR target = Wh_GetStringSetting(L"rules[%d].target", i);
+        if (!*target) {
+            Wh_FreeStringSetting(target);
+            break;
+        }
+        
+        PCWSTR type = Wh_GetStringSetting(L"rules[%d].type", i);
+        PCWSTR action = Wh_GetStringSetting(L"rules[%d].action", i);
+        PCWSTR policy = Wh_GetStringSetting(L"rules[%d].policy", i);
+        AddRule(target, type, action, policy, i);
+        Wh_FreeStringSetting(policy);
+        Wh_FreeStringSetting(action);
+        Wh_FreeStringSetting(type);
+        Wh_FreeStringSetting(target);
+    }
+    
+    if (!g_classRules.empty() && !g_classAtomVerdicts) {
+        g_classAtomVerdicts = new std::atomic<BYTE>[0x10000]();
+    }
+    
+    Wh_Log(L"[Process %d] Compiled %zu process rules, %zu process globs, %zu class rules",
+        GetCurrentProcessId(), g_processRules.size(), g_processGlobs.size(), g_classRules.size());
+}
+
+// Find the rule verdict for an executable path. An exact name rule only wins
+// over the globs listed after it.
+RuleVerdict ClassifyProcessPath(PCWSTR exePath) {
+    RuleVerdict noRule = { RULE_FOLLOW, POLICY_INHERIT };
+    
+    // Get just the filename
+    PCWSTR fileName = wcsrchr(exePath, L'\\');
+    if (fileName) {
+        fileName++; // Skip the backslash
+    } else {
+        fileName = exePath;
+    }
+    
+    std::wstring name = ToLowerRuleString(fileName);
+    auto it = g_processRules.find(name);
+    const OrderedVerdict* match = it != g_processRules.end() ? &it->second : nullptr;
+    
+    // Globs are kept in rule order
+    for (const CompiledGlob& glob : g_processGlobs) {
+        if (match && glob.verdict.order > match->order)
+            break;
+        if (MatchGlob(glob, name.c_str(), name.size()))
+            return glob.verdict.verdict;
+    }
+    
+    return match ? match->verdict : noRule;
+}
+
+// Find the rule verdict for the current process
+RuleVerdict ClassifyProcess() {
+    WCHAR exePath[MAX_PATH];
+    if (GetModuleFileNameW(nullptr, exePath, MAX_PATH) == 0)
+        return RuleVerdict{ RULE_FOLLOW, POLICY_INHERIT };
+    
+    return ClassifyProcessPath(exePath);
+}
+
+// Find the rule verdict for another process, by its executable path
+RuleVerdict ClassifyProcessHandle(HANDLE hProcess) {
+    RuleVerdict verdict = { RULE_FOLLOW, POLICY_INHERIT };
+    WCHAR exePath[MAX_PATH];
+    DWORD size = ARRAYSIZE(exePath);
+    if (QueryFullProcessImageNameW(hProcess, 0, exePath, &size)) {
+        verdict = ClassifyProcessPath(exePath);
+    }
+    return verdict;
+}
+
+// Look up the class rule for a window by class name
+RuleVerdict LookupClassRule(HWND hWnd) {
+    RuleVerdict verdict = { RULE_FOLLOW, POLICY_INHERIT };
+    WCHAR className[256];
+    if (!g_classRules.empty() && GetClassNameW(hWnd, className, ARRAYSIZE(className))) {
+        auto it = g_classRules.find(ToLowerRuleString(className));
+        if (it != g_classRules.end()) {
+            verdict = it->second;
+        }
+    }
+    return verdict;
+}
+
+// Find the class rule verdict for a window. After the first window of a class
+// this is a single table lookup by class atom.
+RuleVerdict GetClassRuleVerdict(HWND hWnd) {
+    RuleVerdict verdict = { RULE_FOLLOW, POLICY_INHERIT };
+    if (!g_classAtomVerdicts)
+        return verdict;
+    
+    ATOM atom = (ATOM)GetClassLongW(hWnd, GCW_ATOM);
+    if (atom) {
+        BYTE packed = g_classAtomVerdicts[atom].load(std::memory_order_relaxed);
+        if (packed) {
+            verdict.action = (RuleAction)((packed - 1) & 3);
+            verdict.policy = (BYTE)((packed - 1) >> 2);
+            return verdict;
+        }
+    }
+    
+    verdict = LookupClassRule(hWnd);
+    
+    if (atom) {
+        g_classAtomVerdicts[atom].store((BYTE)(1 + verdict.action + verdict.policy * 4),
+            std::memory_order_relaxed);
+    }
+    return verdict;
+}
+
+// Resolve the applied state (policy and dark mode) from the class and process
+// rules and the system theme. A class rule overrides the process rule.
+int ResolveRuleState(RuleVerdict classVerdict, RuleVerdict processVerdict, BOOL systemDarkMode) {
+    RuleAction action = classVerdict.action != RULE_FOLLOW ? classVerdict.action : processVerdict.action;
+    BYTE policy = classVerdict.policy != POLICY_INHERIT ? classVerdict.policy : processVerdict.policy;
+    
+    BOOL dark = systemDarkMode ? TRUE : FALSE;
+    if (action == RULE_DARK) {
+        dark = TRUE;
+    } else if (action == RULE_LIGHT) {
+        dark = FALSE;
+    }
+    return policy * 2 + dark;
+}
+
+// Resolve the applied state for a window of the current process
+int ResolveAppliedState(HWND hWnd, BOOL systemDarkMode) {
+    return ResolveRuleState(GetClassRuleVerdict(hWnd),
+        RuleVerdict{ g_processAction, g_processPolicy }, systemDarkMode);
+}
+
+// The attribute set for an applied state
+const DwmAttributeSet& GetAttributeSet(int state) {
+    return g_policies[state / 2].sets[state % 2];
+}
+
+// Load settings from Windhawk configuration
+VOID LoadSettings() {
+    PCWSTR hookMode = Wh_GetStringSetting(L"hookMode");
+    if (hookMode && wcscmp(hookMode, L"subclass") == 0) {
+        g_settings.hookMode = HOOK_MODE_SUBCLASS;
+    } else if (hookMode && wcscmp(hookMode, L"lazy") == 0) {
+        g_settings.hookMode = HOOK_MODE_LAZY;
+    } else {
+        g_settings.hookMode = HOOK_MODE_GLOBAL;
+    }
+    if (hookMode) {
+        Wh_FreeStringSetting(hookMode);
+    }
+    
+    g_settings.initialFrameChangesPerSecond = Wh_GetIntSetting(L"initialFrameChangesPerSecond");
+    if (g_settings.initialFrameChangesPerSecond < 0) {
+        g_settings.initialFrameChangesPerSecond = 0;
+    }
+    
+    g_settings.darkControls = Wh_GetIntSetting(L"darkControls");
+    g_settings.watcherMode = Wh_GetIntSetting(L"watcherMode");
+    
+    PCWSTR logLevel = Wh_GetStringSetting(L"logLevel");
+    if (logLevel && wcscmp(logLevel, L"off") == 0) {
+        g_logLevel = LOG_LEVEL_OFF;
+    } else if (logLevel && wcscmp(logLevel, L"verbose") == 0) {
+        g_logLevel = LOG_LEVEL_VERBOSE;
+    } else {
+        g_logLevel = LOG_LEVEL_WARNING;
+    }
+    if (logLevel) {
+        Wh_FreeStringSetting(logLevel);
+    }
+    
+    CompilePolicies();
+    CompileRules();
+}
+
+// Classify the process against the rules, run once by IsProcessExcluded
+BOOL CALLBACK ClassifyProcessOnce(PINIT_ONCE initOnce, PVOID parameter, PVOID* context) {
+    RuleVerdict verdict = ClassifyProcess();
+    g_processAction = verdict.action;
+    g_processPolicy = verdict.policy;
+    if (g_processAction == RULE_SKIP) {
+        Wh_Log(L"[Process %d] Process excluded by rule", GetCurrentProcessId());
+    }
+    return TRUE;
+}
+
+// Check if current process should be excluded. Classified once, from
+// Wh_ModInit, before any hook is installed; the rules must be loaded.
+BOOL IsProcessExcluded() {
+    InitOnceExecuteOnce(&g_processClassifyOnce, ClassifyProcessOnce, nullptr, nullptr);
+    return g_processAction == RULE_SKIP;
+}
+
+// Check if a window is a captioned top-level window
+BOOL HasEligibleStyle(HWND hWnd) {
+    // Get window styles
+    LONG style = GetWindowLongW(hWnd, GWL_STYLE);
+    LONG styleEx = GetWindowLongW(hWnd, GWL_EXSTYLE);
+    
+    // Must have a titlebar (caption)
+    if (!(style & WS_CAPTION))
+        return FALSE;
+        
+    // Skip tool windows
+    if (styleEx & WS_EX_TOOLWINDOW)
+        return FALSE;
+        
+    // Skip child windows
+    if (style & WS_CHILD)
+        return FALSE;
+    
+    return TRUE;
+}
+
+// Check if window is eligible for dark mode
+BOOL IsWindowEligible(HWND hWnd) {
+    if (!hWnd || !IsWindow(hWnd))
+        return FALSE;
+    
+    if (!HasEligibleStyle(hWnd))
+        return FALSE;
+    
+    // Skip window classes excluded by a rule
+    if (GetClassRuleVerdict(hWnd).action == RULE_SKIP)
+        return FALSE;
+    
+    return TRUE;
+}
+
+// Resolve the uxtheme dark mode ordinals and let the process use dark menus
+VOID InitDarkControls() {
+    if (!g_settings.darkControls)
+        return;
+    
+    HMODULE hUxtheme = GetModuleHandleW(L"uxtheme.dll");
+    if (hUxtheme) {
+        // Ordinal 133 is AllowDarkModeForWindow, 135 is SetPreferredAppMode
+        g_AllowDarkModeForWindow = (pAllowDarkModeForWindow)(void*)GetProcAddress(
+            hUxtheme, MAKEINTRESOURCEA(133));
+        g_SetPreferredAppMode = (pSetPreferredAppMode)(void*)GetProcAddress(
+            hUxtheme, MAKEINTRESOURCEA(135));
+    }
+    // An app that picked its own mode (e.g. forced dark) keeps it
+    if (g_SetPreferredAppMode) {
+        int previousMode = g_SetPreferredAppMode(PREFERRED_APP_MODE_ALLOW_DARK);
+        if (previousMode == PREFERRED_APP_MODE_DEFAULT) {
+            g_previousAppMode = previousMode;
+        } else if (previousMode != PREFERRED_APP_MODE_ALLOW_DARK) {
+            g_SetPreferredAppMode(previousMode);
+        }
+    }
+    
+    g_controlClassVerdicts = new std::atomic<BYTE>[0x10000]();
+}
+
+// Restore the preferred app mode the process had and free the class cache
+VOID StopDarkControls() {
+    if (g_SetPreferredAppMode && g_previousAppMode >= 0) {
+        g_SetPreferredAppMode(g_previousAppMode);
+        g_previousAppMode = -1;
+    }
+    delete[] g_controlClassVerdicts;
+    g_controlClassVerdicts = nullptr;
+}
+
+// Find the dark control class of a window, nullptr if it isn't one. After the
+// first control of a class this is a single table lookup by class atom.
+const DarkControlClass* GetDarkControlClass(HWND hWnd) {
+    ATOM atom = (ATOM)GetClassLongW(hWnd, GCW_ATOM);
+    if (atom) {
+        BYTE verdict = g_controlClassVerdicts[atom].load(std::memory_order_relaxed);
+        if (verdict)
+            return verdict >= 2 ? &g_darkControlClasses[verdict - 2] : nullptr;
+    }
+    
+    BYTE verdict = 1;
+    WCHAR className[256];
+    if (GetClassNameW(hWnd, className, ARRAYSIZE(className))) {
+        for (size_t i = 0; i < ARRAYSIZE(g_darkControlClasses); i++) {
+            if (_wcsicmp(className, g_darkControlClasses[i].className) == 0) {
+                verdict = (BYTE)(i + 2);
+                break;
+            }
+        }
+    }
+    
+    if (atom) {
+        g_controlClassVerdicts[atom].store(verdict, std::memory_order_relaxed);
+    }
+    return verdict >= 2 ? &g_darkControlClasses[verdict - 2] : nullptr;
+}
+
+// Switch a control to the dark (or back to its default) visual styles.
+// Best run on the thread that owns the control, SetWindowTheme sends to it.
+VOID SetControlDarkMode(HWND hWnd, const DarkControlClass* controlClass, BOOL useDarkMode) {
+    if (g_AllowDarkModeForWindow) {
+        g_AllowDarkModeForWindow(hWnd, useDarkMode != FALSE);
+    }
+    SetWindowTheme(hWnd, useDarkMode ? controlClass->darkTheme : nullptr, nullptr);
+}
+
+// Controls owned by another thread than their top-level window are skipped,
+// SetWindowTheme would wait for that thread
+BOOL CALLBACK EnumControlsProc(HWND hWnd, LPARAM lParam) {
+    const DarkControlClass* controlClass = GetDarkControlClass(hWnd);
+    if (controlClass && GetWindowThreadProcessId(hWnd, nullptr) == GetCurrentThreadId()) {
+        SetControlDarkMode(hWnd, controlClass, (BOOL)lParam);
+    }
+    return TRUE;
+}
+
+// Switch the controls inside a top-level window owned by the calling thread
+VOID SwitchWindowControls(HWND hWnd, BOOL useDarkMode) {
+    SetControlsDark(hWnd, useDarkMode);
+    EnumChildWindows(hWnd, EnumControlsProc, (LPARAM)useDarkMode);
+}
+
+// Switch the controls inside a top-level window. SetWindowTheme sends
+// WM_THEMECHANGED to each control, so for a window of another thread the
+// work is posted to that thread and never done from here: a hung thread
+// would hold up the whole pass. Windows whose messages never reach the hook
+// keep their controls as they are.
+VOID ApplyDarkModeToControls(HWND hWnd, BOOL useDarkMode) {
+    if (GetWindowThreadProcessId(hWnd, nullptr) != GetCurrentThreadId()) {
+        PostMessageW(hWnd, g_applyControlsMsg, (WPARAM)useDarkMode, 0);
+        return;
+    }
+    
+    SwitchWindowControls(hWnd, useDarkMode);
+}
+
+// A child window was created: switch it to dark visual styles if it's a
+// dark control class inside an eligible window that is dark
+VOID NewControlShown(HWND hWnd) {
+    const DarkControlClass* controlClass = GetDarkControlClass(hWnd);
+    if (!controlClass)
+        return;
+    
+    HWND hRoot = GetAncestor(hWnd, GA_ROOT);
+    if (!hRoot || hRoot == hWnd || !IsWindowEligible(hRoot))
+        return;
+    
+    // New controls use the light styles, nothing to do in light mode
+    if (GetAttributeSet(ResolveAppliedState(hRoot, g_isDarkMode)).darkMode) {
+        SetControlDarkMode(hWnd, controlClass, TRUE);
+    }
+}
+
+// Remember the original attributes of a window before the mod first changes
+// it. A window that is still being created has the defaults, nothing to read.
+VOID RecordOriginalAttributes(HWND hWnd, const DwmAttributeSet& set, BOOL isNewWindow) {
+    if (!MarkWindowChanged(hWnd, set.mask))
+        return;
+    
+    BOOL originalDarkMode = FALSE;
+    int originalBackdrop = DWMSBT_AUTO_VALUE;
+    if (!isNewWindow) {
+        if (FAILED(DwmGetWindowAttribute(hWnd, DWMWA_USE_IMMERSIVE_DARK_MODE,
+            &originalDarkMode, sizeof(originalDarkMode)))) {
+            originalDarkMode = ORIGINAL_DARK_MODE_UNKNOWN;
+        }
+        if ((set.mask & ATTRIBUTE_BACKDROP) && FAILED(DwmGetWindowAttribute(hWnd,
+            DWMWA_SYSTEMBACKDROP_TYPE, &originalBackdrop, sizeof(originalBackdrop)))) {
+            originalBackdrop = DWMSBT_AUTO_VALUE;
+        }
+    }
+    SetWindowOriginal(hWnd, originalDarkMode, originalBackdrop);
+}
+
+// Check if the frame of a window can't be seen until it is shown or restored
+BOOL IsFrameHidden(HWND hWnd) {
+    return !IsWindowVisible(hWnd) || IsIconic(hWnd);
+}
+
+// Check if DWM hides a window (e.g. on another virtual desktop)
+BOOL IsWindowCloaked(HWND hWnd) {
+    DWORD cloaked = 0;
+    return SUCCEEDED(DwmGetWindowAttribute(hWnd, DWMWA_CLOAKED, &cloaked, sizeof(cloaked))) && cloaked;
+}
+
+// Record the perceived latency of the last theme change, if this is the
+// window that was in the foreground
+VOID RecordPerceivedLatency(HWND hWnd) {
+    HWND expected = hWnd;
+    if (g_perceivedWindow.load(std::memory_order_relaxed) != hWnd ||
+        !g_perceivedWindow.compare_exchange_strong(expected, nullptr))
+        return;
+    
+    ULONGLONG micros = StatsRecordLatency(g_stats->perceivedLatency, g_themeChangeTime);
+    Wh_Log(L"[Process %d] Foreground window %p themed %llu us after the theme change",
+        GetCurrentProcessId(), hWnd, micros);
+}
+
+// Set all attributes of a set on a window, without redrawing its frame.
+// Fails if dark mode couldn't be set, the other attributes are best effort
+// (they need Windows 11).
+HRESULT SetDwmAttributes(HWND hWnd, const DwmAttributeSet& set) {
+    HRESULT hr = S_OK;
+    if (!(set.mask & ATTRIBUTE_KEEP_DARK_MODE)) {
+        BOOL darkMode = set.darkMode;
+        hr = DwmSetWindowAttribute(hWnd, DWMWA_USE_IMMERSIVE_DARK_MODE,
+            &darkMode, sizeof(darkMode));
+        STATS_INCREMENT(dwmCalls);
+    }
+    if (FAILED(hr) || !set.mask)
+        return hr;
+    
+    if (set.mask & ATTRIBUTE_CAPTION_COLOR) {
+        DwmSetWindowAttribute(hWnd, DWMWA_CAPTION_COLOR, &set.captionColor, sizeof(COLORREF));
+        STATS_INCREMENT(dwmCalls);
+    }
+    if (set.mask & ATTRIBUTE_BORDER_COLOR) {
+        DwmSetWindowAttribute(hWnd, DWMWA_BORDER_COLOR, &set.borderColor, sizeof(COLORREF));
+        STATS_INCREMENT(dwmCalls);
+    }
+    if (set.mask & ATTRIBUTE_TEXT_COLOR) {
+        DwmSetWindowAttribute(hWnd, DWMWA_TEXT_COLOR, &set.textColor, sizeof(COLORREF));
+        STATS_INCREMENT(dwmCalls);
+    }
+    if (set.mask & ATTRIBUTE_BACKDROP) {
+        DwmSetWindowAttribute(hWnd, DWMWA_SYSTEMBACKDROP_TYPE, &set.backdrop, sizeof(int));
+        STATS_INCREMENT(dwmCalls);
+    }
+    return hr;
+}
+
+// Set an attribute set on a window and redraw its frame once, if the applied
+// state changed. Returns TRUE if the state was applied.
+BOOL SetWindowAttributes(HWND hWnd, int state, const DwmAttributeSet& set) {
+    // Nothing to do (and nothing to redraw) if the window already has the state
+    if (!SetAppliedState(hWnd, state)) {
+        g_appliesSkipped++;
+        STATS_INCREMENT(appliesSkipped);
+        return FALSE;
+    }
+    
+    if (state != APPLIED_STATE_RESTORED) {
+        RecordOriginalAttributes(hWnd, set, FALSE);
+    }
+    
+    LONGLONG applyStart = StatsStartTiming();
+    HRESULT hr = SetDwmAttributes(hWnd, set);
+    
+    if (SUCCEEDED(hr)) {
+        RecordPerceivedLatency(hWnd);
+        
+        // Nobody sees the frame of a hidden or minimized window, it is redrawn
+        // when the window is shown or restored
+        if (state != APPLIED_STATE_RESTORED && IsFrameHidden(hWnd) && MarkFramePending(hWnd)) {
+            StatsRecordApplyLatency(applyStart);
+            STATS_INCREMENT(framesDeferred);
+            g_appliesPerformed++;
+            LOG_VERBOSE(L"Applied state %d to hidden window %p, frame change deferred", state, hWnd);
+            return TRUE;
+        }
+        if (g_pendingFrameChanges.load(std::memory_order_relaxed)) {
+            TakeFramePending(hWnd);
+        }
+        
+        // Force window to redraw titlebar. Never block on another thread: if
+        // the window isn't ours the request is queued to its owner thread.
+        UINT flags = SWP_FRAMECHANGED | SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER | SWP_NOOWNERZORDER;
+        if (GetWindowThreadProcessId(hWnd, nullptr) != GetCurrentThreadId()) {
+            flags |= SWP_ASYNCWINDOWPOS;
+        }
+        SetWindowPos(hWnd, nullptr, 0, 0, 0, 0, flags);
+        StatsRecordApplyLatency(applyStart);
+        STATS_INCREMENT(frameChanges);
+        g_appliesPerformed++;
+        LOG_VERBOSE(L"Applied state %d to window: %p", state, hWnd);
+        return TRUE;
+    }
+    
+    SetAppliedState(hWnd, APPLIED_STATE_NONE);
+    return FALSE;
+}
+
+// Set the attribute set of an applied state on a window
+BOOL SetWindowAttributeState(HWND hWnd, int state) {
+    return SetWindowAttributes(hWnd, state, GetAttributeSet(state));
+}
+
+// Apply the theme to a window already known to be eligible, taking the rules
+// and policies into account
+VOID ApplyToEligibleWindow(HWND hWnd, BOOL useDarkMode) {
+    int state = ResolveAppliedState(hWnd, useDarkMode);
+    if (SetWindowAttributeState(hWnd, state) && g_controlClassVerdicts) {
+        ApplyDarkModeToControls(hWnd, GetAttributeSet(state).darkMode);
+    }
+}
+
+// Apply the theme to a window, taking the rules and policies into account
+VOID ApplyDarkMode(HWND hWnd, BOOL useDarkMode) {
+    if (!IsWindowEligible(hWnd))
+        return;
+    
+    ApplyToEligibleWindow(hWnd, useDarkMode);
+}
+
+// Rebuild g_hookedMessageBits. Called on init, and under g_trackedWindowsLock
+// when the first frame change is deferred or the last one is done.
+VOID UpdateHookedMessageBits() {
+    UINT messages[] = { WM_SETTINGCHANGE, WM_DWMCOLORIZATIONCOLORCHANGED, WM_NCCREATE,
+        WM_NCDESTROY, g_applyThemeMsg, g_applyControlsMsg,
+        g_pendingFrameChanges.load(std::memory_order_relaxed) ? (UINT)WM_WINDOWPOSCHANGED : 0 };
+    ULONG bits[HOOKED_MESSAGE_BITS / 32] = {};
+    for (UINT message : messages) {
+        if (message) {
+            UINT bit = message & (HOOKED_MESSAGE_BITS - 1);
+            bits[bit / 32] |= 1UL << (bit % 32);
+        }
+    }
+    for (size_t i = 0; i < ARRAYSIZE(bits); i++) {
+        g_hookedMessageBits[i].store(bits[i], std::memory_order_relaxed);
+    }
+}
+
+// Only theme change messages, WM_NCCREATE/WM_NCDESTROY (to track windows),
+// the posted apply messages and, while frame changes are deferred,
+// WM_WINDOWPOSCHANGED get past here. Everything else leaves the hooks after
+// a single bit test, only the messages whose bit is set are compared.
+static inline BOOL IsHookedMessage(UINT Msg) {
+    UINT bit = Msg & (HOOKED_MESSAGE_BITS - 1);
+    if (__builtin_expect(!((g_hookedMessageBits[bit / 32].load(std::memory_order_relaxed) >>
+        (bit % 32)) & 1), 1))
+        return FALSE;
+    
+    return Msg == WM_SETTINGCHANGE || Msg == WM_DWMCOLORIZATIONCOLORCHANGED ||
+        Msg == WM_NCCREATE || Msg == WM_NCDESTROY || Msg == g_applyThemeMsg ||
+        Msg == g_applyControlsMsg ||
+        (Msg == WM_WINDOWPOSCHANGED && g_pendingFrameChanges.load(std::memory_order_relaxed));
+}
+
+// Home slot of a window in the tracked table (the capacity is a power of 2)
+static inline size_t TrackedWindowSlot(HWND hWnd, size_t capacity) {
+    ULONGLONG hash = (ULONGLONG)(ULONG_PTR)hWnd * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32) & (capacity - 1);
+}
+
+// Deferred frame change counter of the bucket a window hashes to
+static inline std::atomic<LONG>& PendingFrameBucket(HWND hWnd) {
+    return g_pendingFrameBuckets[TrackedWindowSlot(hWnd, PENDING_FRAME_BUCKETS)];
+}
+
+// Find a tracked window, nullptr if it isn't tracked. The lock must be held.
+TrackedWindow* FindTrackedWindow(HWND hWnd) {
+    size_t capacity = g_trackedWindows.size();
+    if (!capacity)
+        return nullptr;
+    
+    for (size_t i = TrackedWindowSlot(hWnd, capacity);; i = (i + 1) & (capacity - 1)) {
+        TrackedWindow& window = g_trackedWindows[i];
+        if (window.hWnd == hWnd)
+            return &window;
+        if (!window.hWnd)
+            return nullptr;
+    }
+}
+
+// Put a window that isn't tracked yet into the table, which is known to have
+// a free slot. The lock must be held.
+VOID InsertTrackedWindow(const TrackedWindow& window) {
+    size_t capacity = g_trackedWindows.size();
+    size_t i = TrackedWindowSlot(window.hWnd, capacity);
+    while (g_trackedWindows[i].hWnd) {
+        i = (i + 1) & (capacity - 1);
+    }
+    g_trackedWindows[i] = window;
+    g_trackedWindowCount++;
+}
+
+// Add a window to the tracked set. Returns FALSE if it was already tracked.
+// reachesHook = TRUE records that messages posted to it reach the hook.
+BOOL TrackWindow(HWND hWnd, BOOL reachesHook) {
+    DWORD threadId = GetWindowThreadProcessId(hWnd, nullptr);
+    
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        window->reachesHook |= reachesHook;
+        ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+        return FALSE;
+    }
+    
+    // Keep the load at most one half
+    if ((g_trackedWindowCount + 1) * 2 > g_trackedWindows.size()) {
+        size_t capacity = g_trackedWindows.size() ? g_trackedWindows.size() * 2 : TRACKED_WINDOWS_MIN_CAPACITY;
+        std::vector<TrackedWindow> windows(capacity, TrackedWindow{});
+        windows.swap(g_trackedWindows);
+        g_trackedWindowCount = 0;
+        for (const TrackedWindow& window : windows) {
+            if (window.hWnd) {
+                InsertTrackedWindow(window);
+            }
+        }
+    }
+    InsertTrackedWindow({ hWnd, threadId, APPLIED_STATE_NONE, FALSE, FALSE, 0, 0, FALSE, reachesHook });
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+    return TRUE;
+}
+
+// Remove a window from the tracked set
+VOID UntrackWindow(HWND hWnd) {
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        if (window->framePending) {
+            if (--g_pendingFrameChanges == 0) {
+                UpdateHookedMessageBits();
+            }
+            PendingFrameBucket(hWnd)--;
+        }
+        
+        // Shift back the entries after it that would no longer be reachable
+        size_t capacity = g_trackedWindows.size();
+        size_t hole = window - g_trackedWindows.data();
+        for (size_t i = (hole + 1) & (capacity - 1); g_trackedWindows[i].hWnd; i = (i + 1) & (capacity - 1)) {
+            size_t home = TrackedWindowSlot(g_trackedWindows[i].hWnd, capacity);
+            if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+                g_trackedWindows[hole] = g_trackedWindows[i];
+                hole = i;
+            }
+        }
+        g_trackedWindows[hole] = TrackedWindow{};
+        g_trackedWindowCount--;
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+}
+
+// Record the value about to be applied to a tracked window. Returns FALSE if
+// the window already has it. Untracked windows always need to be applied.
+BOOL SetAppliedState(HWND hWnd, int state) {
+    BOOL changed = TRUE;
+    
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        if (window->appliedState == state) {
+            changed = FALSE;
+        } else {
+            window->appliedState = state;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+    return changed;
+}
+
+// Note that the mod is about to set attributes on a tracked window. Returns
+// TRUE if this is the first change, the caller then records the original
+// attributes with SetWindowOriginal.
+BOOL MarkWindowChanged(HWND hWnd, DWORD mask) {
+    BOOL firstChange = FALSE;
+    
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        firstChange = !window->changed;
+        window->changed = TRUE;
+        window->changedMask |= mask;
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+    return firstChange;
+}
+
+// Record the attributes a tracked window had before the mod changed it
+VOID SetWindowOriginal(HWND hWnd, BOOL originalDarkMode, int originalBackdrop) {
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        window->originalDarkMode = originalDarkMode;
+        window->originalBackdrop = originalBackdrop;
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+}
+
+// Defer the frame change of a tracked window until it is shown or restored.
+// Returns FALSE if the window isn't tracked, it then needs the frame change now.
+BOOL MarkFramePending(HWND hWnd) {
+    BOOL tracked = FALSE;
+    
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        tracked = TRUE;
+        if (!window->framePending) {
+            window->framePending = TRUE;
+            if (g_pendingFrameChanges++ == 0) {
+                UpdateHookedMessageBits();
+            }
+            PendingFrameBucket(hWnd)++;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+    return tracked;
+}
+
+// Clear the deferred frame change of a tracked window. Returns TRUE if it had one.
+BOOL TakeFramePending(HWND hWnd) {
+    BOOL pending = FALSE;
+    
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window && window->framePending) {
+        pending = TRUE;
+        window->framePending = FALSE;
+        if (--g_pendingFrameChanges == 0) {
+            UpdateHookedMessageBits();
+        }
+        PendingFrameBucket(hWnd)--;
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+    return pending;
+}
+
+// Do the deferred frame change of a window once it is shown or restored.
+// Runs in its window procedure, on the owner thread.
+VOID FlushPendingFrameChange(HWND hWnd) {
+    if (!PendingFrameBucket(hWnd).load(std::memory_order_relaxed) ||
+        IsFrameHidden(hWnd) || !TakeFramePending(hWnd))
+        return;
+    
+    SetWindowPos(hWnd, nullptr, 0, 0, 0, 0, SWP_FRAMECHANGED | SWP_NOMOVE | SWP_NOSIZE |
+        SWP_NOZORDER | SWP_NOOWNERZORDER | SWP_NOACTIVATE);
+    STATS_INCREMENT(frameChanges);
+    LOG_VERBOSE(L"Deferred frame change done for window: %p", hWnd);
+}
+
+// Record whether the controls of a tracked window were switched to dark
+VOID SetControlsDark(HWND hWnd, BOOL controlsDark) {
+    AcquireSRWLockExclusive(&g_trackedWindowsLock);
+    TrackedWindow* window = FindTrackedWindow(hWnd);
+    if (window) {
+        window->controlsDark = controlsDark;
+    }
+    ReleaseSRWLockExclusive(&g_trackedWindowsLock);
+}
+
+// Copy of the tracked set, so windows can be processed without holding the
+// lock (applying sends messages, which can destroy and untrack windows)
+std::vector<TrackedWindow> GetTrackedWindows() {
+    std::vector<TrackedWindow> windows;
+    AcquireSRWLockShared(&g_trackedWindowsLock);
+    windows.reserve(g_trackedWindowCount);
+    for (const TrackedWindow& window : g_trackedWindows) {
+        if (window.hWnd) {
+            windows.push_back(window);
+        }
+    }
+    ReleaseSRWLockShared(&g_trackedWindowsLock);
+    return windows;
+}
+
+// A tracked window that missed its WM_NCDESTROY (e.g. the window procedure
+// didn't pass it on) is dropped once its handle no longer matches the thread
+BOOL IsTrackedWindowAlive(const TrackedWindow& window) {
+    if (GetWindowThreadProcessId(window.hWnd, nullptr) == window.threadId)
+        return TRUE;
+    
+    UntrackWindow(window.hWnd);
+    return FALSE;
+}
+
+// Decide from the CreateWindowEx arguments and the window class whether a new
+// window can be eligible at all. Message-only, child and tool windows are
+// dropped without a call, windows of the built-in ineligible classes after a
+// single table lookup.
+BOOL IsCreationCandidate(HWND hWnd, DWORD dwExStyle, DWORD dwStyle, HWND hWndParent) {
+    if (hWndParent == HWND_MESSAGE || (dwStyle & WS_CHILD) || (dwExStyle & WS_EX_TOOLWINDOW))
+        return FALSE;
+    
+    ATOM atom = (ATOM)GetClassLongW(hWnd, GCW_ATOM);
+    if (!atom)
+        return TRUE;
+    
+    BYTE verdict = g_creationClassVerdicts[atom].load(std::memory_order_relaxed);
+    if (!verdict) {
+        verdict = CREATION_CLASS_CANDIDATE;
+        WCHAR className[256];
+        if (GetClassNameW(hWnd, className, ARRAYSIZE(className))) {
+            for (PCWSTR ineligibleClass : g_ineligibleClasses) {
+                if (_wcsicmp(className, ineligibleClass) == 0) {
+                    verdict = CREATION_CLASS_INELIGIBLE;
+                    break;
+                }
+            }
+        }
+        g_creationClassVerdicts[atom].store(verdict, std::memory_order_relaxed);
+    }
+    return verdict == CREATION_CLASS_CANDIDATE;
+}
+
+// Drop what the atom caches decided for a class that is being unregistered
+VOID ForgetClassAtom(ATOM atom) {
+    g_creationClassVerdicts[atom].store(0, std::memory_order_relaxed);
+    if (g_classAtomVerdicts) {
+        g_classAtomVerdicts[atom].store(0, std::memory_order_relaxed);
+    }
+    if (g_controlClassVerdicts) {
+        g_controlClassVerdicts[atom].store(0, std::memory_order_relaxed);
+    }
+}
+
+// Check a window that passed IsCreationCandidate. Its current styles are still
+// checked, since WM_CREATE handlers and CW_USEDEFAULT can change them.
+BOOL IsCandidateEligible(HWND hWnd) {
+    return HasEligibleStyle(hWnd) && GetClassRuleVerdict(hWnd).action != RULE_SKIP;
+}
+
+// Apply dark mode while the window is being created (WM_NCCREATE), before its
+// frame is composed for the first time. The applied state is recorded, so the
+// creation hook finds nothing left to do and no frame change is forced.
+VOID ApplyDarkModePrePaint(HWND hWnd, const CREATESTRUCTW* createStruct) {
+    if (!IsCreationCandidate(hWnd, createStruct->dwExStyle, (DWORD)createStruct->style,
+            createStruct->hwndParent) || !IsCandidateEligible(hWnd))
+        return;
+    
+    // WM_NCCREATE got here, so later posted messages will too
+    int state = ResolveAppliedState(hWnd, g_isDarkMode);
+    TrackWindow(hWnd, TRUE);
+    if (!SetAppliedState(hWnd, state))
+        return;
+    
+    // New windows aren't dark and have no custom attributes, a plain light
+    // mode state only needs to be recorded
+    const DwmAttributeSet& set = GetAttributeSet(state);
+    if (set.darkMode || set.mask) {
+        RecordOriginalAttributes(hWnd, set, TRUE);
+        LONGLONG applyStart = StatsStartTiming();
+        if (FAILED(SetDwmAttributes(hWnd, set))) {
+            SetAppliedState(hWnd, APPLIED_STATE_NONE);
+            return;
+        }
+        StatsRecordApplyLatency(applyStart);
+    }
+    
+    g_appliesPrePaint++;
+}
+
+// Handle a message that passed IsHookedMessage. WM_WINDOWPOSCHANGED comes by
+// for every window while frame changes are deferred, it isn't counted.
+VOID HandleHookedMessage(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    if (Msg == WM_WINDOWPOSCHANGED) {
+        FlushPendingFrameChange(hWnd);
+        return;
+    }
+    
+    STATS_INCREMENT(hookedMessages);
+    if (Msg == WM_NCCREATE) {
+        ApplyDarkModePrePaint(hWnd, (const CREATESTRUCTW*)lParam);
+    } else if (Msg == WM_NCDESTROY) {
+        UntrackWindow(hWnd);
+    } else if (Msg == g_applyThemeMsg) {
+        ApplyToThreadWindows((LONG)wParam, (BOOL)lParam);
+    } else if (Msg == g_applyControlsMsg) {
+        if (lParam == CONTROLS_RESTORE_THREAD) {
+            RestoreThreadControls();
+        } else {
+            SwitchWindowControls(hWnd, (BOOL)wParam);
+        }
+    } else if (IsThemeSettingChange(Msg, lParam)) {
+        ScheduleThemeReevaluation();
+    }
+}
+
+// Subclass procedure used instead of the DefWindowProcW hook in subclass mode
+LRESULT CALLBACK ThemeSubclassProc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam,
+    UINT_PTR uIdSubclass, DWORD_PTR dwRefData) {
+    if (IsHookedMessage(Msg)) {
+        HandleHookedMessage(hWnd, Msg, wParam, lParam);
+        if (Msg == WM_NCDESTROY) {
+            RemoveWindowSubclass(hWnd, ThemeSubclassProc, 0);
+        }
+    }
+    
+    return DefSubclassProc(hWnd, Msg, wParam, lParam);
+}
+
+// SetWindowSubclass and RemoveWindowSubclass only work on the thread that owns
+// the window. For other threads, a temporary WH_CALLWNDPROC hook is installed
+// on the owner thread and a registered message is sent to do the work there.
+static UINT g_subclassRegisteredMsg = RegisterWindowMessageW(L"Windhawk_AutoDarkTitlebar_Subclass");
+
+struct SubclassFromAnyThreadParam {
+    BOOL subclass;  // TRUE = set, FALSE = remove
+    BOOL result;
+};
+
+LRESULT CALLBACK CallWndProcForSubclass(int nCode, WPARAM wParam, LPARAM lParam) {
+    if (nCode == HC_ACTION) {
+        const CWPSTRUCT* cwp = (const CWPSTRUCT*)lParam;
+        if (cwp->message == g_subclassRegisteredMsg && cwp->wParam == (WPARAM)ThemeSubclassProc) {
+            SubclassFromAnyThreadParam* param = (SubclassFromAnyThreadParam*)cwp->lParam;
+            param->result = param->subclass
+                ? SetWindowSubclass(cwp->hwnd, ThemeSubclassProc, 0, 0)
+                : RemoveWindowSubclass(cwp->hwnd, ThemeSubclassProc, 0);
+        }
+    }
+    
+    return CallNextHookEx(nullptr, nCode, wParam, lParam);
+}
+
+BOOL SubclassWindowFromAnyThread(HWND hWnd, BOOL subclass) {
+    DWORD dwThreadId = GetWindowThreadProcessId(hWnd, nullptr);
+    if (dwThreadId == 0)
+        return FALSE;
+    
+    if (dwThreadId == GetCurrentThreadId()) {
+        return subclass
+            ? SetWindowSubclass(hWnd, ThemeSubclassProc, 0, 0)
+            : RemoveWindowSubclass(hWnd, ThemeSubclassProc, 0);
+    }
+    
+    HHOOK hHook = SetWindowsHookExW(WH_CALLWNDPROC, CallWndProcForSubclass, nullptr, dwThreadId);
+    if (!hHook)
+        return FALSE;
+    
+    SubclassFromAnyThreadParam param = { subclass, FALSE };
+    SendMessageW(hWnd, g_subclassRegisteredMsg, (WPARAM)ThemeSubclassProc, (LPARAM)&param);
+    UnhookWindowsHookEx(hHook);
+    return param.result;
+}
+
+// Subclass an eligible window so it receives theme change messages
+VOID SubclassWindow(HWND hWnd) {
+    if (!SubclassWindowFromAnyThread(hWnd, TRUE)) {
+        LOG_WARNING(L"Failed to subclass window: %p", hWnd);
+        return;
+    }
+    
+    TrackWindow(hWnd, TRUE);
+}
+
+// Apply dark mode to a specific window (called from hook). Most new windows are
+// children, tool windows or popups of ineligible classes; they are classified
+// from the CreateWindowEx arguments before the window itself is queried.
+VOID NewWindowShown(HWND hWnd, DWORD dwExStyle, DWORD dwStyle, HWND hWndParent) {
+    if (dwStyle & WS_CHILD) {
+        if (g_controlClassVerdicts && hWndParent != HWND_MESSAGE) {
+            NewControlShown(hWnd);
+        }
+        return;
+    }
+    
+    if (!IsCreationCandidate(hWnd, dwExStyle, dwStyle, hWndParent) || !IsCandidateEligible(hWnd))
+        return;
+    
+    g_windowsCreated++;
+    TrackWindow(hWnd, FALSE);
+    EnsureDefWindowProcHook();
+    
+    BOOL isDarkMode = g_isDarkMode;
+    LOG_VERBOSE(L"New window detected: %p, applying dark mode: %d", hWnd, isDarkMode);
+    ApplyToEligibleWindow(hWnd, isDarkMode);
+    
+    if (g_settings.hookMode == HOOK_MODE_SUBCLASS) {
+        SubclassWindow(hWnd);
+    }
+}
+
+// Enumerate callback to track the windows that existed before the mod loaded
+BOOL CALLBACK EnumWindowsProc(HWND hWnd, LPARAM lParam) {
+    // Skip if not a top-level window
+    HWND hParentWnd = GetAncestor(hWnd, GA_PARENT);
+    if (hParentWnd && hParentWnd != GetDesktopWindow())
+        return TRUE;
+    
+    // Check if window belongs to current process
+    DWORD dwProcessId = 0;
+    if (!GetWindowThreadProcessId(hWnd, &dwProcessId) || 
+        dwProcessId != GetCurrentProcessId())
+        return TRUE;
+    
+    if (IsWindowEligible(hWnd)) {
+        TrackWindow(hWnd, FALSE);
+        EnsureDefWindowProcHook();
+    }
+    return TRUE;
+}
+
+// Track the existing windows of the current process. This is the only full
+// enumeration, later windows are tracked by the creation hooks.
+VOID TrackExistingWindows() {
+    EnumWindows(EnumWindowsProc, 0);
+}
+
+// Where a window goes in a theme pass
+ApplyPriority GetApplyPriority(HWND hWnd, HWND foregroundWnd) {
+    if (hWnd == foregroundWnd)
+        return APPLY_PRIORITY_FOREGROUND;
+    if (IsFrameHidden(hWnd))
+        return APPLY_PRIORITY_HIDDEN;
+    if (IsWindowCloaked(hWnd))
+        return APPLY_PRIORITY_CLOAKED;
+    return APPLY_PRIORITY_VISIBLE;
+}
+
+// Sort windows into apply order: the foreground window, the visible windows
+// from the top of the z-order down, then cloaked, hidden and minimized ones.
+// The z-order is only walked if more than one window is visible, and the walk
+// stops as soon as all of them were found.
+VOID SortWindowsForApply(std::vector<TrackedWindow>* windows) {
+    if (windows->size() < 2)
+        return;
+    
+    // Priority in the high 32 bits, z-order position of visible windows in the low
+    const ULONGLONG unranked = 0xFFFFFFFF;
+    HWND foregroundWnd = GetForegroundWindow();
+    std::vector<std::pair<ULONGLONG, size_t>> keys;
+    keys.reserve(windows->size());
+    std::unordered_map<HWND, size_t> visibleKeys;
+    for (size_t i = 0; i < windows->size(); i++) {
+        ApplyPriority priority = GetApplyPriority((*windows)[i].hWnd, foregroundWnd);
+        if (priority == APPLY_PRIORITY_VISIBLE) {
+            visibleKeys.emplace((*windows)[i].hWnd, keys.size());
+        }
+        keys.push_back({ ((ULONGLONG)priority << 32) | unranked, i });
+    }
+    
+    if (visibleKeys.size() > 1) {
+        ULONG position = 0;
+        for (HWND hWnd = GetTopWindow(nullptr); hWnd && !visibleKeys.empty();
+            hWnd = GetWindow(hWnd, GW_HWNDNEXT), position++) {
+            auto it = visibleKeys.find(hWnd);
+            if (it != visibleKeys.end()) {
+                keys[it->second].first = ((ULONGLONG)APPLY_PRIORITY_VISIBLE << 32) | position;
+                visibleKeys.erase(it);
+            }
+        }
+    }
+    
+    std::sort(keys.begin(), keys.end());
+    std::vector<TrackedWindow> sorted;
+    sorted.reserve(windows->size());
+    for (const auto& key : keys) {
+        sorted.push_back((*windows)[key.second]);
+    }
+    windows->swap(sorted);
+}
+
+// Apply dark mode to the tracked windows owned by the calling thread, in the
+// order ApplyToAllWindows sorted them in. Runs on the owner thread, so the
+// frame change doesn't need a cross-thread send.
+VOID ApplyToThreadWindows(LONG applyGeneration, BOOL useDarkMode) {
+    DWORD threadId = GetCurrentThreadId();
+    std::vector<TrackedWindow> windows;
+    
+    AcquireSRWLockShared(&g_applyPassLock);
+    // A newer pass was posted after this one, it will do the work
+    if (applyGeneration != g_applyGeneration) {
+        ReleaseSRWLockShared(&g_applyPassLock);
+        return;
+    }
+    for (const TrackedWindow& window : g_applyPassWindows) {
+        if (window.threadId == threadId) {
+            windows.push_back(window);
+        }
+    }
+    ReleaseSRWLockShared(&g_applyPassLock);
+    
+    for (const TrackedWindow& window : windows) {
+        if (IsTrackedWindowAlive(window)) {
+            ApplyDarkMode(window.hWnd, useDarkMode);
+        }
+    }
+}
+
+// Apply dark mode to all tracked windows in current process. The windows are
+// grouped by owner thread and each thread with a window that reaches the hook
+// gets one posted apply message, so a hung UI thread can't stall the theme
+// switch for the rest of the process.
+// Threads are posted to in the apply order of their first window, so the
+// foreground window's thread starts first.
+VOID ApplyToAllWindows(BOOL useDarkMode) {
+    DWORD currentThreadId = GetCurrentThreadId();
+    
+    // Sort once for the whole pass, the owner threads take their share from here
+    std::vector<TrackedWindow> windows = GetTrackedWindows();
+    SortWindowsForApply(&windows);
+    AcquireSRWLockExclusive(&g_applyPassLock);
+    LONG applyGeneration = ++g_applyGeneration;
+    g_applyPassWindows = windows;
+    ReleaseSRWLockExclusive(&g_applyPassLock);
+    
+    // Only windows known to reach the hook are posted to, a message lost in
+    // another window procedure would leave the whole thread unapplied
+    std::vector<DWORD> postedThreads;
+    for (const TrackedWindow& window : windows) {
+        if (window.threadId == currentThreadId || !window.reachesHook)
+            continue;
+        
+        if (std::find(postedThreads.begin(), postedThreads.end(), window.threadId) != postedThreads.end())
+            continue;
+        
+        if (IsTrackedWindowAlive(window) &&
+            PostMessageW(window.hWnd, g_applyThemeMsg, (WPARAM)applyGeneration, (LPARAM)useDarkMode)) {
+            postedThreads.push_back(window.threadId);
+        }
+    }
+    
+    // Windows of this thread and of threads that couldn't be posted to are
+    // applied from here, ApplyDarkMode queues the frame change of the latter
+    // asynchronously
+    for (const TrackedWindow& window : windows) {
+        if ((window.threadId == currentThreadId ||
+            std::find(postedThreads.begin(), postedThreads.end(), window.threadId) == postedThreads.end()) &&
+            IsTrackedWindowAlive(window)) {
+            ApplyDarkMode(window.hWnd, useDarkMode);
+        }
+    }
+    
+    Wh_Log(L"[Process %d] Apply pass %ld posted to %zu threads (total %lu performed, %lu skipped)",
+        GetCurrentProcessId(), applyGeneration, postedThreads.size(),
+        g_appliesPerformed.load(), g_appliesSkipped.load());
+}
 
-// Global variables
-static pShouldSystemUseDarkMode g_ShouldSystemUseDarkMode = nullptr;
-static BOOL g_isDarkMode = FALSE;
+// Log how many frame changes window creation cost
+VOID LogCreationStats() {
+    ULONG created = g_windowsCreated;
+    ULONG prePaint = g_appliesPrePaint;
+    Wh_Log(L"[Process %d] %lu windows created, %lu applied before first paint, "
+        L"%lu needed a frame change after creation",
+        GetCurrentProcessId(), created, prePaint, created > prePaint ? created - prePaint : 0);
+}
 
-// Check if system is using dark mode
-BOOL IsSystemDarkMode() {
-    // Check registry first (most reliable)
-    HKEY hKey;
-    if (RegOpenKeyExW(HKEY_CURRENT_USER, 
-        L"Software\\Microsoft\\Windows\\CurrentVersion\\Themes\\Personalize",
-        0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+// Restore the original attributes of the windows the mod changed, in one
+// pass over the tracked windows from the calling thread, ignoring the rules.
+// Used on uninit, when the hooks that handle posted apply messages are already
+// gone. Windows that already had what the mod set (e.g. apps that set dark
+// mode themselves) are left alone.
+VOID RestoreAllWindows() {
+    // Invalidate any pass still queued to the owner threads
+    g_applyGeneration++;
+    
+    ULONG restored = 0;
+    for (const TrackedWindow& window : GetTrackedWindows()) {
+        if (!window.changed)
+            continue;
         
-        DWORD value = 0;
-        DWORD size = sizeof(DWORD);
-        // AppsUseLightTheme: 0 = dark mode, 1 = light mode
-        if (RegQueryValueExW(hKey, L"AppsUseLightTheme", nullptr, nullptr,
-            (LPBYTE)&value, &size) == ERROR_SUCCESS) {
-            RegCloseKey(hKey);
-            return value == 0;
+        if (!window.changedMask && (window.originalDarkMode == ORIGINAL_DARK_MODE_UNKNOWN ||
+            (window.appliedState >= 0 &&
+            GetAttributeSet(window.appliedState).darkMode == window.originalDarkMode)))
+            continue;
+        
+        // Colors can't be read back, the original is the system default.
+        // Dark mode is left alone if its original couldn't be read.
+        DwmAttributeSet original = {};
+        original.darkMode = window.originalDarkMode;
+        original.mask = window.changedMask;
+        if (window.originalDarkMode == ORIGINAL_DARK_MODE_UNKNOWN) {
+            original.mask |= ATTRIBUTE_KEEP_DARK_MODE;
+        }
+        original.captionColor = DWMWA_COLOR_DEFAULT;
+        original.borderColor = DWMWA_COLOR_DEFAULT;
+        original.textColor = DWMWA_COLOR_DEFAULT;
+        original.backdrop = window.originalBackdrop;
+        
+        if (IsTrackedWindowAlive(window) &&
+            SetWindowAttributes(window.hWnd, APPLIED_STATE_RESTORED, original)) {
+            restored++;
         }
-        RegCloseKey(hKey);
     }
     
-    // Fallback: Try uxtheme function
-    if (!g_ShouldSystemUseDarkMode) {
-        HMODULE hUxtheme = GetModuleHandleW(L"uxtheme.dll");
-        if (hUxtheme) {
-            // Ordinal 138 is ShouldSystemUseDarkMode
-            g_ShouldSystemUseDarkMode = (pShouldSystemUseDarkMode)GetProcAddress(
-                hUxtheme, MAKEINTRESOURCEA(138));
+    Wh_Log(L"[Process %d] Restored %lu changed windows", GetCurrentProcessId(), restored);
+}
+
+// Switch the dark controls of the calling thread's windows back to their
+// default visual styles
+VOID RestoreThreadControls() {
+    DWORD currentThreadId = GetCurrentThreadId();
+    for (const TrackedWindow& window : GetTrackedWindows()) {
+        if (window.controlsDark && window.threadId == currentThreadId &&
+            IsTrackedWindowAlive(window)) {
+            SwitchWindowControls(window.hWnd, FALSE);
         }
     }
+}
+
+// Restore the controls the mod switched to dark. Runs before the hooks are
+// removed: each owner thread gets one message, sent to a window of it that
+// reaches the hook, with a timeout so a hung thread can't hold up unloading.
+VOID RestoreAllControls() {
+    if (!g_controlClassVerdicts)
+        return;
     
-    if (g_ShouldSystemUseDarkMode) {
-        return g_ShouldSystemUseDarkMode() != 0;
+    RestoreThreadControls();
+    
+    std::vector<DWORD> threadIds;
+    for (const TrackedWindow& window : GetTrackedWindows()) {
+        if (!window.controlsDark || !window.reachesHook ||
+            window.threadId == GetCurrentThreadId() ||
+            std::find(threadIds.begin(), threadIds.end(), window.threadId) != threadIds.end() ||
+            !IsTrackedWindowAlive(window))
+            continue;
+        
+        threadIds.push_back(window.threadId);
+        DWORD_PTR result;
+        if (!SendMessageTimeoutW(window.hWnd, g_applyControlsMsg, FALSE, CONTROLS_RESTORE_THREAD,
+            SMTO_ABORTIFHUNG | SMTO_ERRORONEXIT, CONTROLS_RESTORE_TIMEOUT_MS, &result)) {
+            Wh_Log(L"[Process %d] Thread %lu didn't restore its controls",
+                GetCurrentProcessId(), window.threadId);
+        }
     }
+}
+
+// Check if the current process is explorer.exe
+BOOL IsExplorerProcess() {
+    WCHAR exePath[MAX_PATH];
+    if (GetModuleFileNameW(nullptr, exePath, MAX_PATH) == 0)
+        return FALSE;
     
-    return FALSE;
+    PCWSTR fileName = wcsrchr(exePath, L'\\');
+    return _wcsicmp(fileName ? fileName + 1 : exePath, L"explorer.exe") == 0;
 }
 
-// Check if current process should be excluded
-BOOL IsProcessExcluded() {
-    static int isExcluded = -1; // -1 = not checked, 0 = not excluded, 1 = excluded
+// Check if the current process is elevated. Explorer can't change the windows
+// of elevated processes, so these always keep the mod.
+BOOL IsProcessElevated() {
+    HANDLE hToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken))
+        return FALSE;
+    
+    TOKEN_ELEVATION elevation = {};
+    DWORD size = sizeof(elevation);
+    BOOL elevated = GetTokenInformation(hToken, TokenElevation, &elevation, size, &size) &&
+        elevation.TokenIsElevated;
+    CloseHandle(hToken);
+    return elevated;
+}
+
+// Check if a process is still running
+BOOL IsProcessRunning(DWORD processId) {
+    HANDLE hProcess = OpenProcess(SYNCHRONIZE, FALSE, processId);
+    if (!hProcess)
+        return FALSE;
+    
+    BOOL running = WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT;
+    CloseHandle(hProcess);
+    return running;
+}
+
+// In watcher mode, check if a running watcher can serve the current process,
+// which then doesn't need the mod. Reads the shared state without keeping it.
+BOOL IsServedByWindowWatcher() {
+    if (!g_settings.watcherMode || IsExplorerProcess() || IsProcessElevated())
+        return FALSE;
+    
+    HANDLE hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, SHARED_THEME_STATE_NAME);
+    if (!hMapping)
+        return FALSE;
     
-    if (isExcluded != -1) {
-        return isExcluded == 1;
+    DWORD watcherPid = 0;
+    SharedThemeState* state = (SharedThemeState*)MapViewOfFile(hMapping,
+        FILE_MAP_READ, 0, 0, sizeof(SharedThemeState));
+    if (state) {
+        watcherPid = state->watcherPid.load();
+        UnmapViewOfFile(state);
     }
+    CloseHandle(hMapping);
     
-    WCHAR exePath[MAX_PATH];
-    if (GetModuleFileNameW(nullptr, exePath, MAX_PATH) == 0) {
-        isExcluded = 0;
+    return watcherPid && IsProcessRunning(watcherPid);
+}
+
+// Check if a process runs the mod itself (it holds a stats slot), in which
+// case the watcher leaves its windows alone. A slot left behind by a dead
+// process whose id was reused doesn't count.
+BOOL IsProcessInjected(DWORD processId) {
+    if (!g_sharedStats)
         return FALSE;
+    
+    for (const ProcessStatsSlot& slot : g_sharedStats->slots) {
+        if (slot.processId.load(std::memory_order_relaxed) == processId)
+            return IsStatsSlotOwnerRunning(slot, processId);
+    }
+    return FALSE;
+}
+
+// Find out whether the watcher serves a process and with which rule. This is
+// done once per process, the entry is dropped when the process has exited.
+// A process that can't be opened is looked at again for each window.
+WatchedProcess GetWatchedProcess(DWORD processId) {
+    auto it = g_watchedProcesses.find(processId);
+    if (it != g_watchedProcesses.end()) {
+        if (WaitForSingleObject(it->second.hProcess, 0) == WAIT_TIMEOUT)
+            return it->second;
+        CloseHandle(it->second.hProcess);
+        g_watchedProcesses.erase(it);
     }
     
-    // Get just the filename
-    WCHAR* fileName = wcsrchr(exePath, L'\\');
-    if (fileName) {
-        fileName++; // Skip the backslash
-    } else {
-        fileName = exePath;
+    WatchedProcess process = { nullptr, IsProcessInjected(processId), { RULE_FOLLOW, POLICY_INHERIT } };
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, FALSE, processId);
+    if (!hProcess)
+        return process;
+    
+    process.hProcess = hProcess;
+    if (!process.injected) {
+        process.verdict = ClassifyProcessHandle(hProcess);
+    }
+    g_watchedProcesses.emplace(processId, process);
+    return process;
+}
+
+// Close the handles of the watched processes, all of them or those that exited
+VOID ForgetWatchedProcesses(BOOL exitedOnly) {
+    for (auto it = g_watchedProcesses.begin(); it != g_watchedProcesses.end();) {
+        if (exitedOnly && WaitForSingleObject(it->second.hProcess, 0) == WAIT_TIMEOUT) {
+            ++it;
+            continue;
+        }
+        CloseHandle(it->second.hProcess);
+        it = g_watchedProcesses.erase(it);
+    }
+}
+
+// Apply the theme to a window of another process, from the watcher thread.
+// DWM accepts the attributes from another process at the same or a higher
+// integrity level; the frame change is queued to the owner thread.
+VOID WatcherApplyToWindow(HWND hWnd, BOOL isDarkMode) {
+    DWORD processId = 0;
+    if (!GetWindowThreadProcessId(hWnd, &processId) || processId == GetCurrentProcessId())
+        return;
+    
+    if (!HasEligibleStyle(hWnd))
+        return;
+    
+    WatchedProcess process = GetWatchedProcess(processId);
+    if (process.injected || process.verdict.action == RULE_SKIP)
+        return;
+    
+    // Class atoms are per process, so the class rules are looked up by name
+    RuleVerdict classVerdict = LookupClassRule(hWnd);
+    if (classVerdict.action == RULE_SKIP)
+        return;
+    
+    int state = ResolveRuleState(classVerdict, process.verdict, isDarkMode);
+    const DwmAttributeSet& set = GetAttributeSet(state);
+    
+    auto it = g_watchedWindows.find(hWnd);
+    if (it == g_watchedWindows.end()) {
+        TrackedWindow window = { hWnd, GetWindowThreadProcessId(hWnd, nullptr),
+            APPLIED_STATE_NONE, TRUE, FALSE, DWMSBT_AUTO_VALUE, 0, FALSE, FALSE };
+        if (FAILED(DwmGetWindowAttribute(hWnd, DWMWA_USE_IMMERSIVE_DARK_MODE,
+            &window.originalDarkMode, sizeof(window.originalDarkMode)))) {
+            window.originalDarkMode = ORIGINAL_DARK_MODE_UNKNOWN;
+        }
+        if ((set.mask & ATTRIBUTE_BACKDROP) && FAILED(DwmGetWindowAttribute(hWnd,
+            DWMWA_SYSTEMBACKDROP_TYPE, &window.originalBackdrop, sizeof(window.originalBackdrop)))) {
+            window.originalBackdrop = DWMSBT_AUTO_VALUE;
+        }
+        it = g_watchedWindows.emplace(hWnd, window).first;
     }
     
-    // Convert to lowercase for comparison
-    for (WCHAR* p = fileName; *p; p++) {
-        *p = towlower(*p);
+    if (it->second.appliedState == state) {
+        g_appliesSkipped++;
+        STATS_INCREMENT(appliesSkipped);
+        return;
     }
     
-    // List of excluded processes
-    const WCHAR* excludedProcesses[] = {
-        L"systemsettings.exe",
-        L"applicationframehost.exe", // UWP app host
-        nullptr
-    };
+    // Remember the state even on failure, so a refused window isn't retried
+    // on every show
+    it->second.appliedState = state;
+    it->second.changedMask |= set.mask;
     
-    for (int i = 0; excludedProcesses[i] != nullptr; i++) {
-        if (wcscmp(fileName, excludedProcesses[i]) == 0) {
-            Wh_Log(L"Process excluded: %s", fileName);
-            isExcluded = 1;
-            return TRUE;
+    LONGLONG applyStart = StatsStartTiming();
+    HRESULT hr = SetDwmAttributes(hWnd, set);
+    if (FAILED(hr)) {
+        LOG_WARNING(L"Watcher can't set attributes on window %p of process %lu, error=0x%08X",
+            hWnd, processId, hr);
+        return;
+    }
+    
+    RecordPerceivedLatency(hWnd);
+    SetWindowPos(hWnd, nullptr, 0, 0, 0, 0, SWP_FRAMECHANGED | SWP_NOMOVE | SWP_NOSIZE |
+        SWP_NOZORDER | SWP_NOOWNERZORDER | SWP_NOACTIVATE | SWP_ASYNCWINDOWPOS);
+    StatsRecordApplyLatency(applyStart);
+    STATS_INCREMENT(frameChanges);
+    g_appliesPerformed++;
+    LOG_VERBOSE(L"Watcher applied state %d to window %p of process %lu", state, hWnd, processId);
+}
+
+BOOL CALLBACK WatcherEnumWindowsProc(HWND hWnd, LPARAM lParam) {
+    WatcherApplyToWindow(hWnd, (BOOL)lParam);
+    return TRUE;
+}
+
+// Apply the theme to all top-level windows the watcher serves, and log how
+// long the pass took
+VOID WatcherApplyToAllWindows(BOOL isDarkMode) {
+    ULONGLONG startTick = GetTickCount64();
+    
+    // Forget windows and processes that are gone
+    for (auto it = g_watchedWindows.begin(); it != g_watchedWindows.end();) {
+        if (!IsWindow(it->first)) {
+            it = g_watchedWindows.erase(it);
+        } else {
+            ++it;
         }
     }
+    ForgetWatchedProcesses(TRUE);
     
-    isExcluded = 0;
-    return FALSE;
+    // The foreground window first, then the rest top to bottom (EnumWindows
+    // goes in z-order)
+    HWND foregroundWnd = GetForegroundWindow();
+    if (foregroundWnd) {
+        WatcherApplyToWindow(foregroundWnd, isDarkMode);
+    }
+    EnumWindows(WatcherEnumWindowsProc, (LPARAM)isDarkMode);
+    Wh_Log(L"[Process %d] Watcher pass (%s) over %zu served windows took %llu ms",
+        GetCurrentProcessId(), isDarkMode ? L"DARK" : L"LIGHT", g_watchedWindows.size(),
+        GetTickCount64() - startTick);
 }
 
-// Check if window is eligible for dark mode
-BOOL IsWindowEligible(HWND hWnd) {
-    if (!hWnd || !IsWindow(hWnd))
-        return FALSE;
+// Put back the original attributes of the windows the watcher changed
+VOID WatcherRestoreWindows() {
+    for (const auto& entry : g_watchedWindows) {
+        const TrackedWindow& window = entry.second;
+        if (window.appliedState < 0 || !IsWindow(window.hWnd))
+            continue;
+        if (!window.changedMask && (window.originalDarkMode == ORIGINAL_DARK_MODE_UNKNOWN ||
+            GetAttributeSet(window.appliedState).darkMode == window.originalDarkMode))
+            continue;
         
-    // Get window styles
-    LONG style = GetWindowLongW(hWnd, GWL_STYLE);
-    LONG styleEx = GetWindowLongW(hWnd, GWL_EXSTYLE);
+        DwmAttributeSet original = {};
+        original.darkMode = window.originalDarkMode;
+        original.mask = window.changedMask;
+        if (window.originalDarkMode == ORIGINAL_DARK_MODE_UNKNOWN) {
+            original.mask |= ATTRIBUTE_KEEP_DARK_MODE;
+        }
+        original.captionColor = DWMWA_COLOR_DEFAULT;
+        original.borderColor = DWMWA_COLOR_DEFAULT;
+        original.textColor = DWMWA_COLOR_DEFAULT;
+        original.backdrop = window.originalBackdrop;
+        if (SUCCEEDED(SetDwmAttributes(window.hWnd, original))) {
+            SetWindowPos(window.hWnd, nullptr, 0, 0, 0, 0, SWP_FRAMECHANGED | SWP_NOMOVE |
+                SWP_NOSIZE | SWP_NOZORDER | SWP_NOOWNERZORDER | SWP_NOACTIVATE | SWP_ASYNCWINDOWPOS);
+        }
+    }
+    g_watchedWindows.clear();
+}
+
+// New or shown top-level windows of other processes
+VOID CALLBACK WatcherWinEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+    LONG idObject, LONG idChild, DWORD idEventThread, DWORD dwmsEventTime) {
+    if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !hWnd)
+        return;
     
-    // Must have a titlebar (caption)
-    if (!(style & WS_CAPTION))
-        return FALSE;
-        
-    // Skip tool windows
-    if (styleEx & WS_EX_TOOLWINDOW)
-        return FALSE;
-        
-    // Skip child windows
-    if (style & WS_CHILD)
-        return FALSE;
+    if (event == EVENT_OBJECT_DESTROY) {
+        g_watchedWindows.erase(hWnd);
+        return;
+    }
     
-    return TRUE;
+    // Only top-level windows
+    HWND hParentWnd = GetAncestor(hWnd, GA_PARENT);
+    if (hParentWnd && hParentWnd != GetDesktopWindow())
+        return;
+    
+    WatcherApplyToWindow(hWnd, g_isDarkMode);
 }
 
-// Apply dark mode to a window
-VOID ApplyDarkMode(HWND hWnd, BOOL useDarkMode) {
-    if (!IsWindowEligible(hWnd))
-        return;
-        
-    BOOL value = useDarkMode ? TRUE : FALSE;
-    HRESULT hr = DwmSetWindowAttribute(hWnd, DWMWA_USE_IMMERSIVE_DARK_MODE, 
-        &value, sizeof(value));
+// Watcher thread: receives the WinEvents out of context, so nothing runs in
+// the other processes, and applies the theme passes posted by UpdateThemeMode
+DWORD WINAPI WindowWatcherThreadProc(LPVOID) {
+    HWINEVENTHOOK hook = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_SHOW, nullptr,
+        WatcherWinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
     
-    if (SUCCEEDED(hr)) {
-        // Force window to redraw titlebar
-        SetWindowPos(hWnd, nullptr, 0, 0, 0, 0, 
-            SWP_FRAMECHANGED | SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER | SWP_NOOWNERZORDER);
-        Wh_Log(L"Applied dark mode (%d) to window: %p", useDarkMode, hWnd);
+    // Make sure the thread has a message queue before anyone posts to it
+    MSG msg;
+    PeekMessageW(&msg, nullptr, WM_USER, WM_USER, PM_NOREMOVE);
+    SetEvent(g_watcherStartEvent);
+    
+    if (!hook) {
+        Wh_Log(L"[Process %d] ERROR: Failed to set the watcher WinEvent hook, error=%lu",
+            GetCurrentProcessId(), GetLastError());
+        return 0;
+    }
+    
+    WatcherApplyToAllWindows(g_isDarkMode);
+    
+    while (GetMessageW(&msg, nullptr, 0, 0) > 0) {
+        if (!msg.hwnd && msg.message == WATCHER_APPLY_MSG) {
+            WatcherApplyToAllWindows((BOOL)msg.wParam);
+            continue;
+        }
+        TranslateMessage(&msg);
+        DispatchMessageW(&msg);
     }
+    
+    UnhookWinEvent(hook);
+    WatcherRestoreWindows();
+    ForgetWatchedProcesses(FALSE);
+    return 0;
 }
 
-// Apply dark mode to a specific window (called from hook)
-VOID NewWindowShown(HWND hWnd) {
-    if (IsProcessExcluded())
+// In watcher mode, run the window watcher if this is the first explorer.exe
+// (or the previous watcher is gone)
+VOID StartWindowWatcher() {
+    if (!g_settings.watcherMode || !g_sharedTheme || !IsExplorerProcess())
         return;
-        
-    if (!hWnd || !IsWindow(hWnd))
+    
+    DWORD processId = GetCurrentProcessId();
+    DWORD watcherPid = g_sharedTheme->watcherPid.load();
+    if (watcherPid && IsProcessRunning(watcherPid))
+        return;
+    if (!g_sharedTheme->watcherPid.compare_exchange_strong(watcherPid, processId))
+        return;
+    
+    g_watcherStartEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (g_watcherStartEvent) {
+        g_watcherThread = CreateThread(nullptr, 0, WindowWatcherThreadProc, nullptr, 0, &g_watcherThreadId);
+    }
+    if (!g_watcherThread) {
+        Wh_Log(L"[Process %d] ERROR: Failed to start the window watcher, error=%lu",
+            processId, GetLastError());
+        g_watcherThreadId = 0;
+        g_sharedTheme->watcherPid.store(0);
         return;
+    }
+    
+    // The thread sets the event as soon as it has a message queue, which
+    // StopWindowWatcher posts to
+    WaitForSingleObject(g_watcherStartEvent, INFINITE);
+    Wh_Log(L"[Process %d] Running the window watcher", processId);
+}
+
+// Stop the watcher thread, which restores the windows it changed, and give
+// up the watcher role
+VOID StopWindowWatcher() {
+    if (g_watcherThread) {
+        // The thread must be gone before the mod is unloaded
+        PostThreadMessageW(g_watcherThreadId, WM_QUIT, 0, 0);
+        WaitForSingleObject(g_watcherThread, INFINITE);
+        CloseHandle(g_watcherThread);
+        g_watcherThread = nullptr;
+        g_watcherThreadId = 0;
         
-    if (!IsWindowEligible(hWnd))
+        DWORD processId = GetCurrentProcessId();
+        g_sharedTheme->watcherPid.compare_exchange_strong(processId, 0);
+    }
+    if (g_watcherStartEvent) {
+        CloseHandle(g_watcherStartEvent);
+        g_watcherStartEvent = nullptr;
+    }
+}
+
+// Take up to `wanted` frame changes from the session-wide token bucket.
+// Returns how many were granted, which may be 0.
+LONG AcquireFrameChangeTokens(LONG wanted) {
+    LONG rate = g_settings.initialFrameChangesPerSecond;
+    if (!g_sharedTheme || rate <= 0)
+        return wanted;
+    
+    ULONGLONG state = g_sharedTheme->frameChangeBucket.load();
+    for (;;) {
+        DWORD now = GetTickCount();
+        DWORD tick = (DWORD)(state >> 32);
+        LONG tokens = (LONG)(DWORD)state;
+        if (state == 0) {
+            // First use, start with a full second worth of budget
+            tick = now;
+            tokens = rate;
+        }
+        
+        // Refill for the elapsed time, only advancing the tick by the time
+        // that whole tokens were added for
+        ULONGLONG refill = (ULONGLONG)(DWORD)(now - tick) * rate / 1000;
+        if (refill >= (ULONGLONG)rate) {
+            tokens = rate;
+            tick = now;
+        } else if (refill > 0) {
+            tokens = tokens + (LONG)refill < rate ? tokens + (LONG)refill : rate;
+            tick += (DWORD)(refill * 1000 / rate);
+        }
+        
+        LONG granted = tokens < wanted ? tokens : wanted;
+        ULONGLONG newState = ((ULONGLONG)tick << 32) | (DWORD)(tokens - granted);
+        if (newState == 0) {
+            newState = 1ULL << 32;  // 0 is reserved for "never used"
+        }
+        if (g_sharedTheme->frameChangeBucket.compare_exchange_weak(state, newState))
+            return granted;
+    }
+}
+
+// Check if another running process is still in its initial pass. Slots of
+// processes that died mid-pass don't count.
+BOOL IsOtherInitialPassPending() {
+    if (!g_sharedStats)
+        return FALSE;
+    
+    for (const ProcessStatsSlot& slot : g_sharedStats->slots) {
+        DWORD processId = slot.processId.load(std::memory_order_relaxed);
+        if (processId && &slot != g_stats && slot.initialPassPending.load(std::memory_order_relaxed) &&
+            IsStatsSlotOwnerRunning(slot, processId))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Stop the initial pass if it's still running
+VOID StopInitialApply() {
+    if (g_initialApplyTimer) {
+        SetThreadpoolTimer(g_initialApplyTimer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(g_initialApplyTimer, TRUE);
+        CloseThreadpoolTimer(g_initialApplyTimer);
+        g_initialApplyTimer = nullptr;
+    }
+    
+    g_stats->initialPassPending = 0;
+    g_initialApplyWindows.clear();
+    g_initialApplyNext = 0;
+}
+
+// Apply the initial pass to as many windows as the budget allows, then come
+// back when the next frame changes are available
+VOID CALLBACK InitialApplyTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    LONG remaining = (LONG)(g_initialApplyWindows.size() - g_initialApplyNext);
+    LONG granted = AcquireFrameChangeTokens(remaining);
+    
+    BOOL isDarkMode = g_isDarkMode;
+    for (LONG i = 0; i < granted; i++) {
+        const TrackedWindow& window = g_initialApplyWindows[g_initialApplyNext++];
+        if (IsTrackedWindowAlive(window)) {
+            ApplyDarkMode(window.hWnd, isDarkMode);
+        }
+    }
+    
+    if (g_initialApplyNext < g_initialApplyWindows.size()) {
+        // Wait about one token's worth of time
+        LONG rate = g_settings.initialFrameChangesPerSecond;
+        LONGLONG delayMs = rate < 100 ? 1000 / rate : 10;
+        ULARGE_INTEGER dueTime;
+        dueTime.QuadPart = (ULONGLONG)(-delayMs * 10000);
+        FILETIME ftDueTime;
+        ftDueTime.dwLowDateTime = dueTime.LowPart;
+        ftDueTime.dwHighDateTime = dueTime.HighPart;
+        SetThreadpoolTimer(g_initialApplyTimer, &ftDueTime, 0, 0);
         return;
+    }
+    
+    ULONGLONG now = GetTickCount64();
+    Wh_Log(L"[Process %d] Initial pass converged in %llu ms (%zu windows)",
+        GetCurrentProcessId(), now - g_initialApplyStartTick, g_initialApplyWindows.size());
     
-    Wh_Log(L"New window detected: %p, applying dark mode: %d", hWnd, g_isDarkMode);
-    ApplyDarkMode(hWnd, g_isDarkMode);
+    g_stats->initialPassPending = 0;
+    if (g_sharedTheme && !IsOtherInitialPassPending()) {
+        Wh_Log(L"[Process %d] Session-wide initial pass converged in %llu ms",
+            GetCurrentProcessId(), now - g_sharedTheme->initialBurstStartTick.load());
+    }
 }
 
-// Enumerate callback for existing windows
-BOOL CALLBACK EnumWindowsProc(HWND hWnd, LPARAM lParam) {
-    BOOL useDarkMode = (BOOL)lParam;
+// Apply the theme to the windows that existed before the mod loaded. With a
+// budget set, the frame changes are spread over time across all processes
+// instead of every process redrawing all its windows at the same moment.
+VOID StartInitialApply() {
+    g_initialApplyStartTick = GetTickCount64();
     
-    // Skip if not a top-level window
-    HWND hParentWnd = GetAncestor(hWnd, GA_PARENT);
-    if (hParentWnd && hParentWnd != GetDesktopWindow())
-        return TRUE;
+    if (!g_sharedTheme || g_settings.initialFrameChangesPerSecond <= 0) {
+        ApplyToAllWindows(g_isDarkMode.load());
+        Wh_Log(L"[Process %d] Initial pass converged in %llu ms",
+            GetCurrentProcessId(), GetTickCount64() - g_initialApplyStartTick);
+        return;
+    }
     
-    // Check if window belongs to current process
-    DWORD dwProcessId = 0;
-    if (!GetWindowThreadProcessId(hWnd, &dwProcessId) || 
-        dwProcessId != GetCurrentProcessId())
-        return TRUE;
+    g_initialApplyWindows = GetTrackedWindows();
+    SortWindowsForApply(&g_initialApplyWindows);
+    g_initialApplyNext = 0;
+    if (g_initialApplyWindows.empty())
+        return;
     
-    ApplyDarkMode(hWnd, useDarkMode);
-    return TRUE;
+    g_initialApplyTimer = CreateThreadpoolTimer(InitialApplyTimerCallback, nullptr, nullptr);
+    if (!g_initialApplyTimer) {
+        g_initialApplyWindows.clear();
+        ApplyToAllWindows(g_isDarkMode.load());
+        return;
+    }
+    
+    g_stats->initialPassPending = 1;
+    if (!IsOtherInitialPassPending()) {
+        g_sharedTheme->initialBurstStartTick = g_initialApplyStartTick;
+    }
+    
+    FILETIME ftDueTime = {};  // now
+    SetThreadpoolTimer(g_initialApplyTimer, &ftDueTime, 0, 0);
 }
 
-// Apply dark mode to all existing windows in current process
-VOID ApplyToAllWindows(BOOL useDarkMode) {
-    EnumWindows(EnumWindowsProc, (LPARAM)useDarkMode);
+// Subclass (or unsubclass) all tracked windows in current process
+VOID SubclassAllWindows(BOOL subclass) {
+    for (const TrackedWindow& window : GetTrackedWindows()) {
+        if (!IsTrackedWindowAlive(window))
+            continue;
+        
+        if (subclass) {
+            SubclassWindow(window.hWnd);
+        } else {
+            SubclassWindowFromAnyThread(window.hWnd, FALSE);
+        }
+    }
 }
 
 // Hook DefWindowProc to catch theme changes
@@ -209,21 +3494,95 @@ using DefWindowProc_t = decltype(&DefWindowProcW);
 DefWindowProc_t DefWindowProc_orig;
 
 LRESULT WINAPI DefWindowProc_hook(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
-    // Detect theme change messages
-    if (!IsProcessExcluded() && (Msg == WM_DWMCOLORIZATIONCOLORCHANGED || Msg == WM_SETTINGCHANGE)) {
-        BOOL newDarkMode = IsSystemDarkMode();
+    // Detect theme change messages. The hook is never installed in excluded
+    // processes, so nothing else needs to be checked first. Only handled
+    // messages are counted, a shared counter on every call would cost more
+    // than the check itself.
+    if (IsHookedMessage(Msg)) {
+        HandleHookedMessage(hWnd, Msg, wParam, lParam);
+    }
+    
+    return DefWindowProc_orig(hWnd, Msg, wParam, lParam);
+}
+
+// Start everything that follows the theme for the windows of the process:
+// dark controls, the log ring, the counters, the shared theme state with its
+// waits and the window watcher
+VOID StartThemeTracking() {
+    InitDarkControls();
+    StartLogRing();
+    OpenProcessStats();
+    
+    // The elected writer (or every process if there is no shared state) watches
+    // the registry. Everyone else takes the state published by the writer.
+    BOOL isDarkMode;
+    LONG generation = 0;
+    BOOL hasSharedState = OpenSharedThemeState();
+    if ((!hasSharedState || TryBecomeThemeWriter()) && StartThemeWatcher()) {
+        isDarkMode = g_cachedDarkMode;
+        ReadSharedThemeState(nullptr, &generation);
+    } else if (!hasSharedState || !ReadSharedThemeState(&isDarkMode, &generation)) {
+        isDarkMode = IsSystemDarkMode();
+        g_cachedDarkMode = isDarkMode;
+    }
+    if (!g_personalizeWait) {
+        ResignThemeWriter();
+    }
+    g_isDarkMode = isDarkMode;
+    Wh_Log(L"[Process %d] Initial theme mode: %s", 
+        GetCurrentProcessId(), isDarkMode ? L"DARK" : L"LIGHT");
+    
+    // Get notified when the writer publishes a new theme generation
+    if (g_sharedTheme) {
+        ArmThemeGenerationWait(generation);
+        WatchThemeWriter();
+    }
+    
+    g_reevaluateTimer = CreateThreadpoolTimer(ReevaluateTimerCallback, nullptr, nullptr);
+    g_statsReportTimer = CreateThreadpoolTimer(StatsReportTimerCallback, nullptr, nullptr);
+    
+    StartWindowWatcher();
+}
+
+// In lazy mode, start the theme tracking and hook DefWindowProcW when the
+// first eligible window appears. Until then the process only has the creation
+// hooks. Other threads creating eligible windows meanwhile wait for it. A
+// failed hook is tried again with the next eligible window.
+static SRWLOCK g_lazySetupLock = SRWLOCK_INIT;
+static BOOL g_themeTrackingStarted = FALSE;
+static std::atomic<BOOL> g_defWindowProcHooked{FALSE};
+
+VOID EnsureDefWindowProcHook() {
+    if (g_settings.hookMode != HOOK_MODE_LAZY ||
+        g_defWindowProcHooked.load(std::memory_order_acquire)) {
+        return;
+    }
+    
+    AcquireSRWLockExclusive(&g_lazySetupLock);
+    if (!g_themeTrackingStarted) {
+        SIZE_T committedAtStart = GetCommittedBytes();
+        StartThemeTracking();
+        g_themeTrackingStarted = TRUE;
         
-        if (newDarkMode != g_isDarkMode) {
-            g_isDarkMode = newDarkMode;
-            Wh_Log(L"[Process %d] Theme changed to %s mode", 
-                GetCurrentProcessId(), newDarkMode ? L"DARK" : L"LIGHT");
-            
-            // Apply to all windows in current process
-            ApplyToAllWindows(g_isDarkMode);
+        // Wh_ModInit counted into the local slot, before the shared one was open
+        SIZE_T committed = GetCommittedBytes();
+        if (g_stats != &g_localStats) {
+            g_stats->committedBytes += g_localStats.committedBytes.load();
         }
+        g_stats->committedBytes += committed > committedAtStart ? committed - committedAtStart : 0;
     }
     
-    return DefWindowProc_orig(hWnd, Msg, wParam, lParam);
+    if (!g_defWindowProcHooked.load(std::memory_order_relaxed)) {
+        if (Wh_SetFunctionHook((void*)DefWindowProcW, (void*)DefWindowProc_hook,
+            (void**)&DefWindowProc_orig)) {
+            Wh_ApplyHookOperations();
+            g_defWindowProcHooked.store(TRUE, std::memory_order_release);
+            Wh_Log(L"[Process %d] First eligible window, hooked DefWindowProcW", GetCurrentProcessId());
+        } else {
+            Wh_Log(L"[Process %d] ERROR: Failed to hook DefWindowProcW", GetCurrentProcessId());
+        }
+    }
+    ReleaseSRWLockExclusive(&g_lazySetupLock);
 }
 
 // Hook CreateWindowExW/A (documented APIs) instead of internal NtUserCreateWindowEx
@@ -241,7 +3600,7 @@ HWND WINAPI CreateWindowExW_hook(
         dwExStyle, lpClassName, lpWindowName, dwStyle,
         X, Y, nWidth, nHeight, hWndParent, hMenu, hInstance, lpParam);
     if (hWnd) {
-        NewWindowShown(hWnd);
+        NewWindowShown(hWnd, dwExStyle, dwStyle, hWndParent);
     }
     return hWnd;
 }
@@ -257,30 +3616,82 @@ HWND WINAPI CreateWindowExA_hook(
         dwExStyle, lpClassName, lpWindowName, dwStyle,
         X, Y, nWidth, nHeight, hWndParent, hMenu, hInstance, lpParam);
     if (hWnd) {
-        NewWindowShown(hWnd);
+        NewWindowShown(hWnd, dwExStyle, dwStyle, hWndParent);
     }
     return hWnd;
 }
 
+// Hook UnregisterClassW/A, so the atom caches forget a class whose atom
+// can be reused. The atom is looked up before the class is gone.
+using UnregisterClassW_t = decltype(&UnregisterClassW);
+static UnregisterClassW_t UnregisterClassW_orig;
+
+BOOL WINAPI UnregisterClassW_hook(LPCWSTR lpClassName, HINSTANCE hInstance) {
+    WNDCLASSEXW wc = { sizeof(wc) };
+    ATOM atom = GetClassInfoExW(hInstance, lpClassName, &wc);
+    BOOL result = UnregisterClassW_orig(lpClassName, hInstance);
+    if (result && atom) {
+        ForgetClassAtom(atom);
+    }
+    return result;
+}
+
+using UnregisterClassA_t = decltype(&UnregisterClassA);
+static UnregisterClassA_t UnregisterClassA_orig;
+
+BOOL WINAPI UnregisterClassA_hook(LPCSTR lpClassName, HINSTANCE hInstance) {
+    WNDCLASSEXA wc = { sizeof(wc) };
+    ATOM atom = GetClassInfoExA(hInstance, lpClassName, &wc);
+    BOOL result = UnregisterClassA_orig(lpClassName, hInstance);
+    if (result && atom) {
+        ForgetClassAtom(atom);
+    }
+    return result;
+}
+
 // Windhawk mod initialization
 BOOL Wh_ModInit() {
     Wh_Log(L"=======================================");
     Wh_Log(L"[Process %d] Initializing Auto Dark Titlebar mod", GetCurrentProcessId());
+    SIZE_T committedAtStart = GetCommittedBytes();
     
-    // Check if this process should be excluded
+    // Rules are needed to classify the process
+    LoadSettings();
+    
+    // Classify the process once. Excluded processes install no hooks at all,
+    // so they pay nothing per message or per window.
     if (IsProcessExcluded()) {
         Wh_Log(L"[Process %d] Process is excluded, skipping initialization", GetCurrentProcessId());
+        delete[] g_classAtomVerdicts;
+        g_classAtomVerdicts = nullptr;
         Wh_Log(L"=======================================");
         return TRUE; // Return TRUE so mod doesn't fail, just does nothing
     }
     
-    // Get initial dark mode state
-    g_isDarkMode = IsSystemDarkMode();
-    Wh_Log(L"[Process %d] Initial theme mode: %s", 
-        GetCurrentProcessId(), g_isDarkMode ? L"DARK" : L"LIGHT");
+    // The watcher in Explorer applies the theme from the outside, unload
+    if (IsServedByWindowWatcher()) {
+        Wh_Log(L"[Process %d] Served by the window watcher, unloading", GetCurrentProcessId());
+        g_servedByWatcher = TRUE;
+        delete[] g_classAtomVerdicts;
+        g_classAtomVerdicts = nullptr;
+        Wh_Log(L"=======================================");
+        return FALSE;
+    }
+    
+    InitDarkModeFallback();
+    UpdateHookedMessageBits();
+    if (g_settings.hookMode != HOOK_MODE_LAZY) {
+        StartThemeTracking();
+    }
     
-    // Hook DefWindowProc to detect theme changes (works globally)
-    if (!Wh_SetFunctionHook((void*)DefWindowProcW, (void*)DefWindowProc_hook,
+    // Hook DefWindowProc to detect theme changes (works globally), unless only
+    // the eligible windows are subclassed or the hook waits for the first one
+    if (g_settings.hookMode == HOOK_MODE_SUBCLASS) {
+        Wh_Log(L"[Process %d] Subclass mode, not hooking DefWindowProcW", GetCurrentProcessId());
+    } else if (g_settings.hookMode == HOOK_MODE_LAZY) {
+        Wh_Log(L"[Process %d] Lazy mode, DefWindowProcW is hooked and the theme tracked "
+            L"from the first eligible window", GetCurrentProcessId());
+    } else if (!Wh_SetFunctionHook((void*)DefWindowProcW, (void*)DefWindowProc_hook,
         (void**)&DefWindowProc_orig)) {
         Wh_Log(L"[Process %d] ERROR: Failed to hook DefWindowProcW", GetCurrentProcessId());
     } else {
@@ -300,6 +3711,16 @@ BOOL Wh_ModInit() {
     } else {
         Wh_Log(L"[Process %d] Successfully hooked CreateWindowExA", GetCurrentProcessId());
     }
+    if (!Wh_SetFunctionHook((void*)UnregisterClassW, (void*)UnregisterClassW_hook,
+        (void**)&UnregisterClassW_orig) ||
+        !Wh_SetFunctionHook((void*)UnregisterClassA, (void*)UnregisterClassA_hook,
+        (void**)&UnregisterClassA_orig)) {
+        Wh_Log(L"[Process %d] WARNING: Failed to hook UnregisterClass, reused class atoms "
+            L"keep the cached decisions", GetCurrentProcessId());
+    }
+    
+    SIZE_T committed = GetCommittedBytes();
+    g_stats->committedBytes += committed > committedAtStart ? committed - committedAtStart : 0;
     
     Wh_Log(L"[Process %d] Initialization complete", GetCurrentProcessId());
     Wh_Log(L"=======================================");
@@ -309,25 +3730,77 @@ BOOL Wh_ModInit() {
 
 // Apply to existing windows after initialization
 VOID Wh_ModAfterInit() {
-    if (IsProcessExcluded()) {
+    if (IsProcessExcluded() || g_servedByWatcher) {
         return;
     }
     
     Wh_Log(L"[Process %d] Applying dark mode to existing windows...", GetCurrentProcessId());
-    ApplyToAllWindows(g_isDarkMode);
+    TrackExistingWindows();
+    StartInitialApply();
+    if (g_settings.hookMode == HOOK_MODE_SUBCLASS) {
+        SubclassAllWindows(TRUE);
+    }
     Wh_Log(L"[Process %d] Finished applying to existing windows", GetCurrentProcessId());
 }
 
+// Restore the dark controls while the hooks can still handle the messages
+VOID Wh_ModBeforeUninit() {
+    if (IsProcessExcluded() || g_servedByWatcher) {
+        return;
+    }
+    
+    RestoreAllControls();
+}
+
 // Cleanup when mod is unloaded
 VOID Wh_ModUninit() {
-    if (IsProcessExcluded()) {
+    if (IsProcessExcluded() || g_servedByWatcher) {
         return;
     }
     
     Wh_Log(L"[Process %d] Uninitializing Auto Dark Titlebar mod", GetCurrentProcessId());
+    LogCreationStats();
+    
+    StopInitialApply();
+    StopWindowWatcher();
+    
+    // Stop re-evaluating, then stop listening for theme generations and hand
+    // off the writer role
+    if (g_reevaluateTimer) {
+        SetThreadpoolTimer(g_reevaluateTimer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(g_reevaluateTimer, TRUE);
+        CloseThreadpoolTimer(g_reevaluateTimer);
+        g_reevaluateTimer = nullptr;
+    }
+    BOOL isThemeWriter = g_isThemeWriter;
+    CloseSharedThemeState();
+    
+    // The subclass procedure must be gone before the mod is unloaded
+    if (g_settings.hookMode == HOOK_MODE_SUBCLASS) {
+        SubclassAllWindows(FALSE);
+    }
     
-    // Restore to default (remove dark mode attribute)
-    ApplyToAllWindows(FALSE);
+    // Put back what the mod changed, nothing else
+    RestoreAllWindows();
+    
+    delete[] g_classAtomVerdicts;
+    g_classAtomVerdicts = nullptr;
+    StopDarkControls();
+    
+    // The writer reports for the whole session before handing in its counters
+    LogProcessStats();
+    if (isThemeWriter) {
+        LogSessionStats();
+    }
+    CloseProcessStats();
+    
+    StopLogRing();
     
     Wh_Log(L"[Process %d] Cleanup complete", GetCurrentProcessId());
-}
\ No newline at end of file
+}
+
+// Settings changed, the hook mode can only be switched by reloading the mod
+BOOL Wh_ModSettingsChanged(BOOL* bReload) {
+    *bReload = TRUE;
+    return TRUE;
+}
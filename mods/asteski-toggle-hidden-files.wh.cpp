@@ -6,7 +6,7 @@
 // @author       Asteski
 // @github       https://github.com/Asteski
 // @include      explorer.exe
-// @compilerOptions -std=c++20
+// @compilerOptions -std=c++20 -lole32 -loleaut32 -luuid
 // ==/WindhawkMod==
 
 // ==WindhawkModSettings==
@@ -40,8 +40,21 @@ This mod allows you to toggle the visibility of hidden files in Windows Explorer
 
 ## Technical Details
 - Only activates when Windows Explorer windows are in focus
+- The focused window is tracked through foreground change events, so other keystrokes
+  are passed on without querying any window
+- The keyboard hook runs on its own high-priority thread that only pumps messages,
+  and the toggle itself runs on a thread pool thread
+- Windows silently drops low-level hooks that are too slow. The hook thread also
+  listens to raw keyboard input, and every 5 seconds a watchdog checks whether
+  keystrokes arrived that the keyboard hook never saw; if so the hook is
+  reinstalled. Mouse input is not taken as evidence, so the hook keeps its place
+  in the hook chain while only the mouse is used. Keystrokes that reached the
+  hook late, removed hooks and reinstalls are counted in the log.
 - Modifies the standard registry settings for showing hidden files
-- Sends refresh messages to all Explorer windows
+- Keeps the registry key open and the current values in memory, updated through
+  change notifications, so a toggle only writes the new values
+- Refreshes the Explorer windows and the desktop through the shell's window list,
+  without broadcasting the change to every application in the session
 - Handles proper cleanup when the mod is unloaded
 - Explorer process must be restarted for changes to take effect
 */
@@ -50,6 +63,11 @@ This mod allows you to toggle the visibility of hidden files in Windows Explorer
 #include <windows.h>
 #include <shlobj.h>
 #include <shellapi.h>
+#include <shobjidl.h>
+#include <shlguid.h>
+#include <exdisp.h>
+
+#include <atomic>
 
 // Settings structure
 struct {
@@ -58,8 +76,44 @@ struct {
 
 // Global variables
 HHOOK g_hKeyboardHook = nullptr;
+HWINEVENTHOOK g_hForegroundHook = nullptr;
 bool g_modEnabled = false;
 
+// Hook thread: owns the keyboard and foreground hooks and only pumps messages,
+// so keystrokes never wait for a busy Explorer thread
+HANDLE g_hookThread = nullptr;
+DWORD g_hookThreadId = 0;
+HANDLE g_hookStartEvent = nullptr;
+// The toggle runs as thread pool work, so uninit can wait for it to return
+PTP_WORK g_toggleWork = nullptr;
+std::atomic<bool> g_toggleRunning{false};
+std::atomic<LONGLONG> g_toggleStartTime{0};   // QueryPerformanceCounter at Ctrl+H
+
+// Thread message handled by the hook thread's message loop
+const UINT HOOK_THREAD_REINSTALL = WM_APP + 1;
+
+// Message-only window of the hook thread that receives raw keyboard input.
+// Raw input registrations are per process, so the sink is only registered if
+// Explorer has no keyboard registration of its own.
+const wchar_t* RAW_INPUT_WINDOW_CLASS = L"ToggleHiddenFilesRawInput";
+HWND g_rawInputWindow = nullptr;
+bool g_rawKeyboardRegistered = false;
+
+// Watchdog: Windows silently removes a low-level hook that misses
+// LowLevelHooksTimeout. The hook records when it was last called, and a raw
+// input sink on the hook thread when the last keystroke arrived. A keystroke
+// later than the last hook call, by more than the threshold, means the hook is
+// gone, and the hook is reinstalled.
+const DWORD HOOK_WATCHDOG_INTERVAL_MS = 5000;
+const DWORD HOOK_STALL_THRESHOLD_MS = 200;
+PTP_TIMER g_watchdogTimer = nullptr;
+std::atomic<DWORD> g_lastHookCallTick{0};    // GetTickCount at the last hook call
+std::atomic<DWORD> g_lastKeyboardInputTick{0};   // time of the last raw keystroke
+std::atomic<bool> g_reinstallPosted{false};
+std::atomic<ULONG> g_hookStalls{0};          // keystrokes that reached the hook late
+std::atomic<ULONG> g_hookRemovals{0};
+std::atomic<ULONG> g_hookReinstalls{0};
+
 // Registry keys and values for hidden files settings
 const wchar_t* EXPLORER_ADVANCED_KEY = L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\Advanced";
 const wchar_t* HIDDEN_FILES_VALUE = L"Hidden";
@@ -70,6 +124,15 @@ const DWORD HIDE_HIDDEN = 2;
 const DWORD SHOW_SUPER_HIDDEN = 1;
 const DWORD HIDE_SUPER_HIDDEN = 0;
 
+// Explorer\Advanced stays open for the lifetime of the mod. Hidden and
+// ShowSuperHidden are kept in memory and re-read only when the key reports a
+// change, so a toggle never reads the registry.
+HKEY g_hAdvancedKey = nullptr;
+HANDLE g_hAdvancedEvent = nullptr;
+HANDLE g_hAdvancedWait = nullptr;
+std::atomic<DWORD> g_hiddenSetting{HIDE_HIDDEN};
+std::atomic<DWORD> g_superHiddenSetting{HIDE_SUPER_HIDDEN};
+
 // Window context enumeration
 enum WindowContext {
     CONTEXT_UNKNOWN = 0,
@@ -77,22 +140,30 @@ enum WindowContext {
     CONTEXT_DESKTOP = 2
 };
 
+// Context of the foreground window, kept up to date by the foreground WinEvent
+// hook so the keyboard hook never has to look at the window itself
+std::atomic<WindowContext> g_foregroundContext{CONTEXT_UNKNOWN};
+
 // Function declarations
 LRESULT CALLBACK KeyboardHookProc(int nCode, WPARAM wParam, LPARAM lParam);
 bool ToggleHiddenFiles();
 bool ToggleProtectedFiles();
-void RefreshAllExplorerWindows();
+int RefreshAllExplorerWindows();
 bool IsCtrlHPressed(WPARAM wParam, LPARAM lParam);
 void LoadSettings();
+WindowContext GetWindowContext(HWND hWnd);
 WindowContext GetCurrentWindowContext();
+void CALLBACK ForegroundEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+    LONG idObject, LONG idChild, DWORD idEventThread, DWORD dwmsEventTime);
 DWORD GetHiddenFilesSetting();
 bool SetHiddenFilesSetting(DWORD dwValue);
 DWORD GetProtectedFilesSetting();
 bool SetProtectedFilesSetting(DWORD dwValue);
+bool StartAdvancedWatcher();
+void StopAdvancedWatcher();
 
-// Get current window context based on focused window
-WindowContext GetCurrentWindowContext() {
-    HWND hForeground = GetForegroundWindow();
+// Get the window context of a foreground window
+WindowContext GetWindowContext(HWND hForeground) {
     if (!hForeground) {
         return CONTEXT_UNKNOWN;
     }
@@ -123,62 +194,124 @@ WindowContext GetCurrentWindowContext() {
     return CONTEXT_UNKNOWN;
 }
 
-// Get current hidden files setting from registry
-DWORD GetHiddenFilesSetting() {
-    HKEY hKey;
-    DWORD dwValue = HIDE_HIDDEN; // Default to hidden
+// Get current window context based on focused window
+WindowContext GetCurrentWindowContext() {
+    return GetWindowContext(GetForegroundWindow());
+}
+
+// Update the cached context when the foreground window changes
+void CALLBACK ForegroundEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+    LONG idObject, LONG idChild, DWORD idEventThread, DWORD dwmsEventTime) {
+    g_foregroundContext.store(GetWindowContext(hWnd), std::memory_order_relaxed);
+}
+
+// Read a DWORD value from the open Explorer\Advanced key
+DWORD ReadAdvancedValue(const wchar_t* valueName, DWORD dwDefault) {
+    DWORD dwValue = dwDefault;
     DWORD dwSize = sizeof(DWORD);
+    if (RegQueryValueExW(g_hAdvancedKey, valueName, nullptr, nullptr, (LPBYTE)&dwValue, &dwSize) != ERROR_SUCCESS) {
+        return dwDefault;
+    }
+    return dwValue;
+}
+
+// Write a DWORD value to the open Explorer\Advanced key
+bool WriteAdvancedValue(const wchar_t* valueName, DWORD dwValue) {
+    return RegSetValueExW(g_hAdvancedKey, valueName, 0, REG_DWORD, (LPBYTE)&dwValue, sizeof(DWORD)) == ERROR_SUCCESS;
+}
+
+// Re-read the cached values
+void RefreshAdvancedSettings() {
+    g_hiddenSetting = ReadAdvancedValue(HIDDEN_FILES_VALUE, HIDE_HIDDEN); // Default to hidden
+    g_superHiddenSetting = ReadAdvancedValue(SUPER_HIDDEN_VALUE, HIDE_SUPER_HIDDEN);
+}
+
+// Ask for a single notification on the next change of the key. Thread
+// agnostic, since the thread pool thread that asked may go away.
+bool ArmAdvancedNotification() {
+    return RegNotifyChangeKeyValue(g_hAdvancedKey, FALSE,
+        REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC,
+        g_hAdvancedEvent, TRUE) == ERROR_SUCCESS;
+}
+
+// Called on the thread pool when a value under Explorer\Advanced changed,
+// by us, the Folder Options dialog or anyone else
+void CALLBACK AdvancedChangedCallback(PVOID lpParameter, BOOLEAN timerOrWaitFired) {
+    // Re-arm before reading so a change in between isn't lost
+    if (!ArmAdvancedNotification()) {
+        Wh_Log(L"Toggle Hidden Files: failed to re-arm the registry notification");
+    }
     
-    if (RegOpenKeyExW(HKEY_CURRENT_USER, EXPLORER_ADVANCED_KEY, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-        RegQueryValueExW(hKey, HIDDEN_FILES_VALUE, nullptr, nullptr, (LPBYTE)&dwValue, &dwSize);
-        RegCloseKey(hKey);
+    RefreshAdvancedSettings();
+}
+
+// Open Explorer\Advanced, read the values and watch them for changes
+bool StartAdvancedWatcher() {
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, EXPLORER_ADVANCED_KEY, 0,
+        KEY_QUERY_VALUE | KEY_SET_VALUE | KEY_NOTIFY, &g_hAdvancedKey) != ERROR_SUCCESS) {
+        g_hAdvancedKey = nullptr;
+        Wh_Log(L"Toggle Hidden Files: failed to open the Explorer\\Advanced key");
+        return false;
     }
     
-    return dwValue;
+    g_hAdvancedEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!g_hAdvancedEvent || !ArmAdvancedNotification() ||
+        !RegisterWaitForSingleObject(&g_hAdvancedWait, g_hAdvancedEvent,
+            AdvancedChangedCallback, nullptr, INFINITE, WT_EXECUTEDEFAULT)) {
+        Wh_Log(L"Toggle Hidden Files: failed to watch the Explorer\\Advanced key, error=%lu", GetLastError());
+        g_hAdvancedWait = nullptr;
+        StopAdvancedWatcher();
+        return false;
+    }
+    
+    RefreshAdvancedSettings();
+    return true;
+}
+
+// Stop watching the key, waiting for a running callback to finish, and close it
+void StopAdvancedWatcher() {
+    if (g_hAdvancedWait) {
+        UnregisterWaitEx(g_hAdvancedWait, INVALID_HANDLE_VALUE);
+        g_hAdvancedWait = nullptr;
+    }
+    if (g_hAdvancedEvent) {
+        CloseHandle(g_hAdvancedEvent);
+        g_hAdvancedEvent = nullptr;
+    }
+    if (g_hAdvancedKey) {
+        RegCloseKey(g_hAdvancedKey);
+        g_hAdvancedKey = nullptr;
+    }
+}
+
+// Get current hidden files setting (cached)
+DWORD GetHiddenFilesSetting() {
+    return g_hiddenSetting;
 }
 
 // Set hidden files setting in registry
 bool SetHiddenFilesSetting(DWORD dwValue) {
-    HKEY hKey;
-    bool success = false;
-    
-    if (RegOpenKeyExW(HKEY_CURRENT_USER, EXPLORER_ADVANCED_KEY, 0, KEY_WRITE, &hKey) == ERROR_SUCCESS) {
-        if (RegSetValueExW(hKey, HIDDEN_FILES_VALUE, 0, REG_DWORD, (LPBYTE)&dwValue, sizeof(DWORD)) == ERROR_SUCCESS) {
-            success = true;
-        }
-        RegCloseKey(hKey);
+    if (!WriteAdvancedValue(HIDDEN_FILES_VALUE, dwValue)) {
+        return false;
     }
     
-    return success;
+    g_hiddenSetting = dwValue;
+    return true;
 }
 
-// Get current protected files setting from registry
+// Get current protected files setting (cached)
 DWORD GetProtectedFilesSetting() {
-    HKEY hKey;
-    DWORD dwValue = HIDE_SUPER_HIDDEN; // Default to hidden
-    DWORD dwSize = sizeof(DWORD);
-    
-    if (RegOpenKeyExW(HKEY_CURRENT_USER, EXPLORER_ADVANCED_KEY, 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-        RegQueryValueExW(hKey, SUPER_HIDDEN_VALUE, nullptr, nullptr, (LPBYTE)&dwValue, &dwSize);
-        RegCloseKey(hKey);
-    }
-    
-    return dwValue;
+    return g_superHiddenSetting;
 }
 
 // Set protected files setting in registry
 bool SetProtectedFilesSetting(DWORD dwValue) {
-    HKEY hKey;
-    bool success = false;
-    
-    if (RegOpenKeyExW(HKEY_CURRENT_USER, EXPLORER_ADVANCED_KEY, 0, KEY_WRITE, &hKey) == ERROR_SUCCESS) {
-        if (RegSetValueExW(hKey, SUPER_HIDDEN_VALUE, 0, REG_DWORD, (LPBYTE)&dwValue, sizeof(DWORD)) == ERROR_SUCCESS) {
-            success = true;
-        }
-        RegCloseKey(hKey);
+    if (!WriteAdvancedValue(SUPER_HIDDEN_VALUE, dwValue)) {
+        return false;
     }
     
-    return success;
+    g_superHiddenSetting = dwValue;
+    return true;
 }
 
 // Toggle hidden files setting
@@ -203,28 +336,109 @@ void LoadSettings() {
     g_settings.toggleProtectedFiles = true;
 }
 
-// Refresh all Explorer windows
-void RefreshAllExplorerWindows() {
-    // Send a message to all windows to refresh their view
-    SendNotifyMessageW(HWND_BROADCAST, WM_SETTINGCHANGE, 0, (LPARAM)L"ShellState");
+// Refresh the view of a shell browser (an Explorer window or the desktop),
+// after letting its window reload the shell settings
+bool RefreshShellBrowser(IDispatch* pDispatch) {
+    IServiceProvider* pServiceProvider = nullptr;
+    if (FAILED(pDispatch->QueryInterface(IID_PPV_ARGS(&pServiceProvider)))) {
+        return false;
+    }
     
-    // Also try to refresh specifically Explorer windows
+    IShellBrowser* pShellBrowser = nullptr;
+    HRESULT hr = pServiceProvider->QueryService(SID_STopLevelBrowser, IID_PPV_ARGS(&pShellBrowser));
+    pServiceProvider->Release();
+    if (FAILED(hr)) {
+        return false;
+    }
+    
+    // Only this window is told about the new settings, nothing is broadcast
     HWND hWnd = nullptr;
-    while ((hWnd = FindWindowExW(nullptr, hWnd, L"CabinetWClass", nullptr)) != nullptr) {
-        SendNotifyMessageW(hWnd, WM_COMMAND, 41504, 0); // Refresh command
+    if (SUCCEEDED(pShellBrowser->GetWindow(&hWnd)) && hWnd) {
+        SendNotifyMessageW(hWnd, WM_SETTINGCHANGE, 0, (LPARAM)L"ShellState");
     }
     
-    // Also check ExploreWClass windows
-    hWnd = nullptr;
-    while ((hWnd = FindWindowExW(nullptr, hWnd, L"ExploreWClass", nullptr)) != nullptr) {
-        SendNotifyMessageW(hWnd, WM_COMMAND, 41504, 0);
+    IShellView* pShellView = nullptr;
+    hr = pShellBrowser->QueryActiveShellView(&pShellView);
+    pShellBrowser->Release();
+    if (FAILED(hr)) {
+        return false;
+    }
+    
+    hr = pShellView->Refresh();
+    pShellView->Release();
+    return SUCCEEDED(hr);
+}
+
+// Refresh the Explorer windows the old way, by their window class, if the
+// shell window list isn't available
+int RefreshExplorerWindowsByClass() {
+    int refreshed = 0;
+    const wchar_t* classNames[] = { L"CabinetWClass", L"ExploreWClass" };
+    for (const wchar_t* className : classNames) {
+        HWND hWnd = nullptr;
+        while ((hWnd = FindWindowExW(nullptr, hWnd, className, nullptr)) != nullptr) {
+            SendNotifyMessageW(hWnd, WM_SETTINGCHANGE, 0, (LPARAM)L"ShellState");
+            SendNotifyMessageW(hWnd, WM_COMMAND, 41504, 0); // Refresh command
+            refreshed++;
+        }
     }
     
-    // Refresh desktop as well
     HWND hDesktop = GetShellWindow();
     if (hDesktop) {
+        SendNotifyMessageW(hDesktop, WM_SETTINGCHANGE, 0, (LPARAM)L"ShellState");
         SendNotifyMessageW(hDesktop, WM_COMMAND, 41504, 0);
+        refreshed++;
     }
+    return refreshed;
+}
+
+// Refresh all Explorer windows and the desktop. Their views are found through
+// the shell window list, so no window of another process is ever touched.
+// Returns how many views were refreshed.
+int RefreshAllExplorerWindows() {
+    HRESULT hrInit = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    
+    IShellWindows* pShellWindows = nullptr;
+    if (FAILED(CoCreateInstance(CLSID_ShellWindows, nullptr, CLSCTX_ALL, IID_PPV_ARGS(&pShellWindows)))) {
+        if (SUCCEEDED(hrInit)) {
+            CoUninitialize();
+        }
+        return RefreshExplorerWindowsByClass();
+    }
+    
+    int refreshed = 0;
+    long count = 0;
+    if (SUCCEEDED(pShellWindows->get_Count(&count))) {
+        for (long i = 0; i < count; i++) {
+            VARIANT vtIndex{}; vtIndex.vt = VT_I4; vtIndex.lVal = i;
+            IDispatch* pDispatch = nullptr;
+            if (pShellWindows->Item(vtIndex, &pDispatch) == S_OK && pDispatch) {
+                if (RefreshShellBrowser(pDispatch)) {
+                    refreshed++;
+                }
+                pDispatch->Release();
+            }
+        }
+    }
+    
+    // The desktop isn't in the list, it is looked up by location
+    VARIANT vtLoc{}; vtLoc.vt = VT_I4; vtLoc.lVal = CSIDL_DESKTOP;
+    VARIANT vtEmpty{}; vtEmpty.vt = VT_EMPTY;
+    long lhwnd = 0;
+    IDispatch* pDesktop = nullptr;
+    if (pShellWindows->FindWindowSW(&vtLoc, &vtEmpty, SWC_DESKTOP, &lhwnd, SWFO_NEEDDISPATCH, &pDesktop) == S_OK &&
+        pDesktop) {
+        if (RefreshShellBrowser(pDesktop)) {
+            refreshed++;
+        }
+        pDesktop->Release();
+    }
+    
+    pShellWindows->Release();
+    if (SUCCEEDED(hrInit)) {
+        CoUninitialize();
+    }
+    return refreshed;
 }
 
 // Check if Ctrl+H is pressed
@@ -244,23 +458,60 @@ bool IsCtrlHPressed(WPARAM wParam, LPARAM lParam) {
     return (GetAsyncKeyState(VK_CONTROL) & 0x8000) != 0;
 }
 
-// Keyboard hook procedure
-LRESULT CALLBACK KeyboardHookProc(int nCode, WPARAM wParam, LPARAM lParam) {
-    if (nCode >= 0 && g_modEnabled) {
-        WindowContext context = GetCurrentWindowContext();
+// Toggle the settings and refresh Explorer, on a thread pool thread so the
+// keyboard hook returns right away
+void CALLBACK ToggleCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    // Toggle hidden files
+    bool success = ToggleHiddenFiles();
+    
+    // Also toggle protected files if setting is enabled
+    if (g_settings.toggleProtectedFiles) {
+        success = ToggleProtectedFiles() && success;
+    }
+    
+    if (success) {
+        int refreshed = RefreshAllExplorerWindows();
         
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+        Wh_Log(L"Toggle Hidden Files: %d views refreshed %lld us after Ctrl+H", refreshed,
+            (now.QuadPart - g_toggleStartTime.load()) * 1000000 / frequency.QuadPart);
+    }
+    
+    g_toggleRunning = false;
+}
+
+// Ask the hook thread to reinstall the keyboard hook, once per incident
+void RequestHookReinstall() {
+    if (!g_reinstallPosted.exchange(true)) {
+        PostThreadMessageW(g_hookThreadId, HOOK_THREAD_REINSTALL, 0, 0);
+    }
+}
+
+// Keyboard hook procedure. It sees every keystroke in the session, so the key
+// and the cached foreground context are checked before anything that calls
+// into the system.
+LRESULT CALLBACK KeyboardHookProc(int nCode, WPARAM wParam, LPARAM lParam) {
+    DWORD now = GetTickCount();
+    g_lastHookCallTick.store(now, std::memory_order_relaxed);
+    
+    // A keystroke that reached us this late got close to costing the hook
+    if (nCode == HC_ACTION && now - ((KBDLLHOOKSTRUCT*)lParam)->time > HOOK_STALL_THRESHOLD_MS) {
+        g_hookStalls.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    if (nCode == HC_ACTION && wParam == WM_KEYDOWN &&
+        ((KBDLLHOOKSTRUCT*)lParam)->vkCode == 'H' && g_modEnabled &&
+        g_foregroundContext.load(std::memory_order_relaxed) == CONTEXT_EXPLORER) {
         // Only process if we're in Explorer windows
-        if (context == CONTEXT_EXPLORER && IsCtrlHPressed(wParam, lParam)) {
-            // Toggle hidden files
-            bool success = ToggleHiddenFiles();
-            
-            // Also toggle protected files if setting is enabled
-            if (g_settings.toggleProtectedFiles) {
-                success = ToggleProtectedFiles() && success;
-            }
-            
-            if (success) {
-                RefreshAllExplorerWindows();
+        if (IsCtrlHPressed(wParam, lParam)) {
+            // Key repeat doesn't start a second toggle while one is running
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            g_toggleStartTime = now.QuadPart;
+            if (!g_toggleRunning.exchange(true)) {
+                SubmitThreadpoolWork(g_toggleWork);
             }
             
             // Consume the key press
@@ -271,18 +522,232 @@ LRESULT CALLBACK KeyboardHookProc(int nCode, WPARAM wParam, LPARAM lParam) {
     return CallNextHookEx(g_hKeyboardHook, nCode, wParam, lParam);
 }
 
+// Replace the keyboard hook with a fresh one (hook thread only). If Windows
+// already removed the old hook, unhooking it fails and it is counted as removed.
+void ReinstallKeyboardHook() {
+    g_reinstallPosted = false;
+    
+    bool removed = g_hKeyboardHook && !UnhookWindowsHookEx(g_hKeyboardHook);
+    g_hKeyboardHook = SetWindowsHookExW(WH_KEYBOARD_LL, KeyboardHookProc, GetModuleHandle(nullptr), 0);
+    g_lastHookCallTick = GetTickCount();
+    g_hookReinstalls++;
+    
+    if (removed) {
+        g_hookRemovals++;
+        Wh_Log(L"Toggle Hidden Files: keyboard hook had been removed, reinstalled "
+            L"(%lu stalls, %lu removals, %lu reinstalls)",
+            g_hookStalls.load(), g_hookRemovals.load(), g_hookReinstalls.load());
+    }
+    if (!g_hKeyboardHook) {
+        Wh_Log(L"Toggle Hidden Files: SetWindowsHookEx failed, error=%lu", GetLastError());
+    }
+}
+
+// Watchdog tick: reinstall the keyboard hook if a keystroke arrived that the
+// hook should have seen by now but didn't
+void CALLBACK WatchdogTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    DWORD lastKeyboardInput = g_lastKeyboardInputTick.load(std::memory_order_relaxed);
+    DWORD lastHookCall = g_lastHookCallTick.load(std::memory_order_relaxed);
+    if ((LONG)(lastKeyboardInput - lastHookCall) > (LONG)HOOK_STALL_THRESHOLD_MS &&
+        GetTickCount() - lastKeyboardInput > HOOK_STALL_THRESHOLD_MS) {
+        RequestHookReinstall();
+    }
+}
+
+// Record when a keystroke arrived, the hook must have been called since
+LRESULT CALLBACK RawInputWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    if (uMsg == WM_INPUT) {
+        g_lastKeyboardInputTick.store((DWORD)GetMessageTime(), std::memory_order_relaxed);
+    }
+    return DefWindowProcW(hWnd, uMsg, wParam, lParam);
+}
+
+// Module of this mod, which owns the raw input window class
+HINSTANCE GetModInstance() {
+    HMODULE hModule = nullptr;
+    GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+        (LPCWSTR)RawInputWindowProc, &hModule);
+    return hModule;
+}
+
+// Listen to raw keyboard input on the hook thread (hook thread only). Without
+// it the watchdog has no evidence and never reinstalls the hook.
+void StartRawKeyboardInput() {
+    UINT deviceCount = 0;
+    GetRegisteredRawInputDevices(nullptr, &deviceCount, sizeof(RAWINPUTDEVICE));
+    if (deviceCount) {
+        RAWINPUTDEVICE* devices = new RAWINPUTDEVICE[deviceCount];
+        bool hasKeyboard = false;
+        if (GetRegisteredRawInputDevices(devices, &deviceCount, sizeof(RAWINPUTDEVICE)) != (UINT)-1) {
+            for (UINT i = 0; i < deviceCount; i++) {
+                hasKeyboard |= devices[i].usUsagePage == 0x01 && devices[i].usUsage == 0x06;
+            }
+        }
+        delete[] devices;
+        if (hasKeyboard) {
+            Wh_Log(L"Toggle Hidden Files: Explorer receives raw keyboard input itself, "
+                L"the hook watchdog is disabled");
+            return;
+        }
+    }
+    
+    WNDCLASSW wc = {};
+    wc.lpfnWndProc = RawInputWindowProc;
+    wc.hInstance = GetModInstance();
+    wc.lpszClassName = RAW_INPUT_WINDOW_CLASS;
+    RegisterClassW(&wc);
+    g_rawInputWindow = CreateWindowExW(0, RAW_INPUT_WINDOW_CLASS, nullptr, 0, 0, 0, 0, 0,
+        HWND_MESSAGE, nullptr, wc.hInstance, nullptr);
+    
+    RAWINPUTDEVICE keyboard = { 0x01, 0x06, RIDEV_INPUTSINK, g_rawInputWindow };
+    g_rawKeyboardRegistered = g_rawInputWindow &&
+        RegisterRawInputDevices(&keyboard, 1, sizeof(keyboard));
+    if (!g_rawKeyboardRegistered) {
+        Wh_Log(L"Toggle Hidden Files: failed to listen to raw keyboard input, error=%lu, "
+            L"the hook watchdog is disabled", GetLastError());
+    }
+}
+
+// Stop listening to raw keyboard input (hook thread only)
+void StopRawKeyboardInput() {
+    if (g_rawKeyboardRegistered) {
+        RAWINPUTDEVICE keyboard = { 0x01, 0x06, RIDEV_REMOVE, nullptr };
+        RegisterRawInputDevices(&keyboard, 1, sizeof(keyboard));
+        g_rawKeyboardRegistered = false;
+    }
+    if (g_rawInputWindow) {
+        DestroyWindow(g_rawInputWindow);
+        g_rawInputWindow = nullptr;
+    }
+    UnregisterClassW(RAW_INPUT_WINDOW_CLASS, GetModInstance());
+}
+
+// Hook thread: installs the hooks and pumps messages for them
+DWORD WINAPI HookThreadProc(LPVOID) {
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+    
+    // Make sure the thread has a message queue before anyone posts to it
+    MSG msg;
+    PeekMessageW(&msg, nullptr, WM_USER, WM_USER, PM_NOREMOVE);
+    
+    // Install keyboard hook
+    g_hKeyboardHook = SetWindowsHookExW(WH_KEYBOARD_LL, KeyboardHookProc, GetModuleHandle(nullptr), 0);
+    g_lastHookCallTick = GetTickCount();
+    
+    // Track the foreground window, Explorer windows live in this process
+    g_foregroundContext = GetCurrentWindowContext();
+    g_hForegroundHook = SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND, nullptr,
+        ForegroundEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+    
+    StartRawKeyboardInput();
+    
+    SetEvent(g_hookStartEvent);
+    if (!g_hKeyboardHook || !g_hForegroundHook) {
+        Wh_Log(L"Toggle Hidden Files: failed to install the hooks, error=%lu", GetLastError());
+    } else {
+        while (GetMessageW(&msg, nullptr, 0, 0) > 0) {
+            if (!msg.hwnd && msg.message == HOOK_THREAD_REINSTALL) {
+                ReinstallKeyboardHook();
+                continue;
+            }
+            TranslateMessage(&msg);
+            DispatchMessageW(&msg);
+        }
+    }
+    
+    if (g_hKeyboardHook) {
+        UnhookWindowsHookEx(g_hKeyboardHook);
+        g_hKeyboardHook = nullptr;
+    }
+    if (g_hForegroundHook) {
+        UnhookWinEvent(g_hForegroundHook);
+        g_hForegroundHook = nullptr;
+    }
+    StopRawKeyboardInput();
+    return 0;
+}
+
+// Stop the watchdog and the hook thread, which removes the hooks
+void StopHookThread() {
+    if (g_watchdogTimer) {
+        SetThreadpoolTimer(g_watchdogTimer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(g_watchdogTimer, TRUE);
+        CloseThreadpoolTimer(g_watchdogTimer);
+        g_watchdogTimer = nullptr;
+    }
+    
+    // The thread runs mod code until it returns, so it is waited for however
+    // long that takes; it only pumps messages, so it can't be stuck for long
+    if (g_hookThread) {
+        PostThreadMessageW(g_hookThreadId, WM_QUIT, 0, 0);
+        WaitForSingleObject(g_hookThread, INFINITE);
+        CloseHandle(g_hookThread);
+        g_hookThread = nullptr;
+        g_hookThreadId = 0;
+    }
+    if (g_hookStartEvent) {
+        CloseHandle(g_hookStartEvent);
+        g_hookStartEvent = nullptr;
+    }
+}
+
+// Wait for a running toggle to return, so no thread is left in the module,
+// and free the work object. The hook thread must be stopped first.
+void StopToggleWork() {
+    if (g_toggleWork) {
+        WaitForThreadpoolWorkCallbacks(g_toggleWork, FALSE);
+        CloseThreadpoolWork(g_toggleWork);
+        g_toggleWork = nullptr;
+    }
+}
+
 // Mod initialization
 BOOL Wh_ModInit() {
     // Load settings
     LoadSettings();
     
-    // Install keyboard hook
-    g_hKeyboardHook = SetWindowsHookExW(WH_KEYBOARD_LL, KeyboardHookProc, GetModuleHandle(nullptr), 0);
+    if (!StartAdvancedWatcher()) {
+        return FALSE;
+    }
     
-    if (!g_hKeyboardHook) {
+    g_toggleWork = CreateThreadpoolWork(ToggleCallback, nullptr, nullptr);
+    if (!g_toggleWork) {
+        Wh_Log(L"Toggle Hidden Files: failed to create the toggle work, error=%lu", GetLastError());
+        StopAdvancedWatcher();
         return FALSE;
     }
     
+    // Start the hook thread and wait for the hooks
+    g_hookStartEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (g_hookStartEvent) {
+        g_hookThread = CreateThread(nullptr, 0, HookThreadProc, nullptr, 0, &g_hookThreadId);
+    }
+    if (!g_hookThread) {
+        Wh_Log(L"Toggle Hidden Files: failed to start the hook thread, error=%lu", GetLastError());
+        StopHookThread();
+        StopToggleWork();
+        StopAdvancedWatcher();
+        return FALSE;
+    }
+    
+    WaitForSingleObject(g_hookStartEvent, 3000);
+    if (!g_hKeyboardHook || !g_hForegroundHook) {
+        StopHookThread();
+        StopToggleWork();
+        StopAdvancedWatcher();
+        return FALSE;
+    }
+    
+    g_watchdogTimer = CreateThreadpoolTimer(WatchdogTimerCallback, nullptr, nullptr);
+    if (g_watchdogTimer) {
+        ULARGE_INTEGER dueTime;
+        dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)HOOK_WATCHDOG_INTERVAL_MS * 10000);
+        FILETIME ftDueTime;
+        ftDueTime.dwLowDateTime = dueTime.LowPart;
+        ftDueTime.dwHighDateTime = dueTime.HighPart;
+        SetThreadpoolTimer(g_watchdogTimer, &ftDueTime, HOOK_WATCHDOG_INTERVAL_MS, 1000);
+    }
+    
     g_modEnabled = true;
     return TRUE;
 }
@@ -296,9 +761,11 @@ void Wh_ModSettingsChanged() {
 void Wh_ModUninit() {
     g_modEnabled = false;
     
-    // Remove keyboard hook
-    if (g_hKeyboardHook) {
-        UnhookWindowsHookEx(g_hKeyboardHook);
-        g_hKeyboardHook = nullptr;
-    }
-}
\ No newline at end of file
+    StopHookThread();
+    
+    StopToggleWork();
+    StopAdvancedWatcher();
+    
+    Wh_Log(L"Toggle Hidden Files: %lu hook stalls, %lu hook removals, %lu hook reinstalls",
+        g_hookStalls.load(), g_hookRemovals.load(), g_hookReinstalls.load());
+}
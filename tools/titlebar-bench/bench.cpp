@@ -0,0 +1,492 @@
+// Linux benchmark harness for the Auto Dark Titlebar mod. The mod source is
+// compiled unchanged against the fake Win32 layer in fake/ and fake_win32.cpp,
+// and loaded into fake processes forked from the driver. See README.md.
+
+#include <windhawk_api.h>
+
+#include "../../mods/asteski-auto-dark-titlebar.wh.cpp"
+
+#include "fake_win32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_MAX_PROCESSES 240
+#define BENCH_MAX_THREADS 64
+#define BENCH_CONVERGE_TIMEOUT_NS (120 * 1000000000ULL)
+// After converging, wait for the reevaluation timers the storm armed
+#define BENCH_SETTLE_NS (3 * THEME_REEVALUATE_DELAY_MS * 1000000ULL)
+#define BENCH_HOOK_COST_WINDOWS 64
+
+struct BenchOptions {
+    UINT windows = 4000;
+    UINT processes = 16;
+    UINT threads = 4;
+    ULONGLONG dwmNs = 20000;
+    ULONGLONG setWindowPosNs = 50000;
+    UINT stormRounds = 4;
+    UINT messages = 2000000;
+    const char* hookMode = "global";
+    int frameBudget = 0;
+    BOOL verbose = FALSE;
+};
+
+enum BenchCommand {
+    BENCH_COMMAND_NONE,
+    BENCH_COMMAND_START,
+    BENCH_COMMAND_STORM,
+    BENCH_COMMAND_EXIT
+};
+
+// Written by one fake process, read by the driver
+struct BenchProcessResult {
+    std::atomic<BOOL> ready;
+    std::atomic<LONG> ackedSeq;
+    std::atomic<ULONGLONG> initNs;
+    std::atomic<ULONGLONG> stormNs;
+    std::atomic<ULONGLONG> stormMessages;
+    std::atomic<ULONG> reevaluations;
+    std::atomic<ULONGLONG> hookedMessages;
+};
+
+// Hook modes the per-message cost is measured for, none = mod not loaded
+static const char* const g_hookCostModes[] = { "none", "global", "lazy", "subclass" };
+
+struct BenchHookCost {
+    double mouseMoveNs;
+    double settingChangeNs;
+};
+
+// Commands from the driver to all fake processes
+struct BenchControl {
+    std::atomic<int> command;
+    std::atomic<LONG> seq;
+    BenchProcessResult processes[BENCH_MAX_PROCESSES];
+    BenchHookCost hookCosts[ARRAYSIZE(g_hookCostModes)];
+};
+
+static BenchControl* g_control = nullptr;
+
+// WM_SETTINGCHANGE sections of a storm: the theme ones the mod reevaluates on,
+// and the unrelated ones a theme switch broadcasts along with them
+static const PCWSTR g_stormSections[] = {
+    L"ImmersiveColorSet",
+    L"WindowsThemeElement",
+    L"Environment",
+    L"Policy",
+};
+
+static BOOL ParseOptions(int argc, char** argv, BenchOptions* options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (strcmp(arg, "--verbose") == 0) {
+            options->verbose = TRUE;
+            continue;
+        }
+        if (!value)
+            return FALSE;
+
+        if (strcmp(arg, "--windows") == 0) {
+            options->windows = (UINT)strtoul(value, nullptr, 10);
+        } else if (strcmp(arg, "--processes") == 0) {
+            options->processes = (UINT)strtoul(value, nullptr, 10);
+        } else if (strcmp(arg, "--threads") == 0) {
+            options->threads = (UINT)strtoul(value, nullptr, 10);
+        } else if (strcmp(arg, "--dwm-ns") == 0) {
+            options->dwmNs = strtoull(value, nullptr, 10);
+        } else if (strcmp(arg, "--swp-ns") == 0) {
+            options->setWindowPosNs = strtoull(value, nullptr, 10);
+        } else if (strcmp(arg, "--storm") == 0) {
+            options->stormRounds = (UINT)strtoul(value, nullptr, 10);
+        } else if (strcmp(arg, "--messages") == 0) {
+            options->messages = (UINT)strtoul(value, nullptr, 10);
+        } else if (strcmp(arg, "--hook-mode") == 0) {
+            options->hookMode = value;
+        } else if (strcmp(arg, "--frame-budget") == 0) {
+            options->frameBudget = atoi(value);
+        } else {
+            return FALSE;
+        }
+        i++;
+    }
+
+    return options->processes >= 1 && options->processes <= BENCH_MAX_PROCESSES &&
+        options->threads >= 1 && options->threads <= BENCH_MAX_THREADS &&
+        options->windows >= options->processes;
+}
+
+static VOID PrintUsage() {
+    fprintf(stderr,
+        "usage: titlebar-bench [--windows N] [--processes N] [--threads N]\n"
+        "                      [--dwm-ns NS] [--swp-ns NS] [--storm ROUNDS]\n"
+        "                      [--messages N]\n"
+        "                      [--hook-mode global|lazy|subclass] [--frame-budget N]\n"
+        "                      [--verbose]\n");
+}
+
+// Top-level windows of a fake process, spread over its UI threads: mostly
+// captioned application windows, some minimized or hidden, and the tool
+// windows and tooltips every application has
+static VOID CreateProcessWindows(UINT count, UINT threads, std::vector<HWND>* windows) {
+    for (UINT i = 0; i < count; i++) {
+        FakeSetCurrentThread(FakeUiThreadId(i % threads));
+        DWORD style = WS_OVERLAPPEDWINDOW | WS_VISIBLE;
+        DWORD exStyle = 0;
+        PCWSTR className = L"BenchApplicationWindow";
+        switch (i % 10) {
+        case 6:
+            style |= WS_MINIMIZE;
+            break;
+        case 7:
+            style &= ~WS_VISIBLE;
+            break;
+        case 8:
+            style = WS_POPUP | WS_CAPTION | WS_VISIBLE;
+            exStyle = WS_EX_TOOLWINDOW;
+            className = L"BenchToolWindow";
+            break;
+        case 9:
+            style = WS_POPUP;
+            className = L"tooltips_class32";
+            break;
+        }
+        HWND hWnd = CreateWindowExW(exStyle, className, L"", style, 0, 0, 800, 600,
+            nullptr, nullptr, nullptr, nullptr);
+        if (hWnd) {
+            windows->push_back(hWnd);
+        }
+    }
+    FakeSetCurrentThread(FakeUiThreadId(0));
+}
+
+// Broadcast WM_SETTINGCHANGE to every window of the process, rounds times
+static VOID RunStorm(const std::vector<HWND>& windows, UINT rounds, BenchProcessResult* result) {
+    ULONGLONG messages = 0;
+    ULONGLONG start = FakeNowNs();
+    for (UINT round = 0; round < rounds; round++) {
+        PCWSTR section = g_stormSections[round % ARRAYSIZE(g_stormSections)];
+        for (HWND hWnd : windows) {
+            SendMessageW(hWnd, WM_SETTINGCHANGE, 0, (LPARAM)section);
+            messages++;
+        }
+    }
+    result->stormNs = FakeNowNs() - start;
+    result->stormMessages = messages;
+}
+
+// Body of a forked fake process: create its windows, load the mod when told
+// to, then run its threads until the driver ends it
+static VOID RunFakeProcess(UINT index, UINT windowCount, const BenchOptions& options) {
+    BenchProcessResult* result = &g_control->processes[index];
+    FakeStartProcess(index);
+
+    std::vector<HWND> windows;
+    CreateProcessWindows(windowCount, options.threads, &windows);
+    if (index == 0 && !windows.empty()) {
+        FakeSetForegroundWindow(windows[0]);
+    }
+    result->ready = TRUE;
+
+    LONG seq = 0;
+    BOOL loaded = FALSE;
+    for (;;) {
+        LONG currentSeq = g_control->seq.load(std::memory_order_acquire);
+        if (currentSeq != seq) {
+            seq = currentSeq;
+            int command = g_control->command.load(std::memory_order_relaxed);
+            if (command == BENCH_COMMAND_EXIT)
+                break;
+
+            if (command == BENCH_COMMAND_START) {
+                ULONGLONG start = FakeNowNs();
+                Wh_ModInit();
+                FakeApplyModHooks();
+                Wh_ModAfterInit();
+                result->initNs = FakeNowNs() - start;
+                loaded = TRUE;
+            } else if (command == BENCH_COMMAND_STORM) {
+                RunStorm(windows, options.stormRounds, result);
+            }
+            result->ackedSeq.store(seq, std::memory_order_release);
+        }
+
+        BOOL ran = FakeRunPending();
+        if (loaded) {
+            result->reevaluations = FakeTimerCallbackCount(g_reevaluateTimer);
+            result->hookedMessages = g_stats->hookedMessages.load(std::memory_order_relaxed);
+        }
+        if (!ran) {
+            FakeIdle(200000);
+        }
+    }
+
+    if (loaded) {
+        Wh_ModBeforeUninit();
+        Wh_ModUninit();
+        FakeRunPending();
+    }
+    FakeExitProcess();
+    result->ackedSeq.store(seq, std::memory_order_release);
+    _exit(0);
+}
+
+// Dispatch count messages round robin to the windows, returns ns per message
+static double TimeDispatch(const std::vector<HWND>& windows, UINT message, LPARAM lParam, UINT count) {
+    MSG msg = { nullptr, message, 0, lParam, 0, {} };
+    ULONGLONG start = FakeNowNs();
+    for (UINT i = 0; i < count; i++) {
+        msg.hwnd = windows[i % windows.size()];
+        DispatchMessageW(&msg);
+    }
+    return count ? (double)(FakeNowNs() - start) / count : 0.0;
+}
+
+// Body of the fake process measuring one hook mode: the messages the hooks
+// let through, dispatched on one thread to the usual window mix
+static VOID RunHookCostProcess(UINT mode, UINT messages) {
+    FakeStartProcess(0);
+    std::wstring hookMode(g_hookCostModes[mode], g_hookCostModes[mode] + strlen(g_hookCostModes[mode]));
+    FakeSetSetting(L"hookMode", hookMode.c_str());
+
+    std::vector<HWND> windows;
+    CreateProcessWindows(BENCH_HOOK_COST_WINDOWS, 1, &windows);
+    BOOL loaded = mode != 0;
+    if (loaded) {
+        Wh_ModInit();
+        FakeApplyModHooks();
+        Wh_ModAfterInit();
+    }
+    while (FakeRunPending()) {
+    }
+
+    TimeDispatch(windows, WM_MOUSEMOVE, 0, messages / 10);
+    BenchHookCost* cost = &g_control->hookCosts[mode];
+    cost->mouseMoveNs = TimeDispatch(windows, WM_MOUSEMOVE, 0, messages);
+    cost->settingChangeNs = TimeDispatch(windows, WM_SETTINGCHANGE, (LPARAM)L"Environment", messages);
+
+    if (loaded) {
+        Wh_ModBeforeUninit();
+        Wh_ModUninit();
+        FakeRunPending();
+    }
+    FakeExitProcess();
+    _exit(0);
+}
+
+// Per-message cost of each hook mode, measured against the mod not loaded.
+// Each mode runs alone in a session of its own.
+static BOOL RunHookCost(const BenchOptions& options) {
+    printf("per-message cost, %u windows on one thread, %u messages each\n",
+        BENCH_HOOK_COST_WINDOWS, options.messages);
+    printf("%-10s %14s %22s\n", "hook mode", "WM_MOUSEMOVE", "WM_SETTINGCHANGE");
+    for (UINT mode = 0; mode < ARRAYSIZE(g_hookCostModes); mode++) {
+        FakeCosts costs = {};
+        FakeInitSession(BENCH_HOOK_COST_WINDOWS, costs);
+        FakeSetSystemDarkMode(TRUE);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return FALSE;
+        }
+        if (pid == 0) {
+            RunHookCostProcess(mode, options.messages);
+        }
+        waitpid(pid, nullptr, 0);
+
+        const BenchHookCost& cost = g_control->hookCosts[mode];
+        const BenchHookCost& baseline = g_control->hookCosts[0];
+        printf("%-10s %8.1f ns", g_hookCostModes[mode], cost.mouseMoveNs);
+        if (mode) {
+            printf(" %+5.1f", cost.mouseMoveNs - baseline.mouseMoveNs);
+        } else {
+            printf("      ");
+        }
+        printf(" %10.1f ns", cost.settingChangeNs);
+        if (mode) {
+            printf(" %+5.1f", cost.settingChangeNs - baseline.settingChangeNs);
+        }
+        printf("\n");
+    }
+    printf("\n");
+    return TRUE;
+}
+
+static VOID SleepNs(ULONGLONG ns) {
+    timespec duration = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+    nanosleep(&duration, nullptr);
+}
+
+// Send a command and wait until every fake process has carried it out
+static VOID RunCommand(BenchCommand command, UINT processes) {
+    g_control->command.store(command, std::memory_order_relaxed);
+    LONG seq = g_control->seq.fetch_add(1, std::memory_order_release) + 1;
+    for (UINT i = 0; i < processes; i++) {
+        while (g_control->processes[i].ackedSeq.load(std::memory_order_acquire) != seq) {
+            SleepNs(100000);
+        }
+    }
+}
+
+// Wait until every eligible window has the theme, returns the time from start
+// to the last window themed
+static ULONGLONG WaitConverged(BOOL dark, ULONGLONG start) {
+    ULONGLONG lastSetNs;
+    ULONG pending;
+    while (!FakeSessionConverged(dark, &lastSetNs, &pending)) {
+        if (FakeNowNs() - start > BENCH_CONVERGE_TIMEOUT_NS) {
+            printf("  did not converge, %lu windows pending\n", (unsigned long)pending);
+            return 0;
+        }
+        SleepNs(200000);
+    }
+    return lastSetNs > start ? lastSetNs - start : 0;
+}
+
+struct BenchTotals {
+    ULONGLONG dwmSetAttributeCalls;
+    ULONGLONG setWindowPosCalls;
+    ULONGLONG registryReads;
+    ULONGLONG hookedMessages;
+    ULONGLONG reevaluations;
+};
+
+static VOID SumTotals(UINT processes, BenchTotals* totals) {
+    *totals = {};
+    for (UINT i = 0; i < processes; i++) {
+        FakeProcessCounters counters;
+        FakeGetProcessCounters(i, &counters);
+        totals->dwmSetAttributeCalls += counters.dwmSetAttributeCalls;
+        totals->setWindowPosCalls += counters.setWindowPosCalls;
+        totals->registryReads += counters.registryReads;
+        totals->hookedMessages += g_control->processes[i].hookedMessages.load(std::memory_order_relaxed);
+        totals->reevaluations += g_control->processes[i].reevaluations.load(std::memory_order_relaxed);
+    }
+}
+
+static VOID PrintPhase(const char* name, ULONGLONG convergeNs, const BenchTotals& before,
+    const BenchTotals& after) {
+    printf("%-16s converged in %9.1f ms   %llu DwmSetWindowAttribute, %llu SetWindowPos, "
+        "%llu registry reads\n",
+        name, convergeNs / 1e6,
+        after.dwmSetAttributeCalls - before.dwmSetAttributeCalls,
+        after.setWindowPosCalls - before.setWindowPosCalls,
+        after.registryReads - before.registryReads);
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!ParseOptions(argc, argv, &options)) {
+        PrintUsage();
+        return 2;
+    }
+
+    g_control = (BenchControl*)mmap(nullptr, sizeof(BenchControl), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_control == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    FakeSetVerbose(options.verbose);
+    FakeSetSetting(L"logLevel", options.verbose ? L"verbose" : L"off");
+    FakeSetIntSetting(L"initialFrameChangesPerSecond", options.frameBudget);
+    if (options.messages && !RunHookCost(options))
+        return 1;
+
+    FakeCosts costs = { options.dwmNs, options.setWindowPosNs };
+    FakeInitSession(options.windows + 1024, costs);
+    std::wstring hookMode(options.hookMode, options.hookMode + strlen(options.hookMode));
+    FakeSetSetting(L"hookMode", hookMode.c_str());
+    FakeSetSystemDarkMode(TRUE);
+
+    fflush(stdout);
+    std::vector<pid_t> children;
+    for (UINT i = 0; i < options.processes; i++) {
+        UINT windowCount = options.windows / options.processes +
+            (i < options.windows % options.processes ? 1 : 0);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            RunFakeProcess(i, windowCount, options);
+        }
+        children.push_back(pid);
+    }
+    for (UINT i = 0; i < options.processes; i++) {
+        while (!g_control->processes[i].ready.load(std::memory_order_acquire)) {
+            SleepNs(100000);
+        }
+    }
+
+    printf("titlebar-bench: %u windows in %u processes x %u threads, hook mode %s\n",
+        options.windows, options.processes, options.threads, options.hookMode);
+    printf("DwmSetWindowAttribute %.1f us, SetWindowPos %.1f us, initial frame budget ",
+        options.dwmNs / 1e3, options.setWindowPosNs / 1e3);
+    if (options.frameBudget > 0) {
+        printf("%d/s\n\n", options.frameBudget);
+    } else {
+        printf("unlimited\n\n");
+    }
+
+    BenchTotals before;
+    BenchTotals after;
+
+    // The mod is enabled in every process of a dark session
+    SumTotals(options.processes, &before);
+    ULONGLONG start = FakeNowNs();
+    RunCommand(BENCH_COMMAND_START, options.processes);
+    ULONGLONG convergeNs = WaitConverged(TRUE, start);
+    SleepNs(BENCH_SETTLE_NS);
+    SumTotals(options.processes, &after);
+    ULONGLONG initNs = 0;
+    for (UINT i = 0; i < options.processes; i++) {
+        initNs += g_control->processes[i].initNs.load(std::memory_order_relaxed);
+    }
+    PrintPhase("initial pass", convergeNs, before, after);
+    printf("%-16s %.2f ms per process in Wh_ModInit and Wh_ModAfterInit\n", "",
+        initNs / 1e6 / options.processes);
+
+    // The user switches to light mode
+    before = after;
+    start = FakeNowNs();
+    FakeSetSystemDarkMode(FALSE);
+    convergeNs = WaitConverged(FALSE, start);
+    SleepNs(BENCH_SETTLE_NS);
+    SumTotals(options.processes, &after);
+    PrintPhase("theme change", convergeNs, before, after);
+
+    // Back to dark, followed by a WM_SETTINGCHANGE storm in every process
+    before = after;
+    start = FakeNowNs();
+    FakeSetSystemDarkMode(TRUE);
+    RunCommand(BENCH_COMMAND_STORM, options.processes);
+    convergeNs = WaitConverged(TRUE, start);
+    SleepNs(BENCH_SETTLE_NS);
+    SumTotals(options.processes, &after);
+    PrintPhase("broadcast storm", convergeNs, before, after);
+
+    ULONGLONG stormNs = 0;
+    ULONGLONG stormMessages = 0;
+    for (UINT i = 0; i < options.processes; i++) {
+        stormNs += g_control->processes[i].stormNs.load(std::memory_order_relaxed);
+        stormMessages += g_control->processes[i].stormMessages.load(std::memory_order_relaxed);
+    }
+    printf("%-16s %llu messages at %.0f ns each (%.2f M/s), %llu hooked, %llu reevaluations\n", "",
+        stormMessages, stormMessages ? (double)stormNs / stormMessages : 0.0,
+        stormNs ? stormMessages * 1e3 / stormNs : 0.0,
+        after.hookedMessages - before.hookedMessages, after.reevaluations - before.reevaluations);
+
+    RunCommand(BENCH_COMMAND_EXIT, options.processes);
+    for (pid_t pid : children) {
+        waitpid(pid, nullptr, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+// Fake dwmapi.h, the functions are declared in windows.h
+#pragma once
+#include <windows.h>
+
+#define DWMWA_CLOAKED 14
+#define DWMWA_USE_IMMERSIVE_DARK_MODE 20
+#define DWMWA_SYSTEMBACKDROP_TYPE 38
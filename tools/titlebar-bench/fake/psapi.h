@@ -0,0 +1,3 @@
+// Fake psapi.h, everything the mod uses is declared in windows.h
+#pragma once
+#include <windows.h>
@@ -0,0 +1,3 @@
+// Fake sddl.h, everything the mod uses is declared in windows.h
+#pragma once
+#include <windows.h>
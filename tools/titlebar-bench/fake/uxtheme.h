@@ -0,0 +1,5 @@
+// Fake uxtheme.h
+#pragma once
+#include <windows.h>
+
+extern "C" HRESULT WINAPI SetWindowTheme(HWND hwnd, LPCWSTR pszSubAppName, LPCWSTR pszSubIdList);
@@ -0,0 +1,16 @@
+// Fake Windhawk mod API, included by bench.cpp before the mod source. Settings
+// come from the benchmark's command line, hooks replace the fake user32 entry
+// points in fake_win32.cpp.
+#pragma once
+
+#include <windows.h>
+
+#define WH_API
+
+void Wh_Log(const wchar_t* format, ...);
+BOOL Wh_SetFunctionHook(void* targetFunction, void* hookFunction, void** originalFunction);
+BOOL Wh_RemoveFunctionHook(void* targetFunction);
+void Wh_ApplyHookOperations();
+int Wh_GetIntSetting(const wchar_t* valueName, ...);
+const wchar_t* Wh_GetStringSetting(const wchar_t* valueName, ...);
+void Wh_FreeStringSetting(const wchar_t* string);
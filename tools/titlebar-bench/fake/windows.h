@@ -0,0 +1,380 @@
+// Fake Win32 layer for building the titlebar mod on Linux. Only the types,
+// constants and functions the mod uses are declared, with their Windows
+// signatures; fake_win32.cpp implements them on top of a simulated window
+// manager. Nothing here is meant to behave like Windows beyond what the
+// benchmark needs.
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#define WINAPI
+#define CALLBACK
+#define NTAPI
+
+// Basic types, sized as on 64-bit Windows (LONG and DWORD are 32 bits)
+typedef int BOOL;
+typedef unsigned char BOOLEAN;
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned int DWORD;
+typedef unsigned int UINT;
+typedef int LONG;
+typedef unsigned int ULONG;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef uintptr_t UINT_PTR;
+typedef uintptr_t DWORD_PTR;
+typedef size_t SIZE_T;
+typedef UINT_PTR WPARAM;
+typedef LONG_PTR LPARAM;
+typedef LONG_PTR LRESULT;
+typedef LONG HRESULT;
+typedef LONG LSTATUS;
+typedef WORD ATOM;
+typedef DWORD COLORREF;
+typedef DWORD REGSAM;
+typedef wchar_t WCHAR;
+typedef char CHAR;
+typedef void VOID;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef BYTE* LPBYTE;
+typedef DWORD* LPDWORD;
+typedef DWORD* PDWORD;
+typedef DWORD_PTR* PDWORD_PTR;
+typedef const wchar_t* LPCWSTR;
+typedef const wchar_t* PCWSTR;
+typedef wchar_t* LPWSTR;
+typedef wchar_t* PWSTR;
+typedef const char* LPCSTR;
+typedef char* LPSTR;
+
+// Handles
+typedef void* HANDLE;
+typedef HANDLE* PHANDLE;
+typedef struct HWND__* HWND;
+typedef struct HINSTANCE__* HINSTANCE;
+typedef HINSTANCE HMODULE;
+typedef struct HMENU__* HMENU;
+typedef struct HKEY__* HKEY;
+typedef HKEY* PHKEY;
+typedef struct HHOOK__* HHOOK;
+typedef struct HWINEVENTHOOK__* HWINEVENTHOOK;
+typedef struct HICON__* HICON;
+typedef HICON HCURSOR;
+typedef struct HBRUSH__* HBRUSH;
+typedef void* PSECURITY_DESCRIPTOR;
+typedef void* PSID;
+
+typedef struct { LONG x, y; } POINT;
+typedef struct { HWND hwnd; UINT message; WPARAM wParam; LPARAM lParam; DWORD time; POINT pt; } MSG, *LPMSG;
+typedef union { struct { DWORD LowPart; LONG HighPart; }; LONGLONG QuadPart; } LARGE_INTEGER;
+typedef union { struct { DWORD LowPart; DWORD HighPart; }; ULONGLONG QuadPart; } ULARGE_INTEGER;
+typedef struct { DWORD dwLowDateTime, dwHighDateTime; } FILETIME, *PFILETIME;
+typedef struct {
+    LPVOID lpCreateParams; HINSTANCE hInstance; HMENU hMenu; HWND hwndParent;
+    int cy, cx, y, x; LONG style; LPCWSTR lpszName; LPCWSTR lpszClass; DWORD dwExStyle;
+} CREATESTRUCTW;
+typedef struct { LPARAM lParam; WPARAM wParam; UINT message; HWND hwnd; } CWPSTRUCT;
+typedef struct { DWORD nLength; LPVOID lpSecurityDescriptor; BOOL bInheritHandle; } SECURITY_ATTRIBUTES;
+typedef struct { PVOID Ptr; } SRWLOCK, *PSRWLOCK;
+typedef struct { PVOID Ptr; } INIT_ONCE, *PINIT_ONCE;
+typedef struct { PSID Sid; DWORD Attributes; } SID_AND_ATTRIBUTES;
+typedef struct { SID_AND_ATTRIBUTES User; } TOKEN_USER;
+typedef struct { DWORD TokenIsElevated; } TOKEN_ELEVATION;
+
+typedef LRESULT (CALLBACK* WNDPROC)(HWND, UINT, WPARAM, LPARAM);
+typedef LRESULT (CALLBACK* HOOKPROC)(int, WPARAM, LPARAM);
+typedef BOOL (CALLBACK* WNDENUMPROC)(HWND, LPARAM);
+typedef struct {
+    UINT cbSize; UINT style; WNDPROC lpfnWndProc; int cbClsExtra; int cbWndExtra; HINSTANCE hInstance;
+    HICON hIcon; HCURSOR hCursor; HBRUSH hbrBackground; LPCWSTR lpszMenuName; LPCWSTR lpszClassName;
+    HICON hIconSm;
+} WNDCLASSEXW;
+typedef struct {
+    UINT cbSize; UINT style; WNDPROC lpfnWndProc; int cbClsExtra; int cbWndExtra; HINSTANCE hInstance;
+    HICON hIcon; HCURSOR hCursor; HBRUSH hbrBackground; LPCSTR lpszMenuName; LPCSTR lpszClassName;
+    HICON hIconSm;
+} WNDCLASSEXA;
+typedef VOID (CALLBACK* WAITORTIMERCALLBACK)(PVOID, BOOLEAN);
+typedef VOID (CALLBACK* WINEVENTPROC)(HWINEVENTHOOK, DWORD, HWND, LONG, LONG, DWORD, DWORD);
+typedef DWORD (WINAPI* LPTHREAD_START_ROUTINE)(LPVOID);
+typedef BOOL (CALLBACK* PINIT_ONCE_FN)(PINIT_ONCE, PVOID, PVOID*);
+typedef intptr_t (WINAPI* FARPROC)();
+
+// Thread pool
+typedef struct TP_TIMER_* PTP_TIMER;
+typedef struct TP_CALLBACK_INSTANCE_* PTP_CALLBACK_INSTANCE;
+typedef struct TP_CALLBACK_ENVIRON_* PTP_CALLBACK_ENVIRON;
+typedef VOID (CALLBACK* PTP_TIMER_CALLBACK)(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER);
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+#define SRWLOCK_INIT {0}
+#define INIT_ONCE_STATIC_INIT {0}
+
+#define S_OK ((HRESULT)0)
+#define E_FAIL ((HRESULT)0x80004005)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define ERROR_SUCCESS 0L
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_ACCESS_DENIED 5L
+#define ERROR_INVALID_HANDLE 6L
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define MAKEINTRESOURCEA(i) ((LPSTR)((ULONG_PTR)((WORD)(i))))
+#define RGB(r, g, b) ((COLORREF)(((BYTE)(r) | ((WORD)((BYTE)(g)) << 8)) | (((DWORD)(BYTE)(b)) << 16)))
+#define GetRValue(rgb) ((BYTE)(rgb))
+#define GetGValue(rgb) ((BYTE)(((WORD)(rgb)) >> 8))
+#define GetBValue(rgb) ((BYTE)((rgb) >> 16))
+
+// Registry
+#define HKEY_CURRENT_USER ((HKEY)(ULONG_PTR)((LONG)0x80000001))
+#define KEY_QUERY_VALUE 0x0001
+#define KEY_SET_VALUE 0x0002
+#define KEY_NOTIFY 0x0010
+#define KEY_READ 0x20019
+#define REG_DWORD 4
+#define REG_NOTIFY_CHANGE_LAST_SET 0x00000004L
+#define REG_NOTIFY_THREAD_AGNOSTIC 0x10000000L
+
+// Messages
+#define WM_NULL 0x0000
+#define WM_CREATE 0x0001
+#define WM_DESTROY 0x0002
+#define WM_SIZE 0x0005
+#define WM_SHOWWINDOW 0x0018
+#define WM_SETTINGCHANGE 0x001A
+#define WM_WINDOWPOSCHANGED 0x0047
+#define WM_NCCREATE 0x0081
+#define WM_NCDESTROY 0x0082
+#define WM_NCHITTEST 0x0084
+#define WM_NCPAINT 0x0085
+#define WM_KEYDOWN 0x0100
+#define WM_TIMER 0x0113
+#define WM_MOUSEMOVE 0x0200
+#define WM_THEMECHANGED 0x031A
+#define WM_DWMCOLORIZATIONCOLORCHANGED 0x0320
+#define WM_USER 0x0400
+#define WM_APP 0x8000
+#define WM_QUIT 0x0012
+#define PM_NOREMOVE 0x0000
+#define PM_REMOVE 0x0001
+
+// Window styles and queries
+#define WS_CHILD 0x40000000L
+#define WS_VISIBLE 0x10000000L
+#define WS_MINIMIZE 0x20000000L
+#define WS_CAPTION 0x00C00000L
+#define WS_SYSMENU 0x00080000L
+#define WS_THICKFRAME 0x00040000L
+#define WS_POPUP 0x80000000L
+#define WS_OVERLAPPEDWINDOW 0x00CF0000L
+#define WS_EX_TOOLWINDOW 0x00000080L
+#define WS_EX_NOACTIVATE 0x08000000L
+#define WS_EX_LAYERED 0x00080000L
+#define GWL_STYLE (-16)
+#define GWL_EXSTYLE (-20)
+#define GCW_ATOM (-32)
+#define GA_PARENT 1
+#define GA_ROOT 2
+#define GA_ROOTOWNER 3
+#define GW_HWNDFIRST 0
+#define GW_HWNDNEXT 2
+#define GW_OWNER 4
+#define HWND_MESSAGE ((HWND)(LONG_PTR)-3)
+#define SWP_NOSIZE 0x0001
+#define SWP_NOMOVE 0x0002
+#define SWP_NOZORDER 0x0004
+#define SWP_NOACTIVATE 0x0010
+#define SWP_FRAMECHANGED 0x0020
+#define SWP_NOOWNERZORDER 0x0200
+#define SWP_ASYNCWINDOWPOS 0x4000
+#define SMTO_ABORTIFHUNG 0x0002
+#define SMTO_ERRORONEXIT 0x0020
+
+// Hooks and events
+#define WH_CALLWNDPROC 4
+#define WH_KEYBOARD_LL 13
+#define HC_ACTION 0
+#define EVENT_SYSTEM_FOREGROUND 0x0003
+#define EVENT_OBJECT_CREATE 0x8000
+#define EVENT_OBJECT_DESTROY 0x8001
+#define EVENT_OBJECT_SHOW 0x8002
+#define WINEVENT_OUTOFCONTEXT 0x0000
+#define WINEVENT_SKIPOWNPROCESS 0x0002
+#define OBJID_WINDOW 0
+#define CHILDID_SELF 0
+
+// Kernel objects
+#define SYNCHRONIZE 0x00100000L
+#define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_READ 0x0004
+#define FILE_MAP_ALL_ACCESS 0xF001F
+#define WAIT_OBJECT_0 0x00000000L
+#define WAIT_TIMEOUT 0x00000102L
+#define WT_EXECUTEDEFAULT 0x00000000
+#define WT_EXECUTEONLYONCE 0x00000008
+#define THREAD_PRIORITY_HIGHEST 2
+#define TOKEN_QUERY 0x0008
+#define SDDL_REVISION_1 1
+#define SECURITY_MAX_SID_SIZE 68
+enum TOKEN_INFORMATION_CLASS { TokenUser = 1, TokenElevation = 20 };
+
+// Process memory counters (psapi)
+typedef struct {
+    DWORD cb; DWORD PageFaultCount;
+    SIZE_T PeakWorkingSetSize, WorkingSetSize, QuotaPeakPagedPoolUsage, QuotaPagedPoolUsage,
+        QuotaPeakNonPagedPoolUsage, QuotaNonPagedPoolUsage, PagefileUsage, PeakPagefileUsage, PrivateUsage;
+} PROCESS_MEMORY_COUNTERS_EX, PROCESS_MEMORY_COUNTERS;
+
+extern "C" {
+
+// user32: windows and messages
+HWND WINAPI CreateWindowExW(DWORD dwExStyle, LPCWSTR lpClassName, LPCWSTR lpWindowName, DWORD dwStyle,
+    int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu, HINSTANCE hInstance, LPVOID lpParam);
+HWND WINAPI CreateWindowExA(DWORD dwExStyle, LPCSTR lpClassName, LPCSTR lpWindowName, DWORD dwStyle,
+    int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu, HINSTANCE hInstance, LPVOID lpParam);
+LRESULT WINAPI DefWindowProcW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
+ATOM WINAPI GetClassInfoExW(HINSTANCE hInstance, LPCWSTR lpszClass, WNDCLASSEXW* lpwcx);
+ATOM WINAPI GetClassInfoExA(HINSTANCE hInstance, LPCSTR lpszClass, WNDCLASSEXA* lpwcx);
+BOOL WINAPI UnregisterClassW(LPCWSTR lpClassName, HINSTANCE hInstance);
+BOOL WINAPI UnregisterClassA(LPCSTR lpClassName, HINSTANCE hInstance);
+BOOL WINAPI IsWindow(HWND hWnd);
+BOOL WINAPI IsWindowVisible(HWND hWnd);
+BOOL WINAPI IsIconic(HWND hWnd);
+LONG WINAPI GetWindowLongW(HWND hWnd, int nIndex);
+DWORD WINAPI GetClassLongW(HWND hWnd, int nIndex);
+int WINAPI GetClassNameW(HWND hWnd, LPWSTR lpClassName, int nMaxCount);
+DWORD WINAPI GetWindowThreadProcessId(HWND hWnd, LPDWORD lpdwProcessId);
+HWND WINAPI GetAncestor(HWND hWnd, UINT gaFlags);
+HWND WINAPI GetDesktopWindow();
+HWND WINAPI GetForegroundWindow();
+HWND WINAPI GetTopWindow(HWND hWnd);
+HWND WINAPI GetWindow(HWND hWnd, UINT uCmd);
+BOOL WINAPI EnumWindows(WNDENUMPROC lpEnumFunc, LPARAM lParam);
+BOOL WINAPI EnumChildWindows(HWND hWndParent, WNDENUMPROC lpEnumFunc, LPARAM lParam);
+BOOL WINAPI SetWindowPos(HWND hWnd, HWND hWndInsertAfter, int X, int Y, int cx, int cy, UINT uFlags);
+BOOL WINAPI PostMessageW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
+LRESULT WINAPI SendMessageW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
+LRESULT WINAPI SendMessageTimeoutW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam, UINT fuFlags,
+    UINT uTimeout, PDWORD_PTR lpdwResult);
+BOOL WINAPI PostThreadMessageW(DWORD idThread, UINT Msg, WPARAM wParam, LPARAM lParam);
+BOOL WINAPI GetMessageW(LPMSG lpMsg, HWND hWnd, UINT wMsgFilterMin, UINT wMsgFilterMax);
+BOOL WINAPI PeekMessageW(LPMSG lpMsg, HWND hWnd, UINT wMsgFilterMin, UINT wMsgFilterMax, UINT wRemoveMsg);
+BOOL WINAPI TranslateMessage(const MSG* lpMsg);
+LRESULT WINAPI DispatchMessageW(const MSG* lpMsg);
+UINT WINAPI RegisterWindowMessageW(LPCWSTR lpString);
+HHOOK WINAPI SetWindowsHookExW(int idHook, HOOKPROC lpfn, HINSTANCE hmod, DWORD dwThreadId);
+BOOL WINAPI UnhookWindowsHookEx(HHOOK hhk);
+LRESULT WINAPI CallNextHookEx(HHOOK hhk, int nCode, WPARAM wParam, LPARAM lParam);
+HWINEVENTHOOK WINAPI SetWinEventHook(DWORD eventMin, DWORD eventMax, HMODULE hmodWinEventProc,
+    WINEVENTPROC pfnWinEventProc, DWORD idProcess, DWORD idThread, DWORD dwFlags);
+BOOL WINAPI UnhookWinEvent(HWINEVENTHOOK hWinEventHook);
+
+// dwmapi
+HRESULT WINAPI DwmSetWindowAttribute(HWND hwnd, DWORD dwAttribute, LPCVOID pvAttribute, DWORD cbAttribute);
+HRESULT WINAPI DwmGetWindowAttribute(HWND hwnd, DWORD dwAttribute, PVOID pvAttribute, DWORD cbAttribute);
+
+// kernel32: processes, threads, modules
+DWORD WINAPI GetCurrentProcessId();
+DWORD WINAPI GetCurrentThreadId();
+HANDLE WINAPI GetCurrentProcess();
+HANDLE WINAPI OpenProcess(DWORD dwDesiredAccess, BOOL bInheritHandle, DWORD dwProcessId);
+BOOL WINAPI GetProcessTimes(HANDLE hProcess, PFILETIME lpCreationTime, PFILETIME lpExitTime,
+    PFILETIME lpKernelTime, PFILETIME lpUserTime);
+BOOL WINAPI QueryFullProcessImageNameW(HANDLE hProcess, DWORD dwFlags, LPWSTR lpExeName, PDWORD lpdwSize);
+HANDLE WINAPI CreateThread(SECURITY_ATTRIBUTES* lpThreadAttributes, SIZE_T dwStackSize,
+    LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter, DWORD dwCreationFlags, LPDWORD lpThreadId);
+HMODULE WINAPI GetModuleHandleW(LPCWSTR lpModuleName);
+DWORD WINAPI GetModuleFileNameW(HMODULE hModule, LPWSTR lpFilename, DWORD nSize);
+FARPROC WINAPI GetProcAddress(HMODULE hModule, LPCSTR lpProcName);
+DWORD WINAPI GetLastError();
+BOOL WINAPI CloseHandle(HANDLE hObject);
+HANDLE WINAPI LocalFree(HANDLE hMem);
+
+// kernel32: synchronization and time
+HANDLE WINAPI CreateEventW(SECURITY_ATTRIBUTES* lpEventAttributes, BOOL bManualReset, BOOL bInitialState, LPCWSTR lpName);
+BOOL WINAPI SetEvent(HANDLE hEvent);
+DWORD WINAPI WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
+BOOL WINAPI RegisterWaitForSingleObject(PHANDLE phNewWaitObject, HANDLE hObject, WAITORTIMERCALLBACK Callback,
+    PVOID Context, ULONG dwMilliseconds, ULONG dwFlags);
+BOOL WINAPI UnregisterWait(HANDLE WaitHandle);
+BOOL WINAPI UnregisterWaitEx(HANDLE WaitHandle, HANDLE CompletionEvent);
+VOID WINAPI AcquireSRWLockExclusive(PSRWLOCK SRWLock);
+VOID WINAPI ReleaseSRWLockExclusive(PSRWLOCK SRWLock);
+VOID WINAPI AcquireSRWLockShared(PSRWLOCK SRWLock);
+VOID WINAPI ReleaseSRWLockShared(PSRWLOCK SRWLock);
+BOOL WINAPI InitOnceExecuteOnce(PINIT_ONCE InitOnce, PINIT_ONCE_FN InitFn, PVOID Parameter, LPVOID* Context);
+DWORD WINAPI GetTickCount();
+ULONGLONG WINAPI GetTickCount64();
+BOOL WINAPI QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount);
+BOOL WINAPI QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency);
+PTP_TIMER WINAPI CreateThreadpoolTimer(PTP_TIMER_CALLBACK pfnti, PVOID pv, PTP_CALLBACK_ENVIRON pcbe);
+VOID WINAPI SetThreadpoolTimer(PTP_TIMER pti, PFILETIME pftDueTime, DWORD msPeriod, DWORD msWindowLength);
+VOID WINAPI WaitForThreadpoolTimerCallbacks(PTP_TIMER pti, BOOL fCancelPendingCallbacks);
+VOID WINAPI CloseThreadpoolTimer(PTP_TIMER pti);
+
+// kernel32: file mappings
+HANDLE WINAPI CreateFileMappingW(HANDLE hFile, SECURITY_ATTRIBUTES* lpFileMappingAttributes, DWORD flProtect,
+    DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow, LPCWSTR lpName);
+HANDLE WINAPI OpenFileMappingW(DWORD dwDesiredAccess, BOOL bInheritHandle, LPCWSTR lpName);
+LPVOID WINAPI MapViewOfFile(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh,
+    DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap);
+BOOL WINAPI UnmapViewOfFile(LPCVOID lpBaseAddress);
+BOOL WINAPI GetProcessMemoryInfo(HANDLE Process, PROCESS_MEMORY_COUNTERS* ppsmemCounters, DWORD cb);
+
+// advapi32
+LSTATUS WINAPI RegOpenKeyExW(HKEY hKey, LPCWSTR lpSubKey, DWORD ulOptions, REGSAM samDesired, PHKEY phkResult);
+LSTATUS WINAPI RegQueryValueExW(HKEY hKey, LPCWSTR lpValueName, LPDWORD lpReserved, LPDWORD lpType,
+    LPBYTE lpData, LPDWORD lpcbData);
+LSTATUS WINAPI RegCloseKey(HKEY hKey);
+LSTATUS WINAPI RegNotifyChangeKeyValue(HKEY hKey, BOOL bWatchSubtree, DWORD dwNotifyFilter, HANDLE hEvent,
+    BOOL fAsynchronous);
+BOOL WINAPI OpenProcessToken(HANDLE ProcessHandle, DWORD DesiredAccess, PHANDLE TokenHandle);
+BOOL WINAPI GetTokenInformation(HANDLE TokenHandle, TOKEN_INFORMATION_CLASS TokenInformationClass,
+    LPVOID TokenInformation, DWORD TokenInformationLength, PDWORD ReturnLength);
+BOOL WINAPI ConvertSidToStringSidW(PSID Sid, LPWSTR* StringSid);
+BOOL WINAPI ConvertStringSecurityDescriptorToSecurityDescriptorW(LPCWSTR StringSecurityDescriptor,
+    DWORD StringSDRevision, PSECURITY_DESCRIPTOR* SecurityDescriptor, ULONG* SecurityDescriptorSize);
+
+}
+
+inline void YieldProcessor() {}
+
+// MSVC CRT functions used by the mod. Windows wide printf functions take
+// wide strings for %s, glibc wants %ls, so the formats are converted first.
+int _wcsicmp(const wchar_t* string1, const wchar_t* string2);
+int _vswprintf_fake(wchar_t* buffer, size_t count, const wchar_t* format, va_list args);
+
+#define _TRUNCATE ((size_t)-1)
+
+inline int swprintf_s(wchar_t* buffer, size_t count, const wchar_t* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = _vswprintf_fake(buffer, count, format, args);
+    va_end(args);
+    return result;
+}
+
+inline int _snwprintf_s(wchar_t* buffer, size_t sizeOfBuffer, size_t count, const wchar_t* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = _vswprintf_fake(buffer, count < sizeOfBuffer ? count + 1 : sizeOfBuffer, format, args);
+    va_end(args);
+    return result;
+}
@@ -0,0 +1,1692 @@
+// Fake user32/dwmapi/advapi32/kernel32 layer for running the titlebar mod on
+// Linux. See fake_win32.h for how a fake session is laid out.
+
+#include "fake_win32.h"
+
+#include <commctrl.h>
+#include <dwmapi.h>
+#include <psapi.h>
+#include <sddl.h>
+#include <uxtheme.h>
+#include <windhawk_api.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#define FAKE_MAX_PROCESSES 256
+#define FAKE_MAX_NAMED_OBJECTS 1024
+#define FAKE_MAX_CLASSES 64
+#define FAKE_SECTION_POOL_SIZE (8 << 20)
+#define FAKE_FIRST_PROCESS_ID 1000
+// Thread ids are processId * 100 + n: UI threads from 1, the thread pool 99
+#define FAKE_THREAD_ID_STRIDE 100
+#define FAKE_POOL_THREAD 99
+#define FAKE_FIRST_ATOM 0xC000
+#define FAKE_HWND_BASE 0x10000
+#define FAKE_HWND_STRIDE 0x10
+#define FAKE_DESKTOP_WINDOW ((HWND)(ULONG_PTR)0x1000)
+#define FAKE_PERSONALIZE_KEY ((HKEY)(ULONG_PTR)0x2000)
+#define FAKE_PERSONALIZE_PATH L"Software\\Microsoft\\Windows\\CurrentVersion\\Themes\\Personalize"
+#define FAKE_USER_SID L"S-1-5-21-1000-1000-1000-1001"
+
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_NOT_SUPPORTED 50L
+#define ERROR_ALREADY_EXISTS 183L
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_CLASS_DOES_NOT_EXIST 1411L
+
+// Session arena, shared by all fake processes
+
+struct FakeWindow {
+    std::atomic<BOOL> alive;
+    DWORD processId;
+    DWORD threadId;
+    ATOM atom;
+    LONG style;
+    LONG exStyle;
+    HWND parent;
+    std::atomic<BOOL> darkMode;         // DWMWA_USE_IMMERSIVE_DARK_MODE
+    std::atomic<int> backdrop;          // DWMWA_SYSTEMBACKDROP_TYPE
+    std::atomic<ULONGLONG> lastSetNs;   // when darkMode was last set
+};
+
+enum FakeObjectKind {
+    FAKE_OBJECT_FREE = 0,
+    FAKE_OBJECT_SECTION = 1,
+    FAKE_OBJECT_EVENT = 2
+};
+
+// Named section or event. Named objects live as long as the session.
+struct FakeNamedObject {
+    WCHAR name[96];
+    int kind;
+    std::atomic<LONG> signaled;
+    BOOL manualReset;
+    size_t offset;                      // sections, into the section pool
+    size_t size;
+};
+
+struct FakeProcessEntry {
+    std::atomic<DWORD> processId;
+    std::atomic<BOOL> running;
+    ULONGLONG startTime;
+    std::atomic<ULONGLONG> dwmSetAttributeCalls;
+    std::atomic<ULONGLONG> setWindowPosCalls;
+    std::atomic<ULONGLONG> registryReads;
+};
+
+struct FakeSession {
+    std::atomic<LONG> lock;
+    FakeCosts costs;
+    std::atomic<DWORD> appsUseLightTheme;
+    std::atomic<ULONG> registryChanges;
+    std::atomic<HWND> foreground;
+    WCHAR classNames[FAKE_MAX_CLASSES][64];
+    ULONG classCount;
+    FakeProcessEntry processes[FAKE_MAX_PROCESSES];
+    FakeNamedObject objects[FAKE_MAX_NAMED_OBJECTS];
+    size_t sectionPoolUsed;
+    size_t windowCapacity;
+    std::atomic<size_t> windowCount;    // windows are never reused
+};
+
+static FakeSession* g_session = nullptr;
+static FakeWindow* g_windows = nullptr;
+static BYTE* g_sectionPool = nullptr;
+
+// Process-local objects
+
+enum FakeHandleKind {
+    FAKE_HANDLE_EVENT,
+    FAKE_HANDLE_SECTION,
+    FAKE_HANDLE_PROCESS,
+    FAKE_HANDLE_TOKEN
+};
+
+struct FakeHandle {
+    FakeHandleKind kind;
+    std::atomic<LONG>* signaled;        // events: localSignaled or a named object's
+    std::atomic<LONG> localSignaled;
+    BOOL manualReset;
+    ULONG registryArm;                  // registryChanges + 1 while a notification is armed
+    FakeNamedObject* object;            // sections
+    DWORD processId;                    // processes
+};
+
+struct TP_TIMER_ {
+    PTP_TIMER_CALLBACK callback;
+    PVOID context;
+    BOOL armed;
+    BOOL closed;
+    ULONGLONG dueNs;
+    DWORD periodMs;
+    ULONG fires;
+};
+
+struct FakeWait {
+    FakeHandle* object;
+    WAITORTIMERCALLBACK callback;
+    PVOID context;
+    ULONG flags;
+    BOOL active;
+    BOOL unregistered;
+};
+
+struct HHOOK__ {
+    HOOKPROC proc;
+    DWORD threadId;
+};
+
+struct FakeSubclass {
+    SUBCLASSPROC proc;
+    UINT_PTR id;
+    DWORD_PTR refData;
+};
+
+// Subclass procedure being called, so DefSubclassProc knows the next one
+struct FakeSubclassFrame {
+    HWND hWnd;
+    int position;
+};
+
+struct FakeProcessState {
+    UINT index = 0;
+    DWORD processId = 0;
+    DWORD currentThreadId = 0;
+    DWORD lastError = 0;
+    BOOL verbose = FALSE;
+    std::map<DWORD, std::deque<MSG>> queues;
+    std::vector<std::vector<FakeSubclass>> subclasses;  // by window index
+    std::vector<FakeSubclassFrame> subclassFrames;
+    std::vector<HHOOK> callWndProcHooks;
+    std::vector<PTP_TIMER> timers;
+    std::vector<FakeWait*> waits;
+    std::map<std::wstring, std::wstring> stringSettings;
+    std::map<std::wstring, int> intSettings;
+    std::map<std::wstring, UINT> registeredMessages;
+};
+
+// Constructed on first use, the mod registers its messages during static
+// initialization
+static FakeProcessState& Process() {
+    static FakeProcessState state;
+    return state;
+}
+
+// Hookable functions. The exported functions call through these pointers,
+// which Wh_ApplyHookOperations points at the mod's hooks.
+
+typedef LRESULT (WINAPI* DefWindowProcW_t)(HWND, UINT, WPARAM, LPARAM);
+typedef HWND (WINAPI* CreateWindowExW_t)(DWORD, LPCWSTR, LPCWSTR, DWORD, int, int, int, int,
+    HWND, HMENU, HINSTANCE, LPVOID);
+typedef HWND (WINAPI* CreateWindowExA_t)(DWORD, LPCSTR, LPCSTR, DWORD, int, int, int, int,
+    HWND, HMENU, HINSTANCE, LPVOID);
+typedef BOOL (WINAPI* UnregisterClassW_t)(LPCWSTR, HINSTANCE);
+typedef BOOL (WINAPI* UnregisterClassA_t)(LPCSTR, HINSTANCE);
+
+static LRESULT WINAPI FakeDefWindowProcW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
+static HWND WINAPI FakeCreateWindowExW(DWORD dwExStyle, LPCWSTR lpClassName, LPCWSTR lpWindowName,
+    DWORD dwStyle, int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu,
+    HINSTANCE hInstance, LPVOID lpParam);
+static HWND WINAPI FakeCreateWindowExA(DWORD dwExStyle, LPCSTR lpClassName, LPCSTR lpWindowName,
+    DWORD dwStyle, int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu,
+    HINSTANCE hInstance, LPVOID lpParam);
+static BOOL WINAPI FakeUnregisterClassW(LPCWSTR lpClassName, HINSTANCE hInstance);
+static BOOL WINAPI FakeUnregisterClassA(LPCSTR lpClassName, HINSTANCE hInstance);
+
+static DefWindowProcW_t g_DefWindowProcW = FakeDefWindowProcW;
+static CreateWindowExW_t g_CreateWindowExW = FakeCreateWindowExW;
+static CreateWindowExA_t g_CreateWindowExA = FakeCreateWindowExA;
+static UnregisterClassW_t g_UnregisterClassW = FakeUnregisterClassW;
+static UnregisterClassA_t g_UnregisterClassA = FakeUnregisterClassA;
+
+struct FakeHookableFunction {
+    void* target;           // exported function the mod hooks
+    void* original;         // implementation behind it
+    void** active;          // what the exported function calls
+    void* pending;          // set by Wh_SetFunctionHook, applied by Wh_ApplyHookOperations
+};
+
+static FakeHookableFunction g_hookableFunctions[] = {
+    { (void*)DefWindowProcW, (void*)FakeDefWindowProcW, (void**)&g_DefWindowProcW, nullptr },
+    { (void*)CreateWindowExW, (void*)FakeCreateWindowExW, (void**)&g_CreateWindowExW, nullptr },
+    { (void*)CreateWindowExA, (void*)FakeCreateWindowExA, (void**)&g_CreateWindowExA, nullptr },
+    { (void*)UnregisterClassW, (void*)FakeUnregisterClassW, (void**)&g_UnregisterClassW, nullptr },
+    { (void*)UnregisterClassA, (void*)FakeUnregisterClassA, (void**)&g_UnregisterClassA, nullptr },
+};
+
+// Helpers
+
+ULONGLONG FakeNowNs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG)now.tv_sec * 1000000000ULL + (ULONGLONG)now.tv_nsec;
+}
+
+// Burn the simulated cost of a call on the calling thread
+static VOID Spin(ULONGLONG ns) {
+    if (!ns)
+        return;
+    ULONGLONG end = FakeNowNs() + ns;
+    while (FakeNowNs() < end) {
+    }
+}
+
+static VOID LockSession() {
+    LONG expected = 0;
+    while (!g_session->lock.compare_exchange_weak(expected, 1, std::memory_order_acquire)) {
+        expected = 0;
+        sched_yield();
+    }
+}
+
+static VOID UnlockSession() {
+    g_session->lock.store(0, std::memory_order_release);
+}
+
+static FakeProcessEntry* FindProcess(DWORD processId) {
+    if (!g_session || !processId)
+        return nullptr;
+    for (FakeProcessEntry& entry : g_session->processes) {
+        if (entry.processId.load(std::memory_order_relaxed) == processId)
+            return &entry;
+    }
+    return nullptr;
+}
+
+static FakeProcessEntry* CurrentProcessEntry() {
+    return g_session && Process().processId ? &g_session->processes[Process().index] : nullptr;
+}
+
+static HWND WindowHandle(size_t index) {
+    return (HWND)(ULONG_PTR)(FAKE_HWND_BASE + index * FAKE_HWND_STRIDE);
+}
+
+static size_t WindowIndex(const FakeWindow* window) {
+    return window - g_windows;
+}
+
+// The window behind a handle, nullptr if it's invalid or was destroyed
+static FakeWindow* GetFakeWindow(HWND hWnd) {
+    ULONG_PTR value = (ULONG_PTR)hWnd;
+    if (!g_session || value < FAKE_HWND_BASE || (value - FAKE_HWND_BASE) % FAKE_HWND_STRIDE)
+        return nullptr;
+
+    size_t index = (value - FAKE_HWND_BASE) / FAKE_HWND_STRIDE;
+    if (index >= g_session->windowCount.load(std::memory_order_acquire))
+        return nullptr;
+
+    FakeWindow* window = &g_windows[index];
+    return window->alive.load(std::memory_order_acquire) ? window : nullptr;
+}
+
+static BOOL IsOwnWindow(const FakeWindow* window) {
+    return window && window->processId == Process().processId;
+}
+
+static FakeNamedObject* FindNamedObject(LPCWSTR name, int kind) {
+    for (FakeNamedObject& object : g_session->objects) {
+        if (object.kind == kind && wcscmp(object.name, name) == 0)
+            return &object;
+    }
+    return nullptr;
+}
+
+// Find or create a named object. The session lock must be held.
+static FakeNamedObject* CreateNamedObject(LPCWSTR name, int kind, BOOL* created) {
+    *created = FALSE;
+    FakeNamedObject* object = FindNamedObject(name, kind);
+    if (object)
+        return object;
+
+    for (FakeNamedObject& free : g_session->objects) {
+        if (free.kind == FAKE_OBJECT_FREE) {
+            wcsncpy(free.name, name, ARRAYSIZE(free.name) - 1);
+            free.kind = kind;
+            *created = TRUE;
+            return &free;
+        }
+    }
+    return nullptr;
+}
+
+// Check if a handle is signaled. Auto-reset events are reset when consumed.
+static BOOL IsSignaled(FakeHandle* handle, BOOL consume) {
+    if (handle->kind == FAKE_HANDLE_PROCESS) {
+        FakeProcessEntry* entry = FindProcess(handle->processId);
+        return !entry || !entry->running.load(std::memory_order_acquire);
+    }
+    if (handle->kind != FAKE_HANDLE_EVENT)
+        return FALSE;
+
+    if (handle->registryArm &&
+        g_session->registryChanges.load(std::memory_order_acquire) + 1 != handle->registryArm) {
+        handle->registryArm = 0;
+        handle->signaled->store(1, std::memory_order_release);
+    }
+
+    if (!consume || handle->manualReset)
+        return handle->signaled->load(std::memory_order_acquire) != 0;
+    return handle->signaled->exchange(0, std::memory_order_acq_rel) != 0;
+}
+
+static DWORD ThreadIdOf(UINT thread) {
+    return Process().processId * FAKE_THREAD_ID_STRIDE + thread;
+}
+
+static VOID ConvertToNarrow(const wchar_t* source, char* destination, size_t size) {
+    size_t i = 0;
+    for (; source[i] && i + 1 < size; i++) {
+        destination[i] = source[i] < 0x80 ? (char)source[i] : '?';
+    }
+    destination[i] = '\0';
+}
+
+// Session control
+
+VOID FakeInitSession(size_t maxWindows, const FakeCosts& costs) {
+    size_t sessionSize = (sizeof(FakeSession) + 63) & ~(size_t)63;
+    size_t windowsSize = (maxWindows * sizeof(FakeWindow) + 63) & ~(size_t)63;
+    size_t size = sessionSize + windowsSize + FAKE_SECTION_POOL_SIZE;
+    void* arena = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    g_session = (FakeSession*)arena;
+    g_windows = (FakeWindow*)((BYTE*)arena + sessionSize);
+    g_sectionPool = (BYTE*)arena + sessionSize + windowsSize;
+    g_session->costs = costs;
+    g_session->windowCapacity = maxWindows;
+    g_session->appsUseLightTheme = 1;
+}
+
+VOID FakeSetSystemDarkMode(BOOL dark) {
+    g_session->appsUseLightTheme.store(dark ? 0 : 1, std::memory_order_relaxed);
+    g_session->registryChanges.fetch_add(1, std::memory_order_release);
+}
+
+VOID FakeSetSetting(PCWSTR name, PCWSTR value) {
+    Process().stringSettings[name] = value;
+}
+
+VOID FakeSetIntSetting(PCWSTR name, int value) {
+    Process().intSettings[name] = value;
+}
+
+VOID FakeSetVerbose(BOOL verbose) {
+    Process().verbose = verbose;
+}
+
+DWORD FakeStartProcess(UINT index) {
+    if (index >= FAKE_MAX_PROCESSES) {
+        fprintf(stderr, "fake process index %u out of range\n", index);
+        exit(1);
+    }
+
+    FakeProcessState& state = Process();
+    state.index = index;
+    state.processId = FAKE_FIRST_PROCESS_ID + index * 4;
+    state.currentThreadId = FakeUiThreadId(0);
+
+    FakeProcessEntry& entry = g_session->processes[index];
+    entry.startTime = FakeNowNs() / 100 + 1;
+    entry.dwmSetAttributeCalls = 0;
+    entry.setWindowPosCalls = 0;
+    entry.registryReads = 0;
+    entry.processId.store(state.processId, std::memory_order_relaxed);
+    entry.running.store(TRUE, std::memory_order_release);
+    return state.processId;
+}
+
+// Destroy the windows of the process and mark it exited, which signals the
+// process handles other fake processes wait on
+VOID FakeExitProcess() {
+    FakeProcessState& state = Process();
+    size_t count = g_session->windowCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        if (g_windows[i].processId == state.processId) {
+            g_windows[i].alive.store(FALSE, std::memory_order_release);
+        }
+    }
+    g_session->processes[state.index].running.store(FALSE, std::memory_order_release);
+}
+
+DWORD FakeUiThreadId(UINT thread) {
+    return ThreadIdOf(1 + thread % (FAKE_POOL_THREAD - 1));
+}
+
+VOID FakeSetCurrentThread(DWORD threadId) {
+    Process().currentThreadId = threadId;
+}
+
+VOID FakeApplyModHooks() {
+    Wh_ApplyHookOperations();
+}
+
+static BOOL RunSignaledWaits() {
+    FakeProcessState& state = Process();
+    BOOL ran = FALSE;
+    for (size_t i = 0; i < state.waits.size(); i++) {
+        FakeWait* wait = state.waits[i];
+        if (!wait->active || !IsSignaled(wait->object, TRUE))
+            continue;
+
+        if (wait->flags & WT_EXECUTEONLYONCE) {
+            wait->active = FALSE;
+        }
+        state.currentThreadId = ThreadIdOf(FAKE_POOL_THREAD);
+        wait->callback(wait->context, FALSE);
+        ran = TRUE;
+    }
+
+    // Unregistered waits are no longer referenced by the mod
+    for (size_t i = 0; i < state.waits.size();) {
+        if (state.waits[i]->unregistered) {
+            delete state.waits[i];
+            state.waits.erase(state.waits.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    return ran;
+}
+
+static BOOL RunDueTimers() {
+    FakeProcessState& state = Process();
+    BOOL ran = FALSE;
+    ULONGLONG now = FakeNowNs();
+    for (size_t i = 0; i < state.timers.size(); i++) {
+        PTP_TIMER timer = state.timers[i];
+        if (!timer->armed || timer->closed || timer->dueNs > now)
+            continue;
+
+        if (timer->periodMs) {
+            timer->dueNs = now + timer->periodMs * 1000000ULL;
+        } else {
+            timer->armed = FALSE;
+        }
+        timer->fires++;
+        state.currentThreadId = ThreadIdOf(FAKE_POOL_THREAD);
+        timer->callback(nullptr, timer->context, timer);
+        ran = TRUE;
+    }
+
+    for (size_t i = 0; i < state.timers.size();) {
+        if (state.timers[i]->closed) {
+            delete state.timers[i];
+            state.timers.erase(state.timers.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    return ran;
+}
+
+static BOOL PumpMessages() {
+    FakeProcessState& state = Process();
+    BOOL ran = FALSE;
+    for (BOOL dispatched = TRUE; dispatched;) {
+        dispatched = FALSE;
+        // std::map iterators stay valid while dispatching posts to new threads
+        for (auto& entry : state.queues) {
+            while (!entry.second.empty()) {
+                MSG msg = entry.second.front();
+                entry.second.pop_front();
+                state.currentThreadId = entry.first;
+                if (msg.hwnd) {
+                    DispatchMessageW(&msg);
+                }
+                dispatched = ran = TRUE;
+            }
+        }
+    }
+    return ran;
+}
+
+BOOL FakeRunPending() {
+    DWORD threadId = Process().currentThreadId;
+    BOOL ran = RunSignaledWaits();
+    ran |= RunDueTimers();
+    ran |= PumpMessages();
+    Process().currentThreadId = threadId;
+    return ran;
+}
+
+VOID FakeIdle(ULONGLONG maxNs) {
+    ULONGLONG now = FakeNowNs();
+    ULONGLONG sleepNs = maxNs;
+    for (PTP_TIMER timer : Process().timers) {
+        if (timer->armed && !timer->closed) {
+            ULONGLONG untilDue = timer->dueNs > now ? timer->dueNs - now : 0;
+            if (untilDue < sleepNs) {
+                sleepNs = untilDue;
+            }
+        }
+    }
+
+    if (!sleepNs) {
+        sched_yield();
+        return;
+    }
+    timespec duration = { (time_t)(sleepNs / 1000000000ULL), (long)(sleepNs % 1000000000ULL) };
+    nanosleep(&duration, nullptr);
+}
+
+ULONG FakeTimerCallbackCount(PTP_TIMER timer) {
+    return timer ? timer->fires : 0;
+}
+
+VOID FakeSetForegroundWindow(HWND hWnd) {
+    g_session->foreground.store(hWnd, std::memory_order_relaxed);
+}
+
+BOOL FakeSessionConverged(BOOL dark, ULONGLONG* lastSetNs, ULONG* pending) {
+    *lastSetNs = 0;
+    *pending = 0;
+    size_t count = g_session->windowCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        const FakeWindow& window = g_windows[i];
+        if (!window.alive.load(std::memory_order_acquire) || window.parent ||
+            !(window.style & WS_CAPTION) || (window.style & WS_CHILD) ||
+            (window.exStyle & WS_EX_TOOLWINDOW))
+            continue;
+
+        FakeProcessEntry* entry = FindProcess(window.processId);
+        if (!entry || !entry->running.load(std::memory_order_acquire))
+            continue;
+
+        if (window.darkMode.load(std::memory_order_acquire) != dark) {
+            (*pending)++;
+        } else if (window.lastSetNs.load(std::memory_order_relaxed) > *lastSetNs) {
+            *lastSetNs = window.lastSetNs.load(std::memory_order_relaxed);
+        }
+    }
+    return *pending == 0;
+}
+
+VOID FakeGetProcessCounters(UINT index, FakeProcessCounters* counters) {
+    const FakeProcessEntry& entry = g_session->processes[index];
+    counters->dwmSetAttributeCalls = entry.dwmSetAttributeCalls.load(std::memory_order_relaxed);
+    counters->setWindowPosCalls = entry.setWindowPosCalls.load(std::memory_order_relaxed);
+    counters->registryReads = entry.registryReads.load(std::memory_order_relaxed);
+}
+
+// Windhawk API
+
+// Convert a format string of the Windows wide printf functions to glibc:
+// %s and %c take wide arguments, and l on an integer is 32 bits like LONG
+static std::wstring ConvertFormat(const wchar_t* format) {
+    std::wstring converted;
+    for (const wchar_t* p = format; *p;) {
+        if (*p != L'%') {
+            converted += *p++;
+            continue;
+        }
+
+        converted += *p++;
+        if (*p == L'%') {
+            converted += *p++;
+            continue;
+        }
+        while (*p && wcschr(L"-+ #0123456789.*", *p)) {
+            converted += *p++;
+        }
+        std::wstring length;
+        while (*p && wcschr(L"hlLqjzt", *p)) {
+            length += *p++;
+        }
+        if (!*p)
+            break;
+
+        wchar_t conversion = *p++;
+        if (length == L"l" && wcschr(L"diouxX", conversion)) {
+            length.clear();
+        } else if (length.empty() && (conversion == L's' || conversion == L'c')) {
+            length = L"l";
+        }
+        converted += length;
+        converted += conversion;
+    }
+    return converted;
+}
+
+int _vswprintf_fake(wchar_t* buffer, size_t count, const wchar_t* format, va_list args) {
+    std::wstring converted = ConvertFormat(format);
+    int result = vswprintf(buffer, count, converted.c_str(), args);
+    if (result < 0 && count) {
+        buffer[count - 1] = L'\0';
+    }
+    return result;
+}
+
+int _wcsicmp(const wchar_t* string1, const wchar_t* string2) {
+    for (;; string1++, string2++) {
+        wint_t c1 = towlower(*string1);
+        wint_t c2 = towlower(*string2);
+        if (c1 != c2 || !c1)
+            return (int)c1 - (int)c2;
+    }
+}
+
+void Wh_Log(const wchar_t* format, ...) {
+    if (!Process().verbose)
+        return;
+
+    wchar_t message[1024];
+    va_list args;
+    va_start(args, format);
+    _vswprintf_fake(message, ARRAYSIZE(message), format, args);
+    va_end(args);
+
+    char narrow[1024];
+    ConvertToNarrow(message, narrow, sizeof(narrow));
+    fprintf(stderr, "%s\n", narrow);
+}
+
+BOOL Wh_SetFunctionHook(void* targetFunction, void* hookFunction, void** originalFunction) {
+    for (FakeHookableFunction& function : g_hookableFunctions) {
+        if (function.target == targetFunction) {
+            function.pending = hookFunction;
+            *originalFunction = function.original;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+BOOL Wh_RemoveFunctionHook(void* targetFunction) {
+    for (FakeHookableFunction& function : g_hookableFunctions) {
+        if (function.target == targetFunction) {
+            function.pending = function.original;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void Wh_ApplyHookOperations() {
+    for (FakeHookableFunction& function : g_hookableFunctions) {
+        if (function.pending) {
+            *function.active = function.pending;
+            function.pending = nullptr;
+        }
+    }
+}
+
+static std::wstring FormatSettingName(const wchar_t* valueName, va_list args) {
+    wchar_t name[256];
+    _vswprintf_fake(name, ARRAYSIZE(name), valueName, args);
+    return name;
+}
+
+int Wh_GetIntSetting(const wchar_t* valueName, ...) {
+    va_list args;
+    va_start(args, valueName);
+    std::wstring name = FormatSettingName(valueName, args);
+    va_end(args);
+
+    auto it = Process().intSettings.find(name);
+    return it != Process().intSettings.end() ? it->second : 0;
+}
+
+const wchar_t* Wh_GetStringSetting(const wchar_t* valueName, ...) {
+    va_list args;
+    va_start(args, valueName);
+    std::wstring name = FormatSettingName(valueName, args);
+    va_end(args);
+
+    auto it = Process().stringSettings.find(name);
+    return wcsdup(it != Process().stringSettings.end() ? it->second.c_str() : L"");
+}
+
+void Wh_FreeStringSetting(const wchar_t* string) {
+    free((void*)string);
+}
+
+// user32: windows
+
+static LRESULT CallWindowChain(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
+
+// Every fake window has the same window procedure, which leaves everything
+// to DefWindowProcW like most application windows do for the messages the
+// mod handles
+static LRESULT CALLBACK FakeApplicationWindowProc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    return DefWindowProcW(hWnd, Msg, wParam, lParam);
+}
+
+static LRESULT WINAPI FakeDefWindowProcW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    return Msg == WM_NCCREATE ? TRUE : 0;
+}
+
+extern "C" LRESULT WINAPI DefWindowProcW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    return g_DefWindowProcW(hWnd, Msg, wParam, lParam);
+}
+
+static ULONG FindClassIndex(LPCWSTR className) {
+    ULONG i = 0;
+    for (; i < g_session->classCount; i++) {
+        if (_wcsicmp(g_session->classNames[i], className) == 0)
+            break;
+    }
+    return i;
+}
+
+static ATOM FindOrAddClass(LPCWSTR className) {
+    LockSession();
+    ULONG i = FindClassIndex(className);
+    if (i == g_session->classCount && i < FAKE_MAX_CLASSES) {
+        wcsncpy(g_session->classNames[i], className, ARRAYSIZE(g_session->classNames[i]) - 1);
+        g_session->classCount++;
+    }
+    UnlockSession();
+    return i < FAKE_MAX_CLASSES ? (ATOM)(FAKE_FIRST_ATOM + i) : 0;
+}
+
+static HWND WINAPI FakeCreateWindowExW(DWORD dwExStyle, LPCWSTR lpClassName, LPCWSTR lpWindowName,
+    DWORD dwStyle, int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu,
+    HINSTANCE hInstance, LPVOID lpParam) {
+    FakeProcessState& state = Process();
+    ATOM atom = FindOrAddClass(lpClassName);
+
+    LockSession();
+    size_t index = g_session->windowCount.load(std::memory_order_relaxed);
+    if (index >= g_session->windowCapacity) {
+        UnlockSession();
+        state.lastError = ERROR_NOT_ENOUGH_MEMORY;
+        return nullptr;
+    }
+    FakeWindow& window = g_windows[index];
+    window.processId = state.processId;
+    window.threadId = state.currentThreadId;
+    window.atom = atom;
+    window.style = (LONG)dwStyle;
+    window.exStyle = (LONG)dwExStyle;
+    window.parent = hWndParent == HWND_MESSAGE ? nullptr : hWndParent;
+    window.alive.store(TRUE, std::memory_order_relaxed);
+    g_session->windowCount.store(index + 1, std::memory_order_release);
+    UnlockSession();
+
+    HWND hWnd = WindowHandle(index);
+    CREATESTRUCTW createStruct = { lpParam, hInstance, hMenu, hWndParent, nHeight, nWidth, Y, X,
+        (LONG)dwStyle, lpWindowName, lpClassName, dwExStyle };
+    CallWindowChain(hWnd, WM_NCCREATE, 0, (LPARAM)&createStruct);
+    CallWindowChain(hWnd, WM_CREATE, 0, (LPARAM)&createStruct);
+    return hWnd;
+}
+
+static HWND WINAPI FakeCreateWindowExA(DWORD dwExStyle, LPCSTR lpClassName, LPCSTR lpWindowName,
+    DWORD dwStyle, int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu,
+    HINSTANCE hInstance, LPVOID lpParam) {
+    std::wstring className(lpClassName, lpClassName + strlen(lpClassName));
+    std::wstring windowName;
+    if (lpWindowName) {
+        windowName.assign(lpWindowName, lpWindowName + strlen(lpWindowName));
+    }
+    return FakeCreateWindowExW(dwExStyle, className.c_str(), windowName.c_str(), dwStyle, X, Y,
+        nWidth, nHeight, hWndParent, hMenu, hInstance, lpParam);
+}
+
+extern "C" HWND WINAPI CreateWindowExW(DWORD dwExStyle, LPCWSTR lpClassName, LPCWSTR lpWindowName,
+    DWORD dwStyle, int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu,
+    HINSTANCE hInstance, LPVOID lpParam) {
+    return g_CreateWindowExW(dwExStyle, lpClassName, lpWindowName, dwStyle, X, Y, nWidth, nHeight,
+        hWndParent, hMenu, hInstance, lpParam);
+}
+
+extern "C" HWND WINAPI CreateWindowExA(DWORD dwExStyle, LPCSTR lpClassName, LPCSTR lpWindowName,
+    DWORD dwStyle, int X, int Y, int nWidth, int nHeight, HWND hWndParent, HMENU hMenu,
+    HINSTANCE hInstance, LPVOID lpParam) {
+    return g_CreateWindowExA(dwExStyle, lpClassName, lpWindowName, dwStyle, X, Y, nWidth, nHeight,
+        hWndParent, hMenu, hInstance, lpParam);
+}
+
+// Classes are registered by the first window that uses them and stay for the
+// whole session, so their atoms are never reused
+extern "C" ATOM WINAPI GetClassInfoExW(HINSTANCE hInstance, LPCWSTR lpszClass, WNDCLASSEXW* lpwcx) {
+    LockSession();
+    ULONG i = FindClassIndex(lpszClass);
+    ATOM atom = i < g_session->classCount ? (ATOM)(FAKE_FIRST_ATOM + i) : 0;
+    UnlockSession();
+    if (!atom) {
+        Process().lastError = ERROR_CLASS_DOES_NOT_EXIST;
+    }
+    return atom;
+}
+
+extern "C" ATOM WINAPI GetClassInfoExA(HINSTANCE hInstance, LPCSTR lpszClass, WNDCLASSEXA* lpwcx) {
+    std::wstring className(lpszClass, lpszClass + strlen(lpszClass));
+    return GetClassInfoExW(hInstance, className.c_str(), nullptr);
+}
+
+static BOOL WINAPI FakeUnregisterClassW(LPCWSTR lpClassName, HINSTANCE hInstance) {
+    return GetClassInfoExW(hInstance, lpClassName, nullptr) != 0;
+}
+
+static BOOL WINAPI FakeUnregisterClassA(LPCSTR lpClassName, HINSTANCE hInstance) {
+    return GetClassInfoExA(hInstance, lpClassName, nullptr) != 0;
+}
+
+extern "C" BOOL WINAPI UnregisterClassW(LPCWSTR lpClassName, HINSTANCE hInstance) {
+    return g_UnregisterClassW(lpClassName, hInstance);
+}
+
+extern "C" BOOL WINAPI UnregisterClassA(LPCSTR lpClassName, HINSTANCE hInstance) {
+    return g_UnregisterClassA(lpClassName, hInstance);
+}
+
+extern "C" BOOL WINAPI IsWindow(HWND hWnd) {
+    return GetFakeWindow(hWnd) != nullptr;
+}
+
+extern "C" BOOL WINAPI IsWindowVisible(HWND hWnd) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    return window && (window->style & WS_VISIBLE);
+}
+
+extern "C" BOOL WINAPI IsIconic(HWND hWnd) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    return window && (window->style & WS_MINIMIZE);
+}
+
+extern "C" LONG WINAPI GetWindowLongW(HWND hWnd, int nIndex) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window)
+        return 0;
+    if (nIndex == GWL_STYLE)
+        return window->style;
+    if (nIndex == GWL_EXSTYLE)
+        return window->exStyle;
+    return 0;
+}
+
+extern "C" DWORD WINAPI GetClassLongW(HWND hWnd, int nIndex) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    return window && nIndex == GCW_ATOM ? window->atom : 0;
+}
+
+extern "C" int WINAPI GetClassNameW(HWND hWnd, LPWSTR lpClassName, int nMaxCount) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window || !window->atom || nMaxCount <= 0)
+        return 0;
+
+    const WCHAR* className = g_session->classNames[window->atom - FAKE_FIRST_ATOM];
+    wcsncpy(lpClassName, className, nMaxCount - 1);
+    lpClassName[nMaxCount - 1] = L'\0';
+    return (int)wcslen(lpClassName);
+}
+
+extern "C" DWORD WINAPI GetWindowThreadProcessId(HWND hWnd, LPDWORD lpdwProcessId) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window)
+        return 0;
+    if (lpdwProcessId) {
+        *lpdwProcessId = window->processId;
+    }
+    return window->threadId;
+}
+
+extern "C" HWND WINAPI GetDesktopWindow() {
+    return FAKE_DESKTOP_WINDOW;
+}
+
+extern "C" HWND WINAPI GetAncestor(HWND hWnd, UINT gaFlags) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window)
+        return nullptr;
+    if (gaFlags == GA_PARENT)
+        return window->parent ? window->parent : FAKE_DESKTOP_WINDOW;
+
+    while (window->parent && GetFakeWindow(window->parent)) {
+        hWnd = window->parent;
+        window = GetFakeWindow(hWnd);
+    }
+    return hWnd;
+}
+
+extern "C" HWND WINAPI GetForegroundWindow() {
+    return g_session ? g_session->foreground.load(std::memory_order_relaxed) : nullptr;
+}
+
+// Siblings are in z-order from the newest window down
+static HWND NextSibling(HWND hParent, size_t below) {
+    for (size_t i = below; i-- > 0;) {
+        const FakeWindow& window = g_windows[i];
+        if (window.alive.load(std::memory_order_acquire) && window.parent == hParent)
+            return WindowHandle(i);
+    }
+    return nullptr;
+}
+
+extern "C" HWND WINAPI GetTopWindow(HWND hWnd) {
+    if (!g_session)
+        return nullptr;
+    HWND hParent = hWnd == FAKE_DESKTOP_WINDOW ? nullptr : hWnd;
+    return NextSibling(hParent, g_session->windowCount.load(std::memory_order_acquire));
+}
+
+extern "C" HWND WINAPI GetWindow(HWND hWnd, UINT uCmd) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window)
+        return nullptr;
+    if (uCmd == GW_HWNDNEXT)
+        return NextSibling(window->parent, WindowIndex(window));
+    if (uCmd == GW_HWNDFIRST)
+        return NextSibling(window->parent, g_session->windowCount.load(std::memory_order_acquire));
+    return nullptr;
+}
+
+extern "C" BOOL WINAPI EnumWindows(WNDENUMPROC lpEnumFunc, LPARAM lParam) {
+    for (HWND hWnd = GetTopWindow(nullptr); hWnd; hWnd = GetWindow(hWnd, GW_HWNDNEXT)) {
+        if (!lpEnumFunc(hWnd, lParam))
+            break;
+    }
+    return TRUE;
+}
+
+extern "C" BOOL WINAPI EnumChildWindows(HWND hWndParent, WNDENUMPROC lpEnumFunc, LPARAM lParam) {
+    size_t count = g_session->windowCount.load(std::memory_order_acquire);
+    for (size_t i = count; i-- > 0;) {
+        HWND hWnd = WindowHandle(i);
+        FakeWindow* window = GetFakeWindow(hWnd);
+        if (!window || !window->parent || GetAncestor(hWnd, GA_ROOT) == hWnd)
+            continue;
+
+        BOOL isDescendant = FALSE;
+        for (FakeWindow* ancestor = window; ancestor && ancestor->parent;
+            ancestor = GetFakeWindow(ancestor->parent)) {
+            if (ancestor->parent == hWndParent) {
+                isDescendant = TRUE;
+                break;
+            }
+        }
+        if (isDescendant && !lpEnumFunc(hWnd, lParam))
+            break;
+    }
+    return TRUE;
+}
+
+// user32: messages
+
+static LRESULT CallSubclass(HWND hWnd, int position, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    FakeProcessState& state = Process();
+    size_t index = WindowIndex(GetFakeWindow(hWnd));
+    if (position < 0 || index >= state.subclasses.size() || state.subclasses[index].empty())
+        return FakeApplicationWindowProc(hWnd, Msg, wParam, lParam);
+
+    std::vector<FakeSubclass>& chain = state.subclasses[index];
+    if (position >= (int)chain.size()) {
+        position = (int)chain.size() - 1;
+    }
+    FakeSubclass subclass = chain[position];
+    state.subclassFrames.push_back({ hWnd, position });
+    LRESULT result = subclass.proc(hWnd, Msg, wParam, lParam, subclass.id, subclass.refData);
+    state.subclassFrames.pop_back();
+    return result;
+}
+
+// Call the window's subclasses, newest first, then its window procedure
+static LRESULT CallWindowChain(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window)
+        return 0;
+
+    FakeProcessState& state = Process();
+    size_t index = WindowIndex(window);
+    if (index >= state.subclasses.size() || state.subclasses[index].empty())
+        return FakeApplicationWindowProc(hWnd, Msg, wParam, lParam);
+    return CallSubclass(hWnd, (int)state.subclasses[index].size() - 1, Msg, wParam, lParam);
+}
+
+// Call a window on its owner thread
+static LRESULT CallOnOwnerThread(HWND hWnd, FakeWindow* window, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    FakeProcessState& state = Process();
+    DWORD threadId = state.currentThreadId;
+    state.currentThreadId = window->threadId;
+    LRESULT result = CallWindowChain(hWnd, Msg, wParam, lParam);
+    state.currentThreadId = threadId;
+    return result;
+}
+
+extern "C" LRESULT WINAPI SendMessageW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!IsOwnWindow(window))
+        return 0;
+
+    FakeProcessState& state = Process();
+    if (!state.callWndProcHooks.empty()) {
+        CWPSTRUCT cwp = { lParam, wParam, Msg, hWnd };
+        std::vector<HHOOK> hooks = state.callWndProcHooks;
+        DWORD threadId = state.currentThreadId;
+        state.currentThreadId = window->threadId;
+        for (HHOOK hook : hooks) {
+            if (hook->threadId == window->threadId) {
+                hook->proc(HC_ACTION, threadId == window->threadId, (LPARAM)&cwp);
+            }
+        }
+        state.currentThreadId = threadId;
+    }
+    return CallOnOwnerThread(hWnd, window, Msg, wParam, lParam);
+}
+
+// Fake threads never hang, the message is always handled
+extern "C" LRESULT WINAPI SendMessageTimeoutW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam,
+    UINT fuFlags, UINT uTimeout, PDWORD_PTR lpdwResult) {
+    if (!IsOwnWindow(GetFakeWindow(hWnd)))
+        return 0;
+
+    LRESULT result = SendMessageW(hWnd, Msg, wParam, lParam);
+    if (lpdwResult) {
+        *lpdwResult = (DWORD_PTR)result;
+    }
+    return 1;
+}
+
+extern "C" BOOL WINAPI PostMessageW(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!IsOwnWindow(window)) {
+        Process().lastError = ERROR_ACCESS_DENIED;
+        return FALSE;
+    }
+
+    Process().queues[window->threadId].push_back({ hWnd, Msg, wParam, lParam, 0, {} });
+    return TRUE;
+}
+
+extern "C" BOOL WINAPI PostThreadMessageW(DWORD idThread, UINT Msg, WPARAM wParam, LPARAM lParam) {
+    if (idThread / FAKE_THREAD_ID_STRIDE != Process().processId) {
+        Process().lastError = ERROR_INVALID_PARAMETER;
+        return FALSE;
+    }
+
+    Process().queues[idThread].push_back({ nullptr, Msg, wParam, lParam, 0, {} });
+    return TRUE;
+}
+
+extern "C" BOOL WINAPI PeekMessageW(LPMSG lpMsg, HWND hWnd, UINT wMsgFilterMin, UINT wMsgFilterMax,
+    UINT wRemoveMsg) {
+    std::deque<MSG>& queue = Process().queues[Process().currentThreadId];
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+        if ((hWnd && it->hwnd != hWnd) ||
+            ((wMsgFilterMin || wMsgFilterMax) &&
+            (it->message < wMsgFilterMin || it->message > wMsgFilterMax)))
+            continue;
+
+        *lpMsg = *it;
+        if (wRemoveMsg & PM_REMOVE) {
+            queue.erase(it);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Never blocks: an empty queue ends the loop like WM_QUIT
+extern "C" BOOL WINAPI GetMessageW(LPMSG lpMsg, HWND hWnd, UINT wMsgFilterMin, UINT wMsgFilterMax) {
+    return PeekMessageW(lpMsg, hWnd, wMsgFilterMin, wMsgFilterMax, PM_REMOVE) &&
+        lpMsg->message != WM_QUIT;
+}
+
+extern "C" BOOL WINAPI TranslateMessage(const MSG* lpMsg) {
+    return FALSE;
+}
+
+extern "C" LRESULT WINAPI DispatchMessageW(const MSG* lpMsg) {
+    FakeWindow* window = GetFakeWindow(lpMsg->hwnd);
+    if (!IsOwnWindow(window))
+        return 0;
+    return CallOnOwnerThread(lpMsg->hwnd, window, lpMsg->message, lpMsg->wParam, lpMsg->lParam);
+}
+
+extern "C" UINT WINAPI RegisterWindowMessageW(LPCWSTR lpString) {
+    std::map<std::wstring, UINT>& messages = Process().registeredMessages;
+    auto it = messages.find(lpString);
+    if (it != messages.end())
+        return it->second;
+
+    UINT message = 0xC000 + (UINT)messages.size();
+    messages.emplace(lpString, message);
+    return message;
+}
+
+extern "C" HHOOK WINAPI SetWindowsHookExW(int idHook, HOOKPROC lpfn, HINSTANCE hmod, DWORD dwThreadId) {
+    if (idHook != WH_CALLWNDPROC || dwThreadId / FAKE_THREAD_ID_STRIDE != Process().processId) {
+        Process().lastError = ERROR_NOT_SUPPORTED;
+        return nullptr;
+    }
+
+    HHOOK hook = new HHOOK__{ lpfn, dwThreadId };
+    Process().callWndProcHooks.push_back(hook);
+    return hook;
+}
+
+extern "C" BOOL WINAPI UnhookWindowsHookEx(HHOOK hhk) {
+    std::vector<HHOOK>& hooks = Process().callWndProcHooks;
+    for (auto it = hooks.begin(); it != hooks.end(); ++it) {
+        if (*it == hhk) {
+            hooks.erase(it);
+            delete hhk;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+extern "C" LRESULT WINAPI CallNextHookEx(HHOOK hhk, int nCode, WPARAM wParam, LPARAM lParam) {
+    return 0;
+}
+
+extern "C" HWINEVENTHOOK WINAPI SetWinEventHook(DWORD eventMin, DWORD eventMax, HMODULE hmodWinEventProc,
+    WINEVENTPROC pfnWinEventProc, DWORD idProcess, DWORD idThread, DWORD dwFlags) {
+    Process().lastError = ERROR_NOT_SUPPORTED;
+    return nullptr;
+}
+
+extern "C" BOOL WINAPI UnhookWinEvent(HWINEVENTHOOK hWinEventHook) {
+    return FALSE;
+}
+
+// comctl32 and uxtheme
+
+extern "C" BOOL WINAPI SetWindowSubclass(HWND hWnd, SUBCLASSPROC pfnSubclass, UINT_PTR uIdSubclass,
+    DWORD_PTR dwRefData) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!IsOwnWindow(window) || window->threadId != Process().currentThreadId)
+        return FALSE;
+
+    std::vector<std::vector<FakeSubclass>>& subclasses = Process().subclasses;
+    size_t index = WindowIndex(window);
+    if (index >= subclasses.size()) {
+        subclasses.resize(index + 1);
+    }
+    for (FakeSubclass& subclass : subclasses[index]) {
+        if (subclass.proc == pfnSubclass && subclass.id == uIdSubclass) {
+            subclass.refData = dwRefData;
+            return TRUE;
+        }
+    }
+    subclasses[index].push_back({ pfnSubclass, uIdSubclass, dwRefData });
+    return TRUE;
+}
+
+extern "C" BOOL WINAPI RemoveWindowSubclass(HWND hWnd, SUBCLASSPROC pfnSubclass, UINT_PTR uIdSubclass) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    std::vector<std::vector<FakeSubclass>>& subclasses = Process().subclasses;
+    if (!IsOwnWindow(window) || window->threadId != Process().currentThreadId ||
+        WindowIndex(window) >= subclasses.size())
+        return FALSE;
+
+    std::vector<FakeSubclass>& chain = subclasses[WindowIndex(window)];
+    for (auto it = chain.begin(); it != chain.end(); ++it) {
+        if (it->proc == pfnSubclass && it->id == uIdSubclass) {
+            chain.erase(it);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+extern "C" LRESULT WINAPI DefSubclassProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    std::vector<FakeSubclassFrame>& frames = Process().subclassFrames;
+    if (frames.empty() || frames.back().hWnd != hWnd)
+        return FakeApplicationWindowProc(hWnd, uMsg, wParam, lParam);
+    return CallSubclass(hWnd, frames.back().position - 1, uMsg, wParam, lParam);
+}
+
+extern "C" HRESULT WINAPI SetWindowTheme(HWND hwnd, LPCWSTR pszSubAppName, LPCWSTR pszSubIdList) {
+    return GetFakeWindow(hwnd) ? S_OK : E_INVALIDARG;
+}
+
+// dwmapi and frame changes
+
+extern "C" HRESULT WINAPI DwmSetWindowAttribute(HWND hwnd, DWORD dwAttribute, LPCVOID pvAttribute,
+    DWORD cbAttribute) {
+    FakeWindow* window = GetFakeWindow(hwnd);
+    if (!window)
+        return E_INVALIDARG;
+
+    Spin(g_session->costs.dwmSetAttributeNs);
+    FakeProcessEntry* entry = CurrentProcessEntry();
+    if (entry) {
+        entry->dwmSetAttributeCalls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (dwAttribute == DWMWA_USE_IMMERSIVE_DARK_MODE && cbAttribute == sizeof(BOOL)) {
+        window->darkMode.store(*(const BOOL*)pvAttribute != FALSE, std::memory_order_release);
+        window->lastSetNs.store(FakeNowNs(), std::memory_order_relaxed);
+    } else if (dwAttribute == DWMWA_SYSTEMBACKDROP_TYPE && cbAttribute == sizeof(int)) {
+        window->backdrop.store(*(const int*)pvAttribute, std::memory_order_relaxed);
+    }
+    return S_OK;
+}
+
+extern "C" HRESULT WINAPI DwmGetWindowAttribute(HWND hwnd, DWORD dwAttribute, PVOID pvAttribute,
+    DWORD cbAttribute) {
+    FakeWindow* window = GetFakeWindow(hwnd);
+    if (!window || cbAttribute != sizeof(DWORD))
+        return E_INVALIDARG;
+
+    if (dwAttribute == DWMWA_USE_IMMERSIVE_DARK_MODE) {
+        *(BOOL*)pvAttribute = window->darkMode.load(std::memory_order_acquire);
+    } else if (dwAttribute == DWMWA_SYSTEMBACKDROP_TYPE) {
+        *(int*)pvAttribute = window->backdrop.load(std::memory_order_relaxed);
+    } else if (dwAttribute == DWMWA_CLOAKED) {
+        *(DWORD*)pvAttribute = 0;
+    } else {
+        return E_INVALIDARG;
+    }
+    return S_OK;
+}
+
+// The frame change costs the configured time, then the window gets its
+// WM_WINDOWPOSCHANGED: sent on the owner thread, or posted to it if async
+extern "C" BOOL WINAPI SetWindowPos(HWND hWnd, HWND hWndInsertAfter, int X, int Y, int cx, int cy,
+    UINT uFlags) {
+    FakeWindow* window = GetFakeWindow(hWnd);
+    if (!window)
+        return FALSE;
+
+    Spin(g_session->costs.setWindowPosNs);
+    FakeProcessEntry* entry = CurrentProcessEntry();
+    if (entry) {
+        entry->setWindowPosCalls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (IsOwnWindow(window)) {
+        if ((uFlags & SWP_ASYNCWINDOWPOS) && window->threadId != Process().currentThreadId) {
+            PostMessageW(hWnd, WM_WINDOWPOSCHANGED, 0, 0);
+        } else {
+            SendMessageW(hWnd, WM_WINDOWPOSCHANGED, 0, 0);
+        }
+    }
+    return TRUE;
+}
+
+// kernel32: processes, threads, modules
+
+extern "C" DWORD WINAPI GetCurrentProcessId() {
+    return Process().processId;
+}
+
+extern "C" DWORD WINAPI GetCurrentThreadId() {
+    return Process().currentThreadId;
+}
+
+extern "C" HANDLE WINAPI GetCurrentProcess() {
+    return (HANDLE)(LONG_PTR)-1;
+}
+
+extern "C" HANDLE WINAPI OpenProcess(DWORD dwDesiredAccess, BOOL bInheritHandle, DWORD dwProcessId) {
+    FakeProcessEntry* entry = FindProcess(dwProcessId);
+    if (!entry || !entry->running.load(std::memory_order_acquire)) {
+        Process().lastError = ERROR_INVALID_PARAMETER;
+        return nullptr;
+    }
+
+    FakeHandle* handle = new FakeHandle{};
+    handle->kind = FAKE_HANDLE_PROCESS;
+    handle->processId = dwProcessId;
+    return handle;
+}
+
+extern "C" BOOL WINAPI GetProcessTimes(HANDLE hProcess, PFILETIME lpCreationTime, PFILETIME lpExitTime,
+    PFILETIME lpKernelTime, PFILETIME lpUserTime) {
+    FakeProcessEntry* entry = hProcess == GetCurrentProcess() ? CurrentProcessEntry()
+        : FindProcess(((FakeHandle*)hProcess)->processId);
+    if (!entry)
+        return FALSE;
+
+    *lpCreationTime = { (DWORD)entry->startTime, (DWORD)(entry->startTime >> 32) };
+    *lpExitTime = {};
+    *lpKernelTime = {};
+    *lpUserTime = {};
+    return TRUE;
+}
+
+static DWORD FormatImagePath(DWORD processId, LPWSTR buffer, DWORD size) {
+    int length = swprintf(buffer, size, L"C:\\Program Files\\Bench\\app%u.exe",
+        (processId - FAKE_FIRST_PROCESS_ID) / 4);
+    return length < 0 ? 0 : (DWORD)length;
+}
+
+extern "C" BOOL WINAPI QueryFullProcessImageNameW(HANDLE hProcess, DWORD dwFlags, LPWSTR lpExeName,
+    PDWORD lpdwSize) {
+    DWORD length = FormatImagePath(((FakeHandle*)hProcess)->processId, lpExeName, *lpdwSize);
+    *lpdwSize = length;
+    return length != 0;
+}
+
+extern "C" DWORD WINAPI GetModuleFileNameW(HMODULE hModule, LPWSTR lpFilename, DWORD nSize) {
+    return hModule ? 0 : FormatImagePath(Process().processId, lpFilename, nSize);
+}
+
+extern "C" HANDLE WINAPI CreateThread(SECURITY_ATTRIBUTES* lpThreadAttributes, SIZE_T dwStackSize,
+    LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter, DWORD dwCreationFlags, LPDWORD lpThreadId) {
+    Process().lastError = ERROR_NOT_SUPPORTED;
+    return nullptr;
+}
+
+extern "C" HMODULE WINAPI GetModuleHandleW(LPCWSTR lpModuleName) {
+    return nullptr;
+}
+
+extern "C" FARPROC WINAPI GetProcAddress(HMODULE hModule, LPCSTR lpProcName) {
+    return nullptr;
+}
+
+extern "C" DWORD WINAPI GetLastError() {
+    return Process().lastError;
+}
+
+extern "C" BOOL WINAPI CloseHandle(HANDLE hObject) {
+    if (!hObject || hObject == GetCurrentProcess())
+        return FALSE;
+    delete (FakeHandle*)hObject;
+    return TRUE;
+}
+
+extern "C" HANDLE WINAPI LocalFree(HANDLE hMem) {
+    free(hMem);
+    return nullptr;
+}
+
+extern "C" BOOL WINAPI GetProcessMemoryInfo(HANDLE Process, PROCESS_MEMORY_COUNTERS* ppsmemCounters, DWORD cb) {
+    return FALSE;
+}
+
+// kernel32: synchronization and time
+
+extern "C" HANDLE WINAPI CreateEventW(SECURITY_ATTRIBUTES* lpEventAttributes, BOOL bManualReset,
+    BOOL bInitialState, LPCWSTR lpName) {
+    FakeHandle* handle = new FakeHandle{};
+    handle->kind = FAKE_HANDLE_EVENT;
+    if (!lpName) {
+        handle->signaled = &handle->localSignaled;
+        handle->manualReset = bManualReset;
+        handle->localSignaled = bInitialState ? 1 : 0;
+        return handle;
+    }
+
+    LockSession();
+    BOOL created;
+    FakeNamedObject* object = CreateNamedObject(lpName, FAKE_OBJECT_EVENT, &created);
+    if (object && created) {
+        object->manualReset = bManualReset;
+        object->signaled = bInitialState ? 1 : 0;
+    }
+    UnlockSession();
+    if (!object) {
+        delete handle;
+        Process().lastError = ERROR_NOT_ENOUGH_MEMORY;
+        return nullptr;
+    }
+
+    handle->signaled = &object->signaled;
+    handle->manualReset = object->manualReset;
+    Process().lastError = created ? ERROR_SUCCESS : ERROR_ALREADY_EXISTS;
+    return handle;
+}
+
+extern "C" BOOL WINAPI SetEvent(HANDLE hEvent) {
+    FakeHandle* handle = (FakeHandle*)hEvent;
+    if (handle->kind != FAKE_HANDLE_EVENT)
+        return FALSE;
+    handle->signaled->store(1, std::memory_order_release);
+    return TRUE;
+}
+
+// Never blocks, the fake processes are single threaded
+extern "C" DWORD WINAPI WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds) {
+    return IsSignaled((FakeHandle*)hHandle, TRUE) ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
+
+extern "C" BOOL WINAPI RegisterWaitForSingleObject(PHANDLE phNewWaitObject, HANDLE hObject,
+    WAITORTIMERCALLBACK Callback, PVOID Context, ULONG dwMilliseconds, ULONG dwFlags) {
+    FakeHandle* handle = (FakeHandle*)hObject;
+    if (!handle || (handle->kind != FAKE_HANDLE_EVENT && handle->kind != FAKE_HANDLE_PROCESS))
+        return FALSE;
+
+    FakeWait* wait = new FakeWait{ handle, Callback, Context, dwFlags, TRUE, FALSE };
+    Process().waits.push_back(wait);
+    *phNewWaitObject = wait;
+    return TRUE;
+}
+
+extern "C" BOOL WINAPI UnregisterWait(HANDLE WaitHandle) {
+    FakeWait* wait = (FakeWait*)WaitHandle;
+    wait->active = FALSE;
+    wait->unregistered = TRUE;
+    return TRUE;
+}
+
+// Callbacks run on the thread that pumps the process, so none is running
+// once the caller gets control back
+extern "C" BOOL WINAPI UnregisterWaitEx(HANDLE WaitHandle, HANDLE CompletionEvent) {
+    if (CompletionEvent && CompletionEvent != INVALID_HANDLE_VALUE) {
+        SetEvent(CompletionEvent);
+    }
+    return UnregisterWait(WaitHandle);
+}
+
+// SRW locks never wait: with one OS thread per fake process, a lock that is
+// taken can only mean a recursive acquire, which deadlocks on Windows. The
+// lock word holds the number of shared owners, or SRW_LOCK_EXCLUSIVE.
+#define SRW_LOCK_EXCLUSIVE ((PVOID)~(ULONG_PTR)0)
+
+static std::atomic_ref<PVOID> LockWord(PSRWLOCK SRWLock) {
+    return std::atomic_ref<PVOID>(SRWLock->Ptr);
+}
+
+static PVOID AddSharedOwners(PVOID value, LONG_PTR delta) {
+    return (PVOID)((ULONG_PTR)value + delta);
+}
+
+static VOID LockRecursion(const char* function) {
+    fprintf(stderr, "%s: recursive SRW lock acquire, this deadlocks on Windows\n", function);
+    abort();
+}
+
+extern "C" VOID WINAPI AcquireSRWLockExclusive(PSRWLOCK SRWLock) {
+    PVOID expected = nullptr;
+    if (!LockWord(SRWLock).compare_exchange_strong(expected, SRW_LOCK_EXCLUSIVE, std::memory_order_acquire))
+        LockRecursion(__func__);
+}
+
+extern "C" VOID WINAPI ReleaseSRWLockExclusive(PSRWLOCK SRWLock) {
+    LockWord(SRWLock).store(nullptr, std::memory_order_release);
+}
+
+extern "C" VOID WINAPI AcquireSRWLockShared(PSRWLOCK SRWLock) {
+    PVOID value = LockWord(SRWLock).load(std::memory_order_relaxed);
+    if (value == SRW_LOCK_EXCLUSIVE ||
+        !LockWord(SRWLock).compare_exchange_strong(value, AddSharedOwners(value, 1), std::memory_order_acquire))
+        LockRecursion(__func__);
+}
+
+extern "C" VOID WINAPI ReleaseSRWLockShared(PSRWLOCK SRWLock) {
+    PVOID value = LockWord(SRWLock).load(std::memory_order_relaxed);
+    while (!LockWord(SRWLock).compare_exchange_weak(value, AddSharedOwners(value, -1),
+        std::memory_order_release)) {
+    }
+}
+
+extern "C" BOOL WINAPI InitOnceExecuteOnce(PINIT_ONCE InitOnce, PINIT_ONCE_FN InitFn, PVOID Parameter,
+    LPVOID* Context) {
+    if (!InitOnce->Ptr) {
+        InitFn(InitOnce, Parameter, Context);
+        InitOnce->Ptr = (PVOID)1;
+    }
+    return TRUE;
+}
+
+extern "C" DWORD WINAPI GetTickCount() {
+    return (DWORD)(FakeNowNs() / 1000000);
+}
+
+extern "C" ULONGLONG WINAPI GetTickCount64() {
+    return FakeNowNs() / 1000000;
+}
+
+extern "C" BOOL WINAPI QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount) {
+    lpPerformanceCount->QuadPart = (LONGLONG)FakeNowNs();
+    return TRUE;
+}
+
+extern "C" BOOL WINAPI QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency) {
+    lpFrequency->QuadPart = 1000000000;
+    return TRUE;
+}
+
+extern "C" PTP_TIMER WINAPI CreateThreadpoolTimer(PTP_TIMER_CALLBACK pfnti, PVOID pv, PTP_CALLBACK_ENVIRON pcbe) {
+    PTP_TIMER timer = new TP_TIMER_{ pfnti, pv, FALSE, FALSE, 0, 0, 0 };
+    Process().timers.push_back(timer);
+    return timer;
+}
+
+// Due times are relative (negative, in 100 ns units) or 0 for now
+extern "C" VOID WINAPI SetThreadpoolTimer(PTP_TIMER pti, PFILETIME pftDueTime, DWORD msPeriod,
+    DWORD msWindowLength) {
+    if (!pftDueTime) {
+        pti->armed = FALSE;
+        return;
+    }
+
+    LONGLONG dueTime = (LONGLONG)(((ULONGLONG)pftDueTime->dwHighDateTime << 32) | pftDueTime->dwLowDateTime);
+    pti->dueNs = FakeNowNs() + (dueTime < 0 ? (ULONGLONG)-dueTime * 100 : 0);
+    pti->periodMs = msPeriod;
+    pti->armed = TRUE;
+}
+
+extern "C" VOID WINAPI WaitForThreadpoolTimerCallbacks(PTP_TIMER pti, BOOL fCancelPendingCallbacks) {
+    if (fCancelPendingCallbacks) {
+        pti->armed = FALSE;
+    }
+}
+
+extern "C" VOID WINAPI CloseThreadpoolTimer(PTP_TIMER pti) {
+    pti->armed = FALSE;
+    pti->closed = TRUE;
+}
+
+// kernel32: file mappings
+
+extern "C" HANDLE WINAPI CreateFileMappingW(HANDLE hFile, SECURITY_ATTRIBUTES* lpFileMappingAttributes,
+    DWORD flProtect, DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow, LPCWSTR lpName) {
+    size_t size = ((size_t)dwMaximumSizeHigh << 32) | dwMaximumSizeLow;
+    if (hFile != INVALID_HANDLE_VALUE || !lpName) {
+        Process().lastError = ERROR_NOT_SUPPORTED;
+        return nullptr;
+    }
+
+    LockSession();
+    BOOL created;
+    FakeNamedObject* object = CreateNamedObject(lpName, FAKE_OBJECT_SECTION, &created);
+    if (object && created) {
+        size_t offset = (g_session->sectionPoolUsed + 63) & ~(size_t)63;
+        if (offset + size > FAKE_SECTION_POOL_SIZE) {
+            object->kind = FAKE_OBJECT_FREE;
+            object = nullptr;
+        } else {
+            object->offset = offset;
+            object->size = size;
+            g_session->sectionPoolUsed = offset + size;
+        }
+    }
+    UnlockSession();
+    if (!object) {
+        Process().lastError = ERROR_NOT_ENOUGH_MEMORY;
+        return nullptr;
+    }
+
+    FakeHandle* handle = new FakeHandle{};
+    handle->kind = FAKE_HANDLE_SECTION;
+    handle->object = object;
+    Process().lastError = created ? ERROR_SUCCESS : ERROR_ALREADY_EXISTS;
+    return handle;
+}
+
+extern "C" HANDLE WINAPI OpenFileMappingW(DWORD dwDesiredAccess, BOOL bInheritHandle, LPCWSTR lpName) {
+    LockSession();
+    FakeNamedObject* object = FindNamedObject(lpName, FAKE_OBJECT_SECTION);
+    UnlockSession();
+    if (!object) {
+        Process().lastError = ERROR_FILE_NOT_FOUND;
+        return nullptr;
+    }
+
+    FakeHandle* handle = new FakeHandle{};
+    handle->kind = FAKE_HANDLE_SECTION;
+    handle->object = object;
+    return handle;
+}
+
+extern "C" LPVOID WINAPI MapViewOfFile(HANDLE hFileMappingObject, DWORD dwDesiredAccess,
+    DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap) {
+    FakeHandle* handle = (FakeHandle*)hFileMappingObject;
+    if (handle->kind != FAKE_HANDLE_SECTION || dwNumberOfBytesToMap > handle->object->size)
+        return nullptr;
+    return g_sectionPool + handle->object->offset;
+}
+
+extern "C" BOOL WINAPI UnmapViewOfFile(LPCVOID lpBaseAddress) {
+    return TRUE;
+}
+
+// advapi32
+
+extern "C" LSTATUS WINAPI RegOpenKeyExW(HKEY hKey, LPCWSTR lpSubKey, DWORD ulOptions, REGSAM samDesired,
+    PHKEY phkResult) {
+    if (hKey != HKEY_CURRENT_USER || _wcsicmp(lpSubKey, FAKE_PERSONALIZE_PATH) != 0)
+        return ERROR_FILE_NOT_FOUND;
+    *phkResult = FAKE_PERSONALIZE_KEY;
+    return ERROR_SUCCESS;
+}
+
+extern "C" LSTATUS WINAPI RegQueryValueExW(HKEY hKey, LPCWSTR lpValueName, LPDWORD lpReserved,
+    LPDWORD lpType, LPBYTE lpData, LPDWORD lpcbData) {
+    if (hKey != FAKE_PERSONALIZE_KEY || wcscmp(lpValueName, L"AppsUseLightTheme") != 0)
+        return ERROR_FILE_NOT_FOUND;
+
+    FakeProcessEntry* entry = CurrentProcessEntry();
+    if (entry) {
+        entry->registryReads.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (lpType) {
+        *lpType = REG_DWORD;
+    }
+    if (lpData) {
+        *(DWORD*)lpData = g_session->appsUseLightTheme.load(std::memory_order_relaxed);
+    }
+    if (lpcbData) {
+        *lpcbData = sizeof(DWORD);
+    }
+    return ERROR_SUCCESS;
+}
+
+extern "C" LSTATUS WINAPI RegCloseKey(HKEY hKey) {
+    return ERROR_SUCCESS;
+}
+
+// One notification on the next change of the value, whatever the filter
+extern "C" LSTATUS WINAPI RegNotifyChangeKeyValue(HKEY hKey, BOOL bWatchSubtree, DWORD dwNotifyFilter,
+    HANDLE hEvent, BOOL fAsynchronous) {
+    FakeHandle* handle = (FakeHandle*)hEvent;
+    if (hKey != FAKE_PERSONALIZE_KEY || !handle || handle->kind != FAKE_HANDLE_EVENT)
+        return ERROR_INVALID_HANDLE;
+    handle->registryArm = g_session->registryChanges.load(std::memory_order_acquire) + 1;
+    return ERROR_SUCCESS;
+}
+
+extern "C" BOOL WINAPI OpenProcessToken(HANDLE ProcessHandle, DWORD DesiredAccess, PHANDLE TokenHandle) {
+    FakeHandle* handle = new FakeHandle{};
+    handle->kind = FAKE_HANDLE_TOKEN;
+    *TokenHandle = handle;
+    return TRUE;
+}
+
+static BYTE g_fakeUserSid[16];
+
+extern "C" BOOL WINAPI GetTokenInformation(HANDLE TokenHandle, TOKEN_INFORMATION_CLASS TokenInformationClass,
+    LPVOID TokenInformation, DWORD TokenInformationLength, PDWORD ReturnLength) {
+    if (TokenInformationClass == TokenUser) {
+        *ReturnLength = sizeof(TOKEN_USER) + sizeof(g_fakeUserSid);
+        if (TokenInformationLength < *ReturnLength)
+            return FALSE;
+        TOKEN_USER* user = (TOKEN_USER*)TokenInformation;
+        user->User.Sid = g_fakeUserSid;
+        user->User.Attributes = 0;
+        return TRUE;
+    }
+    if (TokenInformationClass == TokenElevation) {
+        *ReturnLength = sizeof(TOKEN_ELEVATION);
+        if (TokenInformationLength < *ReturnLength)
+            return FALSE;
+        ((TOKEN_ELEVATION*)TokenInformation)->TokenIsElevated = 0;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+extern "C" BOOL WINAPI ConvertSidToStringSidW(PSID Sid, LPWSTR* StringSid) {
+    *StringSid = wcsdup(FAKE_USER_SID);
+    return *StringSid != nullptr;
+}
+
+extern "C" BOOL WINAPI ConvertStringSecurityDescriptorToSecurityDescriptorW(LPCWSTR StringSecurityDescriptor,
+    DWORD StringSDRevision, PSECURITY_DESCRIPTOR* SecurityDescriptor, ULONG* SecurityDescriptorSize) {
+    *SecurityDescriptor = malloc(1);
+    if (SecurityDescriptorSize) {
+        *SecurityDescriptorSize = 1;
+    }
+    return *SecurityDescriptor != nullptr;
+}
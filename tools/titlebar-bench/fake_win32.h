@@ -0,0 +1,60 @@
+// Control interface of the fake Win32 layer, used by the benchmark driver.
+//
+// A fake session is a shared arena mapped before any fake process is forked:
+// it holds the windows of all processes, the named kernel objects (sections
+// and events), the Personalize registry value and the process table. Each
+// fake process is a forked child running one copy of the mod on a single OS
+// thread; its UI threads are thread ids that the child switches between while
+// it pumps their message queues, runs due thread pool timers and fires
+// signaled waits.
+#pragma once
+
+#include <windows.h>
+
+// Costs of the calls that redraw a window frame on a real desktop
+struct FakeCosts {
+    ULONGLONG dwmSetAttributeNs;
+    ULONGLONG setWindowPosNs;
+};
+
+// Counters of one fake process, read by the driver
+struct FakeProcessCounters {
+    ULONGLONG dwmSetAttributeCalls;
+    ULONGLONG setWindowPosCalls;
+    ULONGLONG registryReads;
+};
+
+// Session, called by the driver before forking
+VOID FakeInitSession(size_t maxWindows, const FakeCosts& costs);
+VOID FakeSetSystemDarkMode(BOOL dark);
+VOID FakeSetSetting(PCWSTR name, PCWSTR value);
+VOID FakeSetIntSetting(PCWSTR name, int value);
+VOID FakeSetVerbose(BOOL verbose);
+
+// Process lifetime, called in the forked child. Thread 0 is the thread the
+// mod is loaded on; thread pool callbacks run on a thread of their own.
+DWORD FakeStartProcess(UINT index);
+VOID FakeExitProcess();
+DWORD FakeUiThreadId(UINT thread);
+VOID FakeSetCurrentThread(DWORD threadId);
+
+// Apply the hooks set with Wh_SetFunctionHook, as Windhawk does after Wh_ModInit
+VOID FakeApplyModHooks();
+
+// Run everything that is ready: signaled waits, due timers and the posted
+// messages of all threads. Returns FALSE if there was nothing to run.
+BOOL FakeRunPending();
+// Sleep until the next timer is due, at most maxNs
+VOID FakeIdle(ULONGLONG maxNs);
+ULONG FakeTimerCallbackCount(PTP_TIMER timer);
+
+// Windows, read across the session
+VOID FakeSetForegroundWindow(HWND hWnd);
+// Check whether every eligible top-level window of a running process has the
+// given dark mode attribute. lastSetNs receives the latest time the attribute
+// was set on any of them, pending the number that don't have it yet.
+BOOL FakeSessionConverged(BOOL dark, ULONGLONG* lastSetNs, ULONG* pending);
+VOID FakeGetProcessCounters(UINT index, FakeProcessCounters* counters);
+
+// Monotonic time in nanoseconds, the same clock in every fake process
+ULONGLONG FakeNowNs();